@@ -30,19 +30,88 @@
 #ifndef KAINJOW_MUSTACHE_HPP
 #define KAINJOW_MUSTACHE_HPP
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cctype>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <exception>
 #include <functional>
 #include <iostream>
+#include <iterator>
+#include <list>
 #include <memory>
+#include <mutex>
+#include <new>
 #include <sstream>
+#include <streambuf>
+#include <thread>
+#include <tuple>
+#include <type_traits>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 
+#if defined(__unix__) || defined(__APPLE__)
+#include <cerrno>
+#include <climits>
+#include <sys/types.h>
+#include <sys/uio.h>
+#endif
+
 #define KAINJOW_MUSTACHE_VERSION_MAJOR 5
 #define KAINJOW_MUSTACHE_VERSION_MINOR 0
 #define KAINJOW_MUSTACHE_VERSION_PATCH 0
 
+// Define KAINJOW_MUSTACHE_NO_SIMD to always use the portable scanning code.
+#if !defined(KAINJOW_MUSTACHE_NO_SIMD) && (defined(__x86_64__) || defined(_M_X64) || (defined(__i386__) && defined(__SSE2__)))
+#define KAINJOW_MUSTACHE_SSE2 1
+#include <emmintrin.h>
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#define KAINJOW_MUSTACHE_TARGET_AVX2
+#else
+#define KAINJOW_MUSTACHE_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+// basic_mustache::render_generator() needs C++20 coroutines
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L && defined(__has_include)
+#if __has_include(<coroutine>)
+#define KAINJOW_MUSTACHE_COROUTINES 1
+#include <coroutine>
+#endif
+#endif
+
+// Bound structs can have std::optional fields with C++17, strings can be
+// borrowed from a std::basic_string_view, and numbers are formatted with
+// std::to_chars where it supports floating point
+#if defined(__has_include) && (__cplusplus >= 201703L || (defined(_MSVC_LANG) && _MSVC_LANG >= 201703L))
+#if __has_include(<optional>)
+#define KAINJOW_MUSTACHE_OPTIONAL 1
+#include <optional>
+#endif
+#if __has_include(<string_view>)
+#include <string_view>
+#if defined(__cpp_lib_string_view)
+#define KAINJOW_MUSTACHE_STRING_VIEW 1
+#endif
+#endif
+#if __has_include(<charconv>)
+#include <charconv>
+#if defined(__cpp_lib_to_chars) && __cpp_lib_to_chars >= 201611L
+#define KAINJOW_MUSTACHE_TO_CHARS 1
+#endif
+#endif
+#endif
+
 namespace kainjow {
 namespace mustache {
 
@@ -60,43 +129,293 @@ string_type trim(const string_type& s) {
 }
 
 template <typename string_type>
-string_type html_escape(const string_type& s) {
-    string_type ret;
-    ret.reserve(s.size()*2);
-    for (const auto ch : s) {
-        switch (ch) {
+std::vector<string_type> split(const string_type& s, typename string_type::value_type delim) {
+    std::vector<string_type> elems;
+    std::basic_stringstream<typename string_type::value_type> ss(s);
+    string_type item;
+    while (std::getline(ss, item, delim)) {
+        elems.push_back(item);
+    }
+    return elems;
+}
+
+// A non-owning reference to a run of characters, typically inside the source
+// text kept by basic_mustache.
+template <typename string_type>
+class text_view {
+public:
+    using value_type = typename string_type::value_type;
+    using size_type = typename string_type::size_type;
+
+    text_view() {}
+    text_view(const value_type* data, size_type size) : data_(data), size_(size) {}
+
+    const value_type* data() const { return data_; }
+    size_type size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+    const value_type* begin() const { return data_; }
+    const value_type* end() const { return data_ + size_; }
+    value_type operator[](size_type i) const { return data_[i]; }
+
+    string_type str() const {
+        return string_type(data_, size_);
+    }
+
+    bool operator==(const text_view& other) const {
+        return size_ == other.size_ && std::equal(data_, data_ + size_, other.data_);
+    }
+    bool operator==(const string_type& s) const {
+        return *this == text_view(s.data(), s.size());
+    }
+    bool operator==(const value_type* s) const {
+        return *this == text_view(s, std::char_traits<value_type>::length(s));
+    }
+    template <typename T>
+    bool operator!=(const T& other) const {
+        return !(*this == other);
+    }
+
+private:
+    const value_type* data_ = nullptr;
+    size_type size_ = 0;
+};
+
+template <typename string_type>
+text_view<string_type> trim(const text_view<string_type>& s) {
+    auto first = s.begin();
+    auto last = s.end();
+    while (first != last && std::isspace(*first)) {
+        first++;
+    }
+    while (last != first && std::isspace(*(last - 1))) {
+        last--;
+    }
+    return {first, static_cast<typename string_type::size_type>(last - first)};
+}
+
+// Searches [s, s + n) for any of the five characters in chars and returns the
+// offset of the first match, or n if there is none. The char overload scans
+// 16 or 32 bytes at a time with SSE2/AVX2, picked once at runtime.
+template <typename char_type>
+std::size_t find_first_of_any_scalar(const char_type* s, std::size_t n, const char_type (&chars)[5]) {
+    for (std::size_t i = 0; i < n; ++i) {
+        const char_type ch = s[i];
+        if (ch == chars[0] || ch == chars[1] || ch == chars[2] || ch == chars[3] || ch == chars[4]) {
+            return i;
+        }
+    }
+    return n;
+}
+
+template <typename char_type>
+std::size_t find_first_of_any(const char_type* s, std::size_t n, const char_type (&chars)[5]) {
+    return find_first_of_any_scalar(s, n, chars);
+}
+
+// Searches [s, s + n) for the first character that ends a run of plain JSON
+// string text: a quote, a backslash, or a control character, which JSON
+// doesn't allow unescaped. Returns n if there is none.
+template <typename char_type>
+std::size_t find_json_string_special_scalar(const char_type* s, std::size_t n) {
+    using unsigned_type = typename std::make_unsigned<char_type>::type;
+    for (std::size_t i = 0; i < n; ++i) {
+        const char_type ch = s[i];
+        if (ch == '"' || ch == '\\' || static_cast<unsigned_type>(ch) < 0x20) {
+            return i;
+        }
+    }
+    return n;
+}
+
+template <typename char_type>
+std::size_t find_json_string_special(const char_type* s, std::size_t n) {
+    return find_json_string_special_scalar(s, n);
+}
+
+#if defined(KAINJOW_MUSTACHE_SSE2)
+
+inline unsigned count_trailing_zeros(unsigned mask) {
+#if defined(_MSC_VER) && !defined(__clang__)
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return static_cast<unsigned>(index);
+#else
+    return static_cast<unsigned>(__builtin_ctz(mask));
+#endif
+}
+
+inline bool cpu_supports_avx2() {
+#if defined(_MSC_VER) && !defined(__clang__)
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7) {
+        return false;
+    }
+    __cpuid(info, 1);
+    // OSXSAVE and AVX, and the OS must be saving the YMM registers
+    if ((info[2] & (1 << 27)) == 0 || (info[2] & (1 << 28)) == 0 || (_xgetbv(0) & 6) != 6) {
+        return false;
+    }
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    return __builtin_cpu_supports("avx2") != 0;
+#endif
+}
+
+inline std::size_t find_first_of_any_sse2(const char* s, std::size_t n, const char (&chars)[5]) {
+    const __m128i c0 = _mm_set1_epi8(chars[0]);
+    const __m128i c1 = _mm_set1_epi8(chars[1]);
+    const __m128i c2 = _mm_set1_epi8(chars[2]);
+    const __m128i c3 = _mm_set1_epi8(chars[3]);
+    const __m128i c4 = _mm_set1_epi8(chars[4]);
+    std::size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+        const __m128i m = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(v, c0), _mm_cmpeq_epi8(v, c1)),
+            _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, c2), _mm_cmpeq_epi8(v, c3)), _mm_cmpeq_epi8(v, c4)));
+        const unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(m));
+        if (mask != 0) {
+            return i + count_trailing_zeros(mask);
+        }
+    }
+    return i + find_first_of_any_scalar(s + i, n - i, chars);
+}
+
+KAINJOW_MUSTACHE_TARGET_AVX2
+inline std::size_t find_first_of_any_avx2(const char* s, std::size_t n, const char (&chars)[5]) {
+    const __m256i c0 = _mm256_set1_epi8(chars[0]);
+    const __m256i c1 = _mm256_set1_epi8(chars[1]);
+    const __m256i c2 = _mm256_set1_epi8(chars[2]);
+    const __m256i c3 = _mm256_set1_epi8(chars[3]);
+    const __m256i c4 = _mm256_set1_epi8(chars[4]);
+    std::size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + i));
+        const __m256i m = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, c0), _mm256_cmpeq_epi8(v, c1)),
+            _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, c2), _mm256_cmpeq_epi8(v, c3)), _mm256_cmpeq_epi8(v, c4)));
+        const unsigned mask = static_cast<unsigned>(_mm256_movemask_epi8(m));
+        if (mask != 0) {
+            return i + count_trailing_zeros(mask);
+        }
+    }
+    return i + find_first_of_any_sse2(s + i, n - i, chars);
+}
+
+inline std::size_t find_first_of_any(const char* s, std::size_t n, const char (&chars)[5]) {
+    using kernel = std::size_t (*)(const char*, std::size_t, const char (&)[5]);
+    static const kernel k = cpu_supports_avx2() ? find_first_of_any_avx2 : find_first_of_any_sse2;
+    return k(s, n, chars);
+}
+
+inline std::size_t find_json_string_special_sse2(const char* s, std::size_t n) {
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i control = _mm_set1_epi8(0x1F);
+    std::size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+        // bytes up to 0x1F are unchanged by an unsigned max with 0x1F
+        const __m128i m = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash)),
+            _mm_cmpeq_epi8(_mm_max_epu8(v, control), control));
+        const unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(m));
+        if (mask != 0) {
+            return i + count_trailing_zeros(mask);
+        }
+    }
+    return i + find_json_string_special_scalar(s + i, n - i);
+}
+
+KAINJOW_MUSTACHE_TARGET_AVX2
+inline std::size_t find_json_string_special_avx2(const char* s, std::size_t n) {
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i backslash = _mm256_set1_epi8('\\');
+    const __m256i control = _mm256_set1_epi8(0x1F);
+    std::size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + i));
+        const __m256i m = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, quote), _mm256_cmpeq_epi8(v, backslash)),
+            _mm256_cmpeq_epi8(_mm256_max_epu8(v, control), control));
+        const unsigned mask = static_cast<unsigned>(_mm256_movemask_epi8(m));
+        if (mask != 0) {
+            return i + count_trailing_zeros(mask);
+        }
+    }
+    return i + find_json_string_special_sse2(s + i, n - i);
+}
+
+inline std::size_t find_json_string_special(const char* s, std::size_t n) {
+    using kernel = std::size_t (*)(const char*, std::size_t);
+    static const kernel k = cpu_supports_avx2() ? find_json_string_special_avx2 : find_json_string_special_sse2;
+    return k(s, n);
+}
+
+#endif // KAINJOW_MUSTACHE_SSE2
+
+// The characters replaced by html_escape
+template <typename char_type>
+const char_type (&html_escape_chars())[5] {
+    static const char_type chars[5] = {'&', '<', '>', '\"', '\''};
+    return chars;
+}
+
+// Appends [s, s + n) to out with the characters that are special in HTML
+// replaced by entities. Runs of other characters are found with
+// find_first_of_any and appended in one go. out is a string or an output
+// sink, anything with append(const value_type*, std::size_t).
+template <typename output_type>
+void html_escape_append(const typename output_type::value_type* s, std::size_t n, output_type& out) {
+    using char_type = typename output_type::value_type;
+    static const char_type amp[] = {'&','a','m','p',';'};
+    static const char_type lt[] = {'&','l','t',';'};
+    static const char_type gt[] = {'&','g','t',';'};
+    static const char_type quot[] = {'&','q','u','o','t',';'};
+    static const char_type apos[] = {'&','a','p','o','s',';'};
+    std::size_t pos = 0;
+    while (pos < n) {
+        const std::size_t run = find_first_of_any(s + pos, n - pos, html_escape_chars<char_type>());
+        out.append(s + pos, run);
+        pos += run;
+        if (pos == n) {
+            break;
+        }
+        switch (s[pos]) {
             case '&':
-                ret.append({'&','a','m','p',';'});
+                out.append(amp, sizeof(amp) / sizeof(char_type));
                 break;
             case '<':
-                ret.append({'&','l','t',';'});
+                out.append(lt, sizeof(lt) / sizeof(char_type));
                 break;
             case '>':
-                ret.append({'&','g','t',';'});
+                out.append(gt, sizeof(gt) / sizeof(char_type));
                 break;
             case '\"':
-                ret.append({'&','q','u','o','t',';'});
-                break;
-            case '\'':
-                ret.append({'&','a','p','o','s',';'});
+                out.append(quot, sizeof(quot) / sizeof(char_type));
                 break;
             default:
-                ret.append(1, ch);
+                out.append(apos, sizeof(apos) / sizeof(char_type));
                 break;
         }
+        ++pos;
     }
-    return ret;
 }
 
 template <typename string_type>
-std::vector<string_type> split(const string_type& s, typename string_type::value_type delim) {
-    std::vector<string_type> elems;
-    std::basic_stringstream<typename string_type::value_type> ss(s);
-    string_type item;
-    while (std::getline(ss, item, delim)) {
-        elems.push_back(item);
+string_type html_escape(const string_type& s) {
+    using char_type = typename string_type::value_type;
+    const std::size_t first = find_first_of_any(s.data(), s.size(), html_escape_chars<char_type>());
+    if (first == s.size()) {
+        return s;
     }
-    return elems;
+    string_type ret;
+    ret.reserve(s.size() + s.size() / 4 + 8);
+    ret.append(s.data(), first);
+    html_escape_append(s.data() + first, s.size() - first, ret);
+    return ret;
 }
 
 template <typename string_type>
@@ -163,10 +482,210 @@ private:
     std::unique_ptr<type2> type2_;
 };
 
+// Remembers the slot of a shape (see basic_shape) a tag's key was last found
+// in, so objects of the same shape skip the hash lookup. The shape's id and
+// the slot share one atomic word, so templates can still be rendered by many
+// threads at once.
+class shape_cache {
+public:
+    shape_cache() {}
+    shape_cache(const shape_cache& other) : value_{other.value_.load(std::memory_order_relaxed)} {}
+    shape_cache& operator= (const shape_cache& other) {
+        value_.store(other.value_.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        return *this;
+    }
+
+    bool find(std::uint32_t shape_id, std::size_t& slot) const {
+        const std::uint64_t value = value_.load(std::memory_order_relaxed);
+        if (shape_id == 0 || static_cast<std::uint32_t>(value >> 32) != shape_id) {
+            return false;
+        }
+        slot = static_cast<std::size_t>(value & 0xFFFFFFFFu);
+        return true;
+    }
+
+    void remember(std::uint32_t shape_id, std::size_t slot) const {
+        if (shape_id != 0 && slot <= 0xFFFFFFFFu) {
+            value_.store((static_cast<std::uint64_t>(shape_id) << 32) | slot, std::memory_order_relaxed);
+        }
+    }
+
+private:
+    mutable std::atomic<std::uint64_t> value_{0};
+};
+
+// One dot-separated part of a tag name, hashed once when the template is
+// parsed.
+template <typename string_type>
+class tag_key {
+public:
+    string_type name;
+    std::size_t hash = 0;
+    shape_cache shape;
+
+    tag_key() {}
+    explicit tag_key(const string_type& n) : name(n), hash(std::hash<string_type>{}(n)) {}
+};
+
+// A tag name split into its keys, so dotted names aren't split on every
+// lookup. "." has no keys and refers to the current context.
+template <typename string_type>
+class tag_path {
+public:
+    tag_path() {}
+
+    explicit tag_path(string_type name) : name_(std::move(name)) {
+        if (name_.size() == 1 && name_[0] == '.') {
+            return;
+        }
+        if (name_.find('.') == string_type::npos) {
+            keys_.emplace_back(name_);
+            return;
+        }
+        // Same parts as split(name, '.')
+        typename string_type::size_type start = 0;
+        while (start < name_.size()) {
+            auto end = name_.find('.', start);
+            if (end == string_type::npos) {
+                end = name_.size();
+            }
+            keys_.emplace_back(name_.substr(start, end - start));
+            start = end + 1;
+        }
+    }
+
+    const string_type& name() const {
+        return name_;
+    }
+
+    const std::vector<tag_key<string_type>>& keys() const {
+        return keys_;
+    }
+
+    bool is_dot() const {
+        return keys_.empty() && !name_.empty();
+    }
+
+private:
+    string_type name_;
+    std::vector<tag_key<string_type>> keys_;
+};
+
+// Hash and equality for basic_object that also accept a tag_key, which
+// carries its hash. With heterogeneous lookup (C++20) finding a tag_key
+// doesn't hash the name again.
+template <typename string_type>
+class object_hash {
+public:
+    using is_transparent = void;
+    std::size_t operator()(const string_type& name) const {
+        return std::hash<string_type>{}(name);
+    }
+    std::size_t operator()(const tag_key<string_type>& key) const {
+        return key.hash;
+    }
+};
+
+template <typename string_type>
+class object_equal {
+public:
+    using is_transparent = void;
+    bool operator()(const string_type& a, const string_type& b) const {
+        return a == b;
+    }
+    bool operator()(const tag_key<string_type>& a, const string_type& b) const {
+        return a.name == b;
+    }
+    bool operator()(const string_type& a, const tag_key<string_type>& b) const {
+        return a == b.name;
+    }
+};
+
+// The keys shared by objects that all have the same keys, like the rows of
+// a table. Each key has a slot, and objects made from the shape (see
+// basic_data's shape constructors) store only their values, in slot order,
+// instead of every object having its own hash table of keys.
+template <typename string_type>
+class basic_shape {
+public:
+    static const std::size_t npos = static_cast<std::size_t>(-1);
+
+    // Repeated keys use the first slot
+    explicit basic_shape(std::vector<string_type> keys) : keys_(std::move(keys)) {
+        slots_.reserve(keys_.size());
+        for (std::size_t i = 0; i < keys_.size(); ++i) {
+            slots_.emplace(keys_[i], i);
+        }
+        // ids are never reused, so a cached id can't match a newer shape
+        static std::atomic<std::uint32_t> next_id{1};
+        std::uint32_t id = next_id.load(std::memory_order_relaxed);
+        while (id != 0 && !next_id.compare_exchange_weak(id, id + 1, std::memory_order_relaxed)) {
+        }
+        id_ = id;
+    }
+
+    basic_shape(const basic_shape&) = delete;
+    basic_shape& operator= (const basic_shape&) = delete;
+
+    static std::shared_ptr<const basic_shape> make(std::vector<string_type> keys) {
+        return std::make_shared<const basic_shape>(std::move(keys));
+    }
+
+    const std::vector<string_type>& keys() const {
+        return keys_;
+    }
+
+    std::size_t size() const {
+        return keys_.size();
+    }
+
+    // The slot of key, or npos
+    std::size_t find(const string_type& key) const {
+        const auto it = slots_.find(key);
+        return it == slots_.end() ? npos : it->second;
+    }
+
+    // The slot of a tag's key, remembered in the key for the next lookup
+    std::size_t find(const tag_key<string_type>& key) const {
+        std::size_t slot;
+        if (key.shape.find(id_, slot)) {
+            return slot;
+        }
+#if defined(__cpp_lib_generic_unordered_lookup)
+        const auto it = slots_.find(key);
+#else
+        const auto it = slots_.find(key.name);
+#endif
+        if (it == slots_.end()) {
+            return npos;
+        }
+        key.shape.remember(id_, it->second);
+        return it->second;
+    }
+
+    // Identifies the shape in caches. 0 once more than 2^32 shapes have been
+    // made, which turns caching off for them.
+    std::uint32_t id() const {
+        return id_;
+    }
+
+private:
+    std::vector<string_type> keys_;
+    std::unordered_map<string_type, std::size_t, object_hash<string_type>, object_equal<string_type>> slots_;
+    std::uint32_t id_;
+};
+
+template <typename string_type>
+const std::size_t basic_shape<string_type>::npos;
+
 template <typename string_type>
 class basic_data;
 template <typename string_type>
-using basic_object = std::unordered_map<string_type, basic_data<string_type>>;
+class basic_record;
+template <typename char_type>
+class json_entry;
+template <typename string_type>
+using basic_object = std::unordered_map<string_type, basic_data<string_type>, object_hash<string_type>, object_equal<string_type>>;
 template <typename string_type>
 using basic_list = std::vector<basic_data<string_type>>;
 template <typename string_type>
@@ -176,6 +695,51 @@ using basic_lambda = typename basic_lambda_t<string_type>::type1;
 template <typename string_type>
 using basic_lambda2 = typename basic_lambda_t<string_type>::type2;
 
+// A list whose items are pulled one at a time while a section renders it,
+// so they don't all have to be in memory. Each time the list is rendered
+// the basic_lazy_list is called for a new source. The source stores the
+// next item in its argument, which still holds the previous item so it can
+// be updated in place, and returns true, or returns false after the last
+// item. Inverted sections only pull the first item, and the next section on
+// the list starts from it rather than opening a new source.
+template <typename string_type>
+using basic_list_source = std::function<bool(basic_data<string_type>& item)>;
+template <typename string_type>
+using basic_lazy_list = std::function<basic_list_source<string_type>()>;
+
+// A field of a struct bound with KAINJOW_MUSTACHE_FIELDS: its name, where
+// it is in the struct, and how to turn its value into data.
+template <typename string_type>
+class basic_field {
+public:
+    const char* name;
+    std::size_t size;
+    const void* (*address)(const void* object);
+    void (*make)(const void* field, basic_data<string_type>& out);
+};
+
+// The fields of a bound struct, generated by KAINJOW_MUSTACHE_FIELDS. Objects
+// whose fields are only known at runtime, like JSON objects, set lookup
+// instead, which returns the named field's address and how to make it, or
+// nullptr if there's no such field.
+template <typename string_type>
+class basic_binding {
+public:
+    const basic_field<string_type>* fields;
+    std::size_t size;
+    const void* (*lookup)(const void* object, const string_type& name, void (*&make)(const void* field, basic_data<string_type>& out));
+
+    const basic_field<string_type>* find(const string_type& name) const {
+        for (std::size_t i = 0; i < size; ++i) {
+            const auto& field = fields[i];
+            if (field.size == name.size() && std::equal(name.begin(), name.end(), field.name)) {
+                return &field;
+            }
+        }
+        return nullptr;
+    }
+};
+
 template <typename string_type>
 class basic_data {
 public:
@@ -188,6 +752,13 @@ public:
         partial,
         lambda,
         lambda2,
+        bound,
+        lazy_list,
+        borrowed_string,
+        int64,
+        uint64,
+        float64,
+        record,
         invalid,
     };
 
@@ -195,112 +766,253 @@ public:
     basic_data() : basic_data(type::object) {
     }
     basic_data(const string_type& string) : type_{type::string} {
-        str_.reset(new string_type(string));
+        new (&str_) string_type(string);
+    }
+    basic_data(string_type&& string) noexcept : type_{type::string} {
+        new (&str_) string_type(std::move(string));
     }
     basic_data(const typename string_type::value_type* string) : type_{type::string} {
-        str_.reset(new string_type(string));
+        new (&str_) string_type(string);
     }
     basic_data(const basic_object<string_type>& obj) : type_{type::object} {
-        obj_.reset(new basic_object<string_type>(obj));
+        obj_ = obj.empty() ? nullptr : new basic_object<string_type>(obj);
+    }
+    basic_data(basic_object<string_type>&& obj) : type_{type::object} {
+        obj_ = obj.empty() ? nullptr : new basic_object<string_type>(std::move(obj));
     }
     basic_data(const basic_list<string_type>& l) : type_{type::list} {
-        list_.reset(new basic_list<string_type>(l));
+        list_ = l.empty() ? nullptr : new basic_list<string_type>(l);
+    }
+    basic_data(basic_list<string_type>&& l) : type_{type::list} {
+        list_ = l.empty() ? nullptr : new basic_list<string_type>(std::move(l));
+    }
+    // An object with shape's keys and no values yet. It only stores a value
+    // per key, so objects made from one shape share the keys. Setting a key
+    // the shape doesn't have turns it into an ordinary object.
+    basic_data(std::shared_ptr<const basic_shape<string_type>> shape) : basic_data(std::move(shape), basic_list<string_type>{}) {
+    }
+    // Same, with values for the keys in the shape's order. Values beyond the
+    // shape's keys are dropped, and missing ones are unset.
+    basic_data(std::shared_ptr<const basic_shape<string_type>> shape, basic_list<string_type> values) : type_{type::record} {
+        values.resize(shape->size(), basic_data{type::invalid});
+        record_ = new basic_record<string_type>{std::move(shape), std::move(values)};
     }
     basic_data(type t) : type_{t} {
         switch (type_) {
-            case type::object:
-                obj_.reset(new basic_object<string_type>);
-                break;
             case type::string:
-                str_.reset(new string_type);
+                new (&str_) string_type;
                 break;
-            case type::list:
-                list_.reset(new basic_list<string_type>);
+            case type::borrowed_string:
+                borrowed_.data = nullptr;
+                borrowed_.size = 0;
+                break;
+            case type::int64:
+                int64_ = 0;
+                break;
+            case type::uint64:
+                uint64_ = 0;
+                break;
+            case type::float64:
+                float64_ = 0;
+                break;
+            case type::record:
+                record_ = nullptr;
                 break;
             default:
+                // Objects and lists are allocated when something is added.
+                // Partials and lambdas have no value.
+                obj_ = nullptr;
                 break;
         }
     }
     basic_data(const string_type& name, const basic_data& var) : basic_data{} {
         set(name, var);
     }
+    basic_data(const string_type& name, basic_data&& var) : basic_data{} {
+        set(name, std::move(var));
+    }
     basic_data(const basic_partial<string_type>& p) : type_{type::partial} {
-        partial_.reset(new basic_partial<string_type>(p));
+        partial_ = new basic_partial<string_type>(p);
+    }
+    basic_data(const basic_lazy_list<string_type>& l) : type_{type::lazy_list} {
+        lazy_list_ = new basic_lazy_list<string_type>(l);
     }
     basic_data(const basic_lambda<string_type>& l) : type_{type::lambda} {
-        lambda_.reset(new basic_lambda_t<string_type>(l));
+        lambda_ = new basic_lambda_t<string_type>(l);
     }
     basic_data(const basic_lambda2<string_type>& l) : type_{type::lambda2} {
-        lambda_.reset(new basic_lambda_t<string_type>(l));
+        lambda_ = new basic_lambda_t<string_type>(l);
     }
-    basic_data(const basic_lambda_t<string_type>& l) {
+    basic_data(const basic_lambda_t<string_type>& l) : type_{type::invalid} {
         if (l.is_type1()) {
             type_ = type::lambda;
         } else if (l.is_type2()) {
             type_ = type::lambda2;
         }
-        lambda_.reset(new basic_lambda_t<string_type>(l));
+        if (type_ != type::invalid) {
+            lambda_ = new basic_lambda_t<string_type>(l);
+        }
     }
     basic_data(bool b) : type_{b ? type::bool_true : type::bool_false} {
     }
+    // Other numbers convert to bool, as they always have: zero is false and
+    // anything else is true. Use number() for a value that renders as the
+    // number.
+    template <typename T, typename std::enable_if<(std::is_integral<T>::value || std::is_floating_point<T>::value) && !std::is_same<T, bool>::value && !std::is_same<T, char>::value && !std::is_same<T, wchar_t>::value, int>::type = 0>
+    basic_data(T value) : type_{value != 0 ? type::bool_true : type::bool_false} {
+    }
+    // Refers to object, which has the given fields. Use bind() instead.
+    basic_data(const void* object, const basic_binding<string_type>& binding) : type_{type::bound} {
+        bound_.object = object;
+        bound_.binding = &binding;
+    }
+
+    // Refers to a struct whose fields are listed with KAINJOW_MUSTACHE_FIELDS,
+    // so it can be rendered without copying it into data. Fields are read as
+    // the template asks for them. The struct must outlive the data.
+    template <typename T>
+    static basic_data bind(const T& object) {
+        return basic_data{&object, mustache_fields(&object, static_cast<const string_type*>(nullptr))};
+    }
+    template <typename T>
+    static basic_data bind(const T&& object) = delete;
+
+    // Refers to a string owned by someone else instead of copying it. The
+    // string must stay unchanged at the same address for as long as the data
+    // is rendered, and for as long as a fragment_sink it was rendered into
+    // is used. It renders and escapes the same as an owned string.
+    static basic_data borrow(const typename string_type::value_type* data, std::size_t size) {
+        basic_data borrowed{type::borrowed_string};
+        borrowed.borrowed_.data = data;
+        borrowed.borrowed_.size = size;
+        return borrowed;
+    }
+    static basic_data borrow(const string_type& string) {
+        return borrow(string.data(), string.size());
+    }
+    static basic_data borrow(const string_type&& string) = delete;
+#if defined(KAINJOW_MUSTACHE_STRING_VIEW)
+    static basic_data borrow(std::basic_string_view<typename string_type::value_type, typename string_type::traits_type> string) {
+        return borrow(string.data(), string.size());
+    }
+#endif
+
+    // A number stored as int64, uint64 or float64 and formatted when it's
+    // rendered. Like strings, numbers (zero included) render sections once.
+    template <typename T, typename std::enable_if<std::is_integral<T>::value && std::is_signed<T>::value && !std::is_same<T, char>::value && !std::is_same<T, wchar_t>::value, int>::type = 0>
+    static basic_data number(T value) {
+        basic_data data{type::int64};
+        data.int64_ = value;
+        return data;
+    }
+    template <typename T, typename std::enable_if<std::is_integral<T>::value && std::is_unsigned<T>::value && !std::is_same<T, bool>::value && !std::is_same<T, char>::value && !std::is_same<T, wchar_t>::value, int>::type = 0>
+    static basic_data number(T value) {
+        basic_data data{type::uint64};
+        data.uint64_ = value;
+        return data;
+    }
+    template <typename T, typename std::enable_if<std::is_floating_point<T>::value, int>::type = 0>
+    static basic_data number(T value) {
+        basic_data data{type::float64};
+        data.float64_ = static_cast<double>(value);
+        return data;
+    }
+
+    // A string that only lives as long as the render. Sinks get a copy of it
+    // rather than a reference.
+    static basic_data temporary(string_type&& string) {
+        basic_data data{std::move(string)};
+        data.temporary_ = true;
+        return data;
+    }
+
+    // Parses JSON into data that can be changed afterwards: objects, lists,
+    // strings, bools, and numbers as int64, uint64 or float64. null is false.
+    // Each object and list is sized from the parsed document before it's
+    // filled. Returns invalid data if the JSON isn't valid, with the reason
+    // in error_message if it's given.
+    static basic_data from_json(const typename string_type::value_type* text, std::size_t size, string_type* error_message = nullptr);
+    static basic_data from_json(const string_type& text, string_type* error_message = nullptr) {
+        return from_json(text.data(), text.size(), error_message);
+    }
+#if defined(KAINJOW_MUSTACHE_STRING_VIEW)
+    static basic_data from_json(std::basic_string_view<typename string_type::value_type, typename string_type::traits_type> text, string_type* error_message = nullptr) {
+        return from_json(text.data(), text.size(), error_message);
+    }
+#endif
+
+    ~basic_data() {
+        destroy();
+    }
 
     // Copying
-    basic_data(const basic_data& dat) : type_(dat.type_) {
-        if (dat.obj_) {
-            obj_.reset(new basic_object<string_type>(*dat.obj_));
-        } else if (dat.str_) {
-            str_.reset(new string_type(*dat.str_));
-        } else if (dat.list_) {
-            list_.reset(new basic_list<string_type>(*dat.list_));
-        } else if (dat.partial_) {
-            partial_.reset(new basic_partial<string_type>(*dat.partial_));
-        } else if (dat.lambda_) {
-            lambda_.reset(new basic_lambda_t<string_type>(*dat.lambda_));
+    basic_data(const basic_data& dat) : type_(dat.type_), temporary_(dat.temporary_) {
+        switch (type_) {
+            case type::object:
+                obj_ = dat.obj_ ? new basic_object<string_type>(*dat.obj_) : nullptr;
+                break;
+            case type::string:
+                new (&str_) string_type(dat.str_);
+                break;
+            case type::list:
+                list_ = dat.list_ ? new basic_list<string_type>(*dat.list_) : nullptr;
+                break;
+            case type::partial:
+                partial_ = dat.partial_ ? new basic_partial<string_type>(*dat.partial_) : nullptr;
+                break;
+            case type::lazy_list:
+                lazy_list_ = dat.lazy_list_ ? new basic_lazy_list<string_type>(*dat.lazy_list_) : nullptr;
+                break;
+            case type::lambda:
+            case type::lambda2:
+                lambda_ = dat.lambda_ ? new basic_lambda_t<string_type>(*dat.lambda_) : nullptr;
+                break;
+            case type::bound:
+                bound_ = dat.bound_;
+                break;
+            case type::borrowed_string:
+                borrowed_ = dat.borrowed_;
+                break;
+            case type::int64:
+                int64_ = dat.int64_;
+                break;
+            case type::uint64:
+                uint64_ = dat.uint64_;
+                break;
+            case type::float64:
+                float64_ = dat.float64_;
+                break;
+            case type::record:
+                record_ = dat.record_ ? new basic_record<string_type>(*dat.record_) : nullptr;
+                break;
+            default:
+                break;
         }
     }
 
-    // Move
-    basic_data(basic_data&& dat) : type_{dat.type_} {
-        if (dat.obj_) {
-            obj_ = std::move(dat.obj_);
-        } else if (dat.str_) {
-            str_ = std::move(dat.str_);
-        } else if (dat.list_) {
-            list_ = std::move(dat.list_);
-        } else if (dat.partial_) {
-            partial_ = std::move(dat.partial_);
-        } else if (dat.lambda_) {
-            lambda_ = std::move(dat.lambda_);
+    basic_data& operator= (const basic_data& dat) {
+        if (this != &dat) {
+            basic_data copy{dat};
+            *this = std::move(copy);
         }
-        dat.type_ = type::invalid;
+        return *this;
+    }
+
+    // Move
+    basic_data(basic_data&& dat) noexcept : type_{type::invalid} {
+        take(dat);
     }
-    basic_data& operator= (basic_data&& dat) {
+    basic_data& operator= (basic_data&& dat) noexcept {
         if (this != &dat) {
-            obj_.reset();
-            str_.reset();
-            list_.reset();
-            partial_.reset();
-            lambda_.reset();
-            if (dat.obj_) {
-                obj_ = std::move(dat.obj_);
-            } else if (dat.str_) {
-                str_ = std::move(dat.str_);
-            } else if (dat.list_) {
-                list_ = std::move(dat.list_);
-            } else if (dat.partial_) {
-                partial_ = std::move(dat.partial_);
-            } else if (dat.lambda_) {
-                lambda_ = std::move(dat.lambda_);
-            }
-            type_ = dat.type_;
-            dat.type_ = type::invalid;
+            destroy();
+            take(dat);
         }
         return *this;
     }
 
     // Type info
     bool is_object() const {
-        return type_ == type::object;
+        return type_ == type::object || type_ == type::record;
     }
     bool is_string() const {
         return type_ == type::string;
@@ -326,28 +1038,105 @@ public:
     bool is_lambda2() const {
         return type_ == type::lambda2;
     }
-    bool is_invalid() const {
-        return type_ == type::invalid;
+    bool is_bound() const {
+        return type_ == type::bound;
     }
-
-    // Object data
-    bool is_empty_object() const {
-        return is_object() && obj_->empty();
+    bool is_lazy_list() const {
+        return type_ == type::lazy_list;
     }
-    bool is_non_empty_object() const {
-        return is_object() && !obj_->empty();
+    bool is_borrowed_string() const {
+        return type_ == type::borrowed_string;
     }
-    void set(const string_type& name, const basic_data& var) {
-        if (is_object()) {
-            auto it = obj_->find(name);
-            if (it != obj_->end()) {
-                obj_->erase(it);
+    // Whether the data is an owned or a borrowed string. is_string() is only
+    // true for owned strings.
+    bool is_string_like() const {
+        return type_ == type::string || type_ == type::borrowed_string;
+    }
+    bool is_number() const {
+        return type_ == type::int64 || type_ == type::uint64 || type_ == type::float64;
+    }
+    bool is_int64() const {
+        return type_ == type::int64;
+    }
+    bool is_uint64() const {
+        return type_ == type::uint64;
+    }
+    bool is_float64() const {
+        return type_ == type::float64;
+    }
+    bool is_temporary() const {
+        return temporary_;
+    }
+    bool is_invalid() const {
+        return type_ == type::invalid;
+    }
+    // An object made from a shape that still has only the shape's keys
+    bool is_record() const {
+        return type_ == type::record;
+    }
+
+    // Object data
+    bool is_empty_object() const {
+        if (is_record()) {
+            return !record_ || record_->empty();
+        }
+        return is_object() && (!obj_ || obj_->empty());
+    }
+    bool is_non_empty_object() const {
+        if (is_record()) {
+            return record_ && !record_->empty();
+        }
+        return is_object() && obj_ && !obj_->empty();
+    }
+    void set(const string_type& name, const basic_data& var) {
+        emplace(name, var);
+    }
+    void set(const string_type& name, basic_data&& var) {
+        emplace(name, std::move(var));
+    }
+    // Sets name to a value constructed from args, replacing any existing
+    // value. Returns the new value, or null if this isn't an object.
+    template <typename... Args>
+    basic_data* emplace(const string_type& name, Args&&... args) {
+        if (!is_object()) {
+            return nullptr;
+        }
+        if (const auto slot = record_slot(name)) {
+            *slot = basic_data(std::forward<Args>(args)...);
+            return slot;
+        }
+        auto& obj = object_storage();
+        const auto it = obj.find(name);
+        if (it != obj.end()) {
+            it->second = basic_data(std::forward<Args>(args)...);
+            return &it->second;
+        }
+        return &obj.emplace(std::piecewise_construct, std::forward_as_tuple(name), std::forward_as_tuple(std::forward<Args>(args)...)).first->second;
+    }
+    // Same as emplace, but leaves an existing value alone and returns it
+    template <typename... Args>
+    basic_data* try_emplace(const string_type& name, Args&&... args) {
+        if (!is_object()) {
+            return nullptr;
+        }
+        if (const auto slot = record_slot(name)) {
+            if (slot->is_invalid()) {
+                *slot = basic_data(std::forward<Args>(args)...);
             }
-            obj_->insert(std::pair<string_type,basic_data>{name, var});
+            return slot;
         }
+        auto& obj = object_storage();
+        const auto it = obj.find(name);
+        if (it != obj.end()) {
+            return &it->second;
+        }
+        return &obj.emplace(std::piecewise_construct, std::forward_as_tuple(name), std::forward_as_tuple(std::forward<Args>(args)...)).first->second;
     }
     const basic_data* get(const string_type& name) const {
-        if (!is_object()) {
+        if (is_record()) {
+            return record_ ? record_->get(name) : nullptr;
+        }
+        if (!is_object() || !obj_) {
             return nullptr;
         }
         const auto& it = obj_->find(name);
@@ -356,34 +1145,83 @@ public:
         }
         return &it->second;
     }
+    const basic_data* get(const tag_key<string_type>& key) const {
+        if (is_record()) {
+            return record_ ? record_->get(key) : nullptr;
+        }
+        if (!is_object() || !obj_) {
+            return nullptr;
+        }
+#if defined(__cpp_lib_generic_unordered_lookup)
+        const auto it = obj_->find(key);
+#else
+        const auto it = obj_->find(key.name);
+#endif
+        if (it == obj_->end()) {
+            return nullptr;
+        }
+        return &it->second;
+    }
 
     // List data
     void push_back(const basic_data& var) {
-        if (is_list()) {
-            list_->push_back(var);
+        emplace_back(var);
+    }
+    void push_back(basic_data&& var) {
+        emplace_back(std::move(var));
+    }
+    // Appends a value constructed from args. Returns it, or null if this
+    // isn't a list.
+    template <typename... Args>
+    basic_data* emplace_back(Args&&... args) {
+        if (!is_list()) {
+            return nullptr;
         }
+        auto& list = list_storage();
+        list.emplace_back(std::forward<Args>(args)...);
+        return &list.back();
     }
     const basic_list<string_type>& list_value() const {
-        return *list_;
+        static const basic_list<string_type> empty_list;
+        return list_ ? *list_ : empty_list;
     }
     bool is_empty_list() const {
-        return is_list() && list_->empty();
+        return is_list() && (!list_ || list_->empty());
     }
     bool is_non_empty_list() const {
-        return is_list() && !list_->empty();
+        return is_list() && list_ && !list_->empty();
     }
     basic_data& operator<< (const basic_data& data) {
         push_back(data);
         return *this;
     }
+    basic_data& operator<< (basic_data&& data) {
+        push_back(std::move(data));
+        return *this;
+    }
+
+    // Reserves room for size items in a list or object
+    void reserve(std::size_t size) {
+        if (is_list()) {
+            list_storage().reserve(size);
+        } else if (type_ == type::object) {
+            object_storage().reserve(size);
+        }
+    }
 
     // String data
     const string_type& string_value() const {
-        return *str_;
+        return str_;
     }
 
     basic_data& operator[] (const string_type& key) {
-        return (*obj_)[key];
+        if (const auto slot = record_slot(key)) {
+            if (slot->is_invalid()) {
+                *slot = basic_data{};
+            }
+            return *slot;
+        }
+        return object_storage()[key];
     }
 
     const basic_partial<string_type>& partial_value() const {
@@ -398,664 +1236,3815 @@ public:
         return lambda_->type2_value();
     }
 
-private:
-    type type_;
-    std::unique_ptr<basic_object<string_type>> obj_;
-    std::unique_ptr<string_type> str_;
-    std::unique_ptr<basic_list<string_type>> list_;
-    std::unique_ptr<basic_partial<string_type>> partial_;
-    std::unique_ptr<basic_lambda_t<string_type>> lambda_;
-};
+    const basic_lazy_list<string_type>& lazy_list_value() const {
+        return *lazy_list_;
+    }
 
-template <typename string_type>
-class delimiter_set {
-public:
-    string_type begin;
-    string_type end;
-    delimiter_set()
-        : begin(default_begin)
-        , end(default_end)
-    {}
-    bool is_default() const { return begin == default_begin && end == default_end; }
-    static const string_type default_begin;
-    static const string_type default_end;
-};
+    // Borrowed string data
+    text_view<string_type> borrowed_string_value() const {
+        return {borrowed_.data, borrowed_.size};
+    }
 
-template <typename string_type>
-const string_type delimiter_set<string_type>::default_begin(2, '{');
-template <typename string_type>
-const string_type delimiter_set<string_type>::default_end(2, '}');
+    // The text of an owned or borrowed string, or an empty view otherwise
+    text_view<string_type> text_value() const {
+        if (type_ == type::string) {
+            return {str_.data(), str_.size()};
+        }
+        if (type_ == type::borrowed_string) {
+            return borrowed_string_value();
+        }
+        return {};
+    }
 
-template <typename string_type>
-class basic_context {
-public:
-    virtual ~basic_context() = default;
-    virtual void push(const basic_data<string_type>* data) = 0;
-    virtual void pop() = 0;
+    // Number data
+    std::int64_t int64_value() const {
+        return int64_;
+    }
 
-    virtual const basic_data<string_type>* get(const string_type& name) const = 0;
-    virtual const basic_data<string_type>* get_partial(const string_type& name) const = 0;
-};
+    std::uint64_t uint64_value() const {
+        return uint64_;
+    }
 
-template <typename string_type>
-class context : public basic_context<string_type> {
-public:
-    context(const basic_data<string_type>* data) {
-        push(data);
+    double float64_value() const {
+        return float64_;
     }
 
-    context() {
+    // Bound struct data
+    const void* bound_object() const {
+        return bound_.object;
     }
 
-    virtual void push(const basic_data<string_type>* data) override {
-        items_.insert(items_.begin(), data);
+    const basic_binding<string_type>& bound_binding() const {
+        return *bound_.binding;
     }
 
-    virtual void pop() override {
-        items_.erase(items_.begin());
+private:
+    // Replaces this with the value of a JSON document's tape entry
+    void assign_json(const json_entry<typename string_type::value_type>& entry);
+
+    basic_object<string_type>& object_storage() {
+        if (is_record()) {
+            record_to_object();
+        }
+        if (!obj_) {
+            obj_ = new basic_object<string_type>;
+        }
+        return *obj_;
     }
 
-    virtual const basic_data<string_type>* get(const string_type& name) const override {
-        // process {{.}} name
-        if (name.size() == 1 && name.at(0) == '.') {
-            return items_.front();
+    basic_list<string_type>& list_storage() {
+        if (!list_) {
+            list_ = new basic_list<string_type>;
         }
-        if (name.find('.') == string_type::npos) {
-            // process normal name without having to split which is slower
-            for (const auto& item : items_) {
-                const auto var = item->get(name);
-                if (var) {
-                    return var;
-                }
-            }
+        return *list_;
+    }
+
+    // The value of key in a record, or null if this isn't a record or its
+    // shape doesn't have key
+    basic_data* record_slot(const string_type& key) {
+        if (!is_record() || !record_) {
             return nullptr;
         }
-        // process x.y-like name
-        const auto names = split(name, '.');
-        for (const auto& item : items_) {
-            auto var = item;
-            for (const auto& n : names) {
-                var = var->get(n);
-                if (!var) {
-                    break;
+        const std::size_t slot = record_->shape->find(key);
+        return slot == basic_shape<string_type>::npos ? nullptr : &record_->values[slot];
+    }
+
+    // Gives a record its own hash table, for a key its shape doesn't have
+    void record_to_object() {
+        basic_record<string_type>* record = record_;
+        basic_object<string_type>* obj = nullptr;
+        if (record) {
+            obj = new basic_object<string_type>;
+            obj->reserve(record->values.size() + 1);
+            const auto& keys = record->shape->keys();
+            for (std::size_t i = 0; i < keys.size(); ++i) {
+                if (!record->values[i].is_invalid()) {
+                    obj->emplace(keys[i], std::move(record->values[i]));
                 }
             }
-            if (var) {
-                return var;
-            }
+            delete record;
         }
-        return nullptr;
+        obj_ = obj;
+        type_ = type::object;
     }
 
-    virtual const basic_data<string_type>* get_partial(const string_type& name) const override {
-        for (const auto& item : items_) {
-            const auto var = item->get(name);
-            if (var) {
-                return var;
-            }
+    void destroy() noexcept {
+        switch (type_) {
+            case type::object:
+                delete obj_;
+                break;
+            case type::string:
+                str_.~string_type();
+                break;
+            case type::list:
+                delete list_;
+                break;
+            case type::partial:
+                delete partial_;
+                break;
+            case type::lazy_list:
+                delete lazy_list_;
+                break;
+            case type::lambda:
+            case type::lambda2:
+                delete lambda_;
+                break;
+            case type::record:
+                delete record_;
+                break;
+            default:
+                break;
         }
-        return nullptr;
+        type_ = type::invalid;
     }
 
-    context(const context&) = delete;
-    context& operator= (const context&) = delete;
+    // Moves dat's value into this, which holds nothing, and leaves dat invalid
+    void take(basic_data& dat) noexcept {
+        switch (dat.type_) {
+            case type::string:
+                new (&str_) string_type(std::move(dat.str_));
+                dat.str_.~string_type();
+                break;
+            case type::object:
+                obj_ = dat.obj_;
+                break;
+            case type::list:
+                list_ = dat.list_;
+                break;
+            case type::partial:
+                partial_ = dat.partial_;
+                break;
+            case type::lazy_list:
+                lazy_list_ = dat.lazy_list_;
+                break;
+            case type::lambda:
+            case type::lambda2:
+                lambda_ = dat.lambda_;
+                break;
+            case type::bound:
+                bound_ = dat.bound_;
+                break;
+            case type::borrowed_string:
+                borrowed_ = dat.borrowed_;
+                break;
+            case type::int64:
+                int64_ = dat.int64_;
+                break;
+            case type::uint64:
+                uint64_ = dat.uint64_;
+                break;
+            case type::float64:
+                float64_ = dat.float64_;
+                break;
+            case type::record:
+                record_ = dat.record_;
+                break;
+            default:
+                break;
+        }
+        type_ = dat.type_;
+        temporary_ = dat.temporary_;
+        dat.type_ = type::invalid;
+    }
 
-private:
-    std::vector<const basic_data<string_type>*> items_;
+    class bound_value {
+    public:
+        const void* object;
+        const basic_binding<string_type>* binding;
+    };
+
+    class borrowed_value {
+    public:
+        const typename string_type::value_type* data;
+        std::size_t size;
+    };
+
+    // Strings, borrowed strings, numbers and bound structs are stored inline,
+    // everything else that has a value is allocated. Empty objects and lists are null until
+    // something is added.
+    union {
+        string_type str_;
+        basic_object<string_type>* obj_;
+        basic_list<string_type>* list_;
+        basic_partial<string_type>* partial_;
+        basic_lambda_t<string_type>* lambda_;
+        basic_lazy_list<string_type>* lazy_list_;
+        basic_record<string_type>* record_;
+        bound_value bound_;
+        borrowed_value borrowed_;
+        std::int64_t int64_;
+        std::uint64_t uint64_;
+        double float64_;
+    };
+    type type_;
+    bool temporary_ = false;
 };
 
+// Convert the value of a bound struct's field to data when the template
+// looks it up. Strings are borrowed and nested bound structs are referred
+// to rather than copied, and lists of them become lists of references.
 template <typename string_type>
-class line_buffer_state {
-public:
-    string_type data;
-    bool contained_section_tag = false;
+basic_data<string_type> bound_data(const string_type& value);
+template <typename string_type>
+basic_data<string_type> bound_data(const typename string_type::value_type* value);
+template <typename string_type>
+basic_data<string_type> bound_data(bool value);
+template <typename string_type, typename T>
+typename std::enable_if<std::is_integral<T>::value && !std::is_same<T, bool>::value, basic_data<string_type>>::type bound_data(T value);
+template <typename string_type, typename T>
+typename std::enable_if<std::is_floating_point<T>::value, basic_data<string_type>>::type bound_data(T value);
+template <typename string_type, typename T>
+basic_data<string_type> bound_data(const std::vector<T>& values);
+#if defined(KAINJOW_MUSTACHE_OPTIONAL)
+template <typename string_type, typename T>
+basic_data<string_type> bound_data(const std::optional<T>& value);
+#endif
+template <typename string_type, typename T>
+auto bound_data(const T& value) -> decltype(mustache_fields(&value, static_cast<const string_type*>(nullptr)), basic_data<string_type>{});
 
-    bool is_empty_or_contains_only_whitespace() const {
-        for (const auto ch : data) {
-            // don't look at newlines
-            if (ch != ' ' && ch != '\t') {
-                return false;
-            }
-        }
-        return true;
-    }
+template <typename string_type>
+basic_data<string_type> bound_data(const string_type& value) {
+    return basic_data<string_type>::borrow(value);
+}
 
-    void clear() {
-        data.clear();
-        contained_section_tag = false;
-    }
-};
+template <typename string_type>
+basic_data<string_type> bound_data(const typename string_type::value_type* value) {
+    return basic_data<string_type>::borrow(value, string_type::traits_type::length(value));
+}
 
 template <typename string_type>
-class context_internal {
-public:
-    basic_context<string_type>& ctx;
-    delimiter_set<string_type> delim_set;
-    line_buffer_state<string_type> line_buffer;
+basic_data<string_type> bound_data(bool value) {
+    return basic_data<string_type>{value};
+}
 
-    context_internal(basic_context<string_type>& a_ctx)
-        : ctx(a_ctx)
-    {
+template <typename string_type, typename T>
+typename std::enable_if<std::is_integral<T>::value && !std::is_same<T, bool>::value, basic_data<string_type>>::type bound_data(T value) {
+    if (std::is_signed<T>::value) {
+        return basic_data<string_type>::number(static_cast<std::int64_t>(value));
     }
-};
+    return basic_data<string_type>::number(static_cast<std::uint64_t>(value));
+}
 
-enum class tag_type {
-    text,
-    variable,
-    unescaped_variable,
-    section_begin,
-    section_end,
-    section_begin_inverted,
-    comment,
-    partial,
-    set_delimiter,
-};
+template <typename string_type, typename T>
+typename std::enable_if<std::is_floating_point<T>::value, basic_data<string_type>>::type bound_data(T value) {
+    return basic_data<string_type>::number(static_cast<double>(value));
+}
 
-template <typename string_type>
-class mstch_tag /* gcc doesn't allow "tag tag;" so rename the class :( */ {
-public:
-    string_type name;
-    tag_type type = tag_type::text;
-    std::shared_ptr<string_type> section_text;
-    std::shared_ptr<delimiter_set<string_type>> delim_set;
-    bool is_section_begin() const {
-        return type == tag_type::section_begin || type == tag_type::section_begin_inverted;
+template <typename string_type, typename T>
+basic_data<string_type> bound_data(const std::vector<T>& values) {
+    basic_data<string_type> list{basic_data<string_type>::type::list};
+    list.reserve(values.size());
+    for (const auto& value : values) {
+        list.push_back(bound_data<string_type>(value));
     }
-    bool is_section_end() const {
-        return type == tag_type::section_end;
+    return list;
+}
+
+#if defined(KAINJOW_MUSTACHE_OPTIONAL)
+template <typename string_type, typename T>
+basic_data<string_type> bound_data(const std::optional<T>& value) {
+    if (!value) {
+        return basic_data<string_type>{basic_data<string_type>::type::bool_false};
     }
-};
+    return bound_data<string_type>(*value);
+}
+#endif
+
+template <typename string_type, typename T>
+auto bound_data(const T& value) -> decltype(mustache_fields(&value, static_cast<const string_type*>(nullptr)), basic_data<string_type>{}) {
+    return basic_data<string_type>::bind(value);
+}
 
+// The value of an object made from a shape: the shape, and a value for
+// each of its keys that's invalid while the key is unset
 template <typename string_type>
-class context_pusher {
+class basic_record {
 public:
-    context_pusher(context_internal<string_type>& ctx, const basic_data<string_type>* data)
-        : ctx_(ctx)
-    {
-        ctx.ctx.push(data);
+    std::shared_ptr<const basic_shape<string_type>> shape;
+    basic_list<string_type> values;
+
+    template <typename key_type>
+    const basic_data<string_type>* get(const key_type& key) const {
+        const std::size_t slot = shape->find(key);
+        if (slot == basic_shape<string_type>::npos || values[slot].is_invalid()) {
+            return nullptr;
+        }
+        return &values[slot];
     }
-    ~context_pusher() {
-        ctx_.ctx.pop();
+
+    bool empty() const {
+        for (const auto& value : values) {
+            if (!value.is_invalid()) {
+                return false;
+            }
+        }
+        return true;
     }
-    context_pusher(const context_pusher&) = delete;
-    context_pusher& operator= (const context_pusher&) = delete;
-private:
-    context_internal<string_type>& ctx_;
 };
 
-template <typename string_type>
-class component {
-private:
-    using string_size_type = typename string_type::size_type;
-
-public:
-    string_type text;
-    mstch_tag<string_type> tag;
-    std::vector<component> children;
-    string_size_type position = string_type::npos;
+// Enough room for any number formatted by format_number()
+const std::size_t number_buffer_size = 32;
 
-    enum class walk_control {
-        walk, // "continue" is reserved :/
-        stop,
-        skip,
+// Writes a number to buffer, which has room for number_buffer_size
+// characters, and returns the number of characters. Floating point numbers
+// are written like %g with the fewest digits, but at least 15, that read
+// back as the same value, so 100000.0 is 100000 and 1e21 is 1e+21.
+template <typename string_type>
+std::size_t format_number(const basic_data<string_type>& number, char* buffer) {
+#if defined(KAINJOW_MUSTACHE_TO_CHARS)
+    char* const end = buffer + number_buffer_size;
+    std::to_chars_result result;
+    if (number.is_int64()) {
+        result = std::to_chars(buffer, end, number.int64_value());
+    } else if (number.is_uint64()) {
+        result = std::to_chars(buffer, end, number.uint64_value());
+    } else {
+        const double value = number.float64_value();
+        for (int precision = 15; precision <= 17; ++precision) {
+            result = std::to_chars(buffer, end, value, std::chars_format::general, precision);
+            double read = 0;
+            std::from_chars(buffer, result.ptr, read);
+            if (read == value || value != value) {
+                break;
+            }
+        }
+    }
+    return static_cast<std::size_t>(result.ptr - buffer);
+#else
+    int size;
+    if (number.is_int64()) {
+        size = std::snprintf(buffer, number_buffer_size, "%lld", static_cast<long long>(number.int64_value()));
+    } else if (number.is_uint64()) {
+        size = std::snprintf(buffer, number_buffer_size, "%llu", static_cast<unsigned long long>(number.uint64_value()));
+    } else {
+        // the fewest digits that read back as the same value
+        const double value = number.float64_value();
+        for (int precision = 15; precision <= 17; ++precision) {
+            size = std::snprintf(buffer, number_buffer_size, "%.*g", precision, value);
+            if (std::strtod(buffer, nullptr) == value || value != value) {
+                break;
+            }
+        }
+    }
+    return size > 0 ? static_cast<std::size_t>(size) : 0;
+#endif
+}
+
+// The make function of a field of type T
+template <typename string_type, typename T>
+void make_bound_data(const void* field, basic_data<string_type>& out) {
+    out = bound_data<string_type>(*static_cast<const T*>(field));
+}
+
+// Returns a lazy list of the items from first to last, each converted to
+// data as it's rendered. The range is read again every time the list is
+// rendered, so input iterators only allow rendering it once.
+template <typename string_type, typename iterator_type>
+basic_lazy_list<string_type> make_lazy_list(iterator_type first, iterator_type last) {
+    return [first, last]() -> basic_list_source<string_type> {
+        iterator_type it = first;
+        return [it, last](basic_data<string_type>& item) mutable {
+            if (it == last) {
+                return false;
+            }
+            item = basic_data<string_type>(*it);
+            ++it;
+            return true;
+        };
     };
-    using walk_callback = std::function<walk_control(component&)>;
+}
 
-    component() {}
-    component(const string_type& t, string_size_type p) : text(t), position(p) {}
+enum class json_type {
+    object,
+    array,
+    string,
+    number,
+    bool_true,
+    bool_false,
+    null,
+};
 
-    bool is_text() const {
-        return tag.type == tag_type::text;
+// One value in the tape of a basic_json_document. Objects and arrays are
+// followed by their members (an object's are key, value, key, value...), so
+// size counts the entries the value takes including everything inside it.
+// Strings and numbers point at their text in the document, strings without
+// the quotes and still escaped.
+template <typename char_type>
+class json_entry {
+public:
+    json_type type;
+    bool escaped;
+    std::size_t size;
+    const char_type* text;
+    std::size_t length;
+};
+
+// Appends code point cp as UTF-8, UTF-16 or UTF-32 depending on the size of
+// out's characters
+template <typename string_type>
+void append_code_point(std::uint32_t cp, string_type& out) {
+    using char_type = typename string_type::value_type;
+    if (sizeof(char_type) >= 4 || cp < 0x80) {
+        out.push_back(static_cast<char_type>(cp));
+    } else if (sizeof(char_type) == 2) {
+        if (cp < 0x10000) {
+            out.push_back(static_cast<char_type>(cp));
+        } else {
+            cp -= 0x10000;
+            out.push_back(static_cast<char_type>(0xD800 + (cp >> 10)));
+            out.push_back(static_cast<char_type>(0xDC00 + (cp & 0x3FF)));
+        }
+    } else if (cp < 0x800) {
+        out.push_back(static_cast<char_type>(0xC0 | (cp >> 6)));
+        out.push_back(static_cast<char_type>(0x80 | (cp & 0x3F)));
+    } else if (cp < 0x10000) {
+        out.push_back(static_cast<char_type>(0xE0 | (cp >> 12)));
+        out.push_back(static_cast<char_type>(0x80 | ((cp >> 6) & 0x3F)));
+        out.push_back(static_cast<char_type>(0x80 | (cp & 0x3F)));
+    } else {
+        out.push_back(static_cast<char_type>(0xF0 | (cp >> 18)));
+        out.push_back(static_cast<char_type>(0x80 | ((cp >> 12) & 0x3F)));
+        out.push_back(static_cast<char_type>(0x80 | ((cp >> 6) & 0x3F)));
+        out.push_back(static_cast<char_type>(0x80 | (cp & 0x3F)));
     }
+}
 
-    bool is_newline() const {
-        return is_text() && ((text.size() == 2 && text[0] == '\r' && text[1] == '\n') ||
-        (text.size() == 1 && (text[0] == '\n' || text[0] == '\r')));
+template <typename char_type>
+int json_hex_digit(char_type ch) {
+    if (ch >= '0' && ch <= '9') {
+        return ch - '0';
+    }
+    if (ch >= 'a' && ch <= 'f') {
+        return ch - 'a' + 10;
     }
+    if (ch >= 'A' && ch <= 'F') {
+        return ch - 'A' + 10;
+    }
+    return -1;
+}
 
-    bool is_non_newline_whitespace() const {
-        return is_text() && !is_newline() && text.size() == 1 && (text[0] == ' ' || text[0] == '\t');
+template <typename char_type>
+std::uint32_t json_hex4(const char_type* s) {
+    std::uint32_t value = 0;
+    for (int i = 0; i < 4; ++i) {
+        value = (value << 4) | static_cast<std::uint32_t>(json_hex_digit(s[i]));
     }
+    return value;
+}
 
-    void walk_children(const walk_callback& callback) {
-        for (auto& child : children) {
-            if (child.walk(callback) != walk_control::walk) {
+// Appends the JSON string text [s, s + n), which has been checked by
+// basic_json_document, to out with its escapes decoded
+template <typename string_type>
+void json_unescape(const typename string_type::value_type* s, std::size_t n, string_type& out) {
+    using char_type = typename string_type::value_type;
+    static const char_type backslash[5] = {'\\', '\\', '\\', '\\', '\\'};
+    std::size_t pos = 0;
+    while (pos < n) {
+        const std::size_t run = find_first_of_any(s + pos, n - pos, backslash);
+        out.append(s + pos, run);
+        pos += run;
+        if (pos == n) {
+            break;
+        }
+        const char_type ch = s[pos + 1];
+        pos += 2;
+        switch (ch) {
+            case 'b': out.push_back('\b'); break;
+            case 'f': out.push_back('\f'); break;
+            case 'n': out.push_back('\n'); break;
+            case 'r': out.push_back('\r'); break;
+            case 't': out.push_back('\t'); break;
+            case 'u': {
+                std::uint32_t cp = json_hex4(s + pos);
+                pos += 4;
+                // a surrogate pair is two escapes
+                if (cp >= 0xD800 && cp < 0xDC00 && pos + 6 <= n && s[pos] == '\\' && s[pos + 1] == 'u') {
+                    const std::uint32_t low = json_hex4(s + pos + 2);
+                    if (low >= 0xDC00 && low < 0xE000) {
+                        cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                        pos += 6;
+                    }
+                }
+                // a surrogate without its other half isn't a character
+                if (cp >= 0xD800 && cp < 0xE000) {
+                    cp = 0xFFFD;
+                }
+                append_code_point(cp, out);
                 break;
             }
+            default: out.push_back(ch); break;
         }
     }
+}
 
-private:
-    walk_control walk(const walk_callback& callback) {
-        walk_control control{callback(*this)};
-        if (control == walk_control::stop) {
-            return control;
-        } else if (control == walk_control::skip) {
-            return walk_control::walk;
+// A JSON string entry's text, decoded
+template <typename string_type>
+string_type json_string(const json_entry<typename string_type::value_type>& entry) {
+    if (!entry.escaped) {
+        return string_type(entry.text, entry.length);
+    }
+    string_type decoded;
+    json_unescape(entry.text, entry.length, decoded);
+    return decoded;
+}
+
+// A JSON number entry as int64 if it's an integer that fits, then uint64,
+// otherwise float64
+template <typename string_type>
+basic_data<string_type> json_number(const json_entry<typename string_type::value_type>& entry) {
+    const auto* first = entry.text;
+    const auto* last = entry.text + entry.length;
+    const bool negative = *first == '-';
+    bool integer = true;
+    std::uint64_t magnitude = 0;
+    for (const auto* it = negative ? first + 1 : first; it != last; ++it) {
+        if (*it < '0' || *it > '9') {
+            integer = false;
+            break;
         }
-        for (auto& child : children) {
-            control = child.walk(callback);
-            if (control == walk_control::stop) {
-                return control;
-            }
+        const auto digit = static_cast<std::uint64_t>(*it - '0');
+        if (magnitude > (UINT64_MAX - digit) / 10) {
+            integer = false;
+            break;
         }
-        return control;
+        magnitude = magnitude * 10 + digit;
     }
-};
+    if (integer && !negative) {
+        if (magnitude <= static_cast<std::uint64_t>(INT64_MAX)) {
+            return basic_data<string_type>::number(static_cast<std::int64_t>(magnitude));
+        }
+        return basic_data<string_type>::number(magnitude);
+    }
+    if (integer && magnitude <= static_cast<std::uint64_t>(INT64_MAX)) {
+        return basic_data<string_type>::number(-static_cast<std::int64_t>(magnitude));
+    }
+    if (integer && magnitude == static_cast<std::uint64_t>(INT64_MAX) + 1) {
+        return basic_data<string_type>::number(INT64_MIN);
+    }
+    // JSON numbers are ASCII, so narrow them for the C library
+    char small[64];
+    std::string large;
+    char* buffer = small;
+    if (entry.length >= sizeof(small)) {
+        large.resize(entry.length + 1);
+        buffer = &large[0];
+    }
+    for (std::size_t i = 0; i < entry.length; ++i) {
+        buffer[i] = static_cast<char>(first[i]);
+    }
+    buffer[entry.length] = '\0';
+    double value = 0;
+#if defined(KAINJOW_MUSTACHE_TO_CHARS)
+    // out of range values are left to strtod, which gives infinity or zero
+    if (std::from_chars(buffer, buffer + entry.length, value).ec == std::errc{}) {
+        return basic_data<string_type>::number(value);
+    }
+#endif
+    value = std::strtod(buffer, nullptr);
+    return basic_data<string_type>::number(value);
+}
+
+// How many entries are directly inside an object or array. An object's keys
+// and values are counted separately.
+template <typename char_type>
+std::size_t json_count(const json_entry<char_type>& entry) {
+    std::size_t count = 0;
+    const json_entry<char_type>* last = &entry + entry.size;
+    for (const json_entry<char_type>* item = &entry + 1; item < last; item += item->size) {
+        ++count;
+    }
+    return count;
+}
 
 template <typename string_type>
-class parser {
+const void* json_lookup(const void* object, const string_type& name, void (*&make)(const void* field, basic_data<string_type>& out));
+
+template <typename string_type>
+void make_json_data(const void* value, basic_data<string_type>& out);
+
+// The binding of JSON objects, which looks their keys up in the tape
+template <typename string_type>
+const basic_binding<string_type>& json_binding() {
+    static const basic_binding<string_type> binding{nullptr, 0, &json_lookup<string_type>};
+    return binding;
+}
+
+template <typename string_type>
+bool json_key_equals(const json_entry<typename string_type::value_type>& key, const string_type& name) {
+    if (!key.escaped) {
+        return key.length == name.size() && std::equal(name.begin(), name.end(), key.text);
+    }
+    string_type decoded;
+    json_unescape(key.text, key.length, decoded);
+    return decoded == name;
+}
+
+// Finds the value of a key in an object. Like data::from_json(), the last
+// of duplicate keys wins, so the whole object is scanned.
+template <typename string_type>
+const void* json_lookup(const void* object, const string_type& name, void (*&make)(const void* field, basic_data<string_type>& out)) {
+    using entry = json_entry<typename string_type::value_type>;
+    const entry* first = static_cast<const entry*>(object);
+    const entry* last = first + first->size;
+    const entry* key = first + 1;
+    const entry* found = nullptr;
+    while (key < last) {
+        const entry* value = key + 1;
+        if (json_key_equals(*key, name)) {
+            found = value;
+        }
+        key = value + value->size;
+    }
+    if (found) {
+        make = &make_json_data<string_type>;
+    }
+    return found;
+}
+
+// Turns a tape entry into data. Objects become bound data whose keys are
+// looked up as they're rendered. Arrays become lazy lists whose items are
+// made one at a time as a section renders them. Strings without escapes are
+// borrowed from the document's text. Strings with escapes are decoded here,
+// which is only when a template asks for them, and numbers are read here
+// like data::from_json() reads them, so they render the same way. null is
+// false.
+template <typename string_type>
+void make_json_data(const void* value, basic_data<string_type>& out) {
+    using entry = json_entry<typename string_type::value_type>;
+    const entry& e = *static_cast<const entry*>(value);
+    switch (e.type) {
+        case json_type::object:
+            out = basic_data<string_type>{&e, json_binding<string_type>()};
+            break;
+        case json_type::array: {
+            const entry* array = &e;
+            out = basic_data<string_type>{basic_lazy_list<string_type>{[array]() -> basic_list_source<string_type> {
+                const entry* last = array + array->size;
+                const entry* next = array + 1;
+                return [next, last](basic_data<string_type>& item) mutable {
+                    if (next == last) {
+                        return false;
+                    }
+                    make_json_data<string_type>(next, item);
+                    next += next->size;
+                    return true;
+                };
+            }}};
+            break;
+        }
+        case json_type::string:
+            if (e.escaped) {
+                out = basic_data<string_type>::temporary(json_string<string_type>(e));
+            } else {
+                out = basic_data<string_type>::borrow(e.text, e.length);
+            }
+            break;
+        case json_type::number:
+            out = json_number<string_type>(e);
+            break;
+        case json_type::bool_true:
+            out = basic_data<string_type>{true};
+            break;
+        case json_type::bool_false:
+        case json_type::null:
+            out = basic_data<string_type>{false};
+            break;
+    }
+}
+
+// A parsed JSON document that templates render straight from. Parsing makes
+// one pass over the text and records a tape of json_entry values pointing
+// into it; nothing is copied or decoded until a template looks it up. The
+// text must outlive the document, and the document must outlive anything
+// rendered from root().
+//
+//     json_document doc{text};
+//     if (doc.is_valid()) {
+//         tmpl.render(doc.root());
+//     }
+template <typename string_type>
+class basic_json_document {
 public:
-    parser(const string_type& input, context_internal<string_type>& ctx, component<string_type>& root_component, string_type& error_message)
+    using value_type = typename string_type::value_type;
+    using entry = json_entry<value_type>;
+
+    // How deeply objects and arrays can nest
+    static const std::size_t max_depth = 512;
+
+    basic_json_document(const value_type* text, std::size_t size)
+        : first_{text}
+        , pos_{text}
+        , last_{text + size}
     {
-        parse(input, ctx, root_component, error_message);
+        // typical JSON has an entry every 8 to 16 characters, and growing
+        // the tape from empty costs more than the parse
+        tape_.reserve(size / 16 + 1);
+        if (parse_value(0)) {
+            skip_whitespace();
+            if (pos_ != last_) {
+                fail("Unexpected text after JSON");
+            }
+        }
+        if (!error_message_.empty()) {
+            tape_.clear();
+        }
     }
 
-private:
-    void parse(const string_type& input, context_internal<string_type>& ctx, component<string_type>& root_component, string_type& error_message) const {
-        using string_size_type = typename string_type::size_type;
-        using streamstring = std::basic_ostringstream<typename string_type::value_type>;
+    explicit basic_json_document(const string_type& text)
+        : basic_json_document(text.data(), text.size())
+    {}
+    explicit basic_json_document(const string_type&& text) = delete;
 
-        const string_type brace_delimiter_end_unescaped(3, '}');
-        const string_size_type input_size{input.size()};
+    basic_json_document(const basic_json_document&) = delete;
+    basic_json_document& operator= (const basic_json_document&) = delete;
 
-        bool current_delimiter_is_brace{ctx.delim_set.is_default()};
+    bool is_valid() const {
+        return error_message_.empty();
+    }
 
-        std::vector<component<string_type>*> sections{&root_component};
-        std::vector<string_size_type> section_starts;
-        string_type current_text;
-        string_size_type current_text_position = string_type::npos;
+    const string_type& error_message() const {
+        return error_message_;
+    }
 
-        current_text.reserve(input_size);
+    // The top level value as data, or false if the document isn't valid
+    basic_data<string_type> root() const {
+        basic_data<string_type> data{false};
+        if (!tape_.empty()) {
+            make_json_data<string_type>(&tape_.front(), data);
+        }
+        return data;
+    }
 
-        const auto process_current_text = [&current_text, &current_text_position, &sections]() {
-            if (!current_text.empty()) {
-                const component<string_type> comp{current_text, current_text_position};
-                sections.back()->children.push_back(comp);
-                current_text.clear();
-                current_text_position = string_type::npos;
-            }
-        };
+    const std::vector<entry>& tape() const {
+        return tape_;
+    }
 
-        const std::vector<string_type> whitespace{
-            string_type(1, '\r') + string_type(1, '\n'),
-            string_type(1, '\n'),
-            string_type(1, '\r'),
-            string_type(1, ' '),
-            string_type(1, '\t'),
-        };
+private:
+    bool fail(const char* message) {
+        std::basic_ostringstream<value_type> ss;
+        ss << message << " at " << (pos_ - first_);
+        error_message_.assign(ss.str());
+        return false;
+    }
 
-        for (string_size_type input_position = 0; input_position != input_size;) {
-            bool parse_tag = false;
+    void skip_whitespace() {
+        while (pos_ != last_ && (*pos_ == ' ' || *pos_ == '\n' || *pos_ == '\r' || *pos_ == '\t')) {
+            ++pos_;
+        }
+    }
 
-            if (input.compare(input_position, ctx.delim_set.begin.size(), ctx.delim_set.begin) == 0) {
-                process_current_text();
+    void add(json_type type, const value_type* text, std::size_t length, bool escaped = false) {
+        tape_.push_back(entry{type, escaped, 1, text, length});
+    }
 
-                // Tag start delimiter
-                parse_tag = true;
-            } else {
-                bool parsed_whitespace = false;
-                for (const auto& whitespace_text : whitespace) {
-                    if (input.compare(input_position, whitespace_text.size(), whitespace_text) == 0) {
-                        process_current_text();
+    bool parse_value(std::size_t depth) {
+        skip_whitespace();
+        if (pos_ == last_) {
+            return fail("Unexpected end of JSON");
+        }
+        const value_type ch = *pos_;
+        if (ch == '{') {
+            return parse_container(json_type::object, '}', depth);
+        }
+        if (ch == '[') {
+            return parse_container(json_type::array, ']', depth);
+        }
+        if (ch == '"') {
+            return parse_string();
+        }
+        if (ch == '-' || (ch >= '0' && ch <= '9')) {
+            return parse_number();
+        }
+        if (parse_literal("true", 4)) {
+            add(json_type::bool_true, nullptr, 0);
+            return true;
+        }
+        if (parse_literal("false", 5)) {
+            add(json_type::bool_false, nullptr, 0);
+            return true;
+        }
+        if (parse_literal("null", 4)) {
+            add(json_type::null, nullptr, 0);
+            return true;
+        }
+        return fail("Unexpected character");
+    }
 
-                        const component<string_type> comp{whitespace_text, input_position};
-                        sections.back()->children.push_back(comp);
-                        input_position += whitespace_text.size();
+    bool parse_literal(const char* literal, std::size_t size) {
+        if (static_cast<std::size_t>(last_ - pos_) < size) {
+            return false;
+        }
+        for (std::size_t i = 0; i < size; ++i) {
+            if (pos_[i] != static_cast<value_type>(literal[i])) {
+                return false;
+            }
+        }
+        pos_ += size;
+        return true;
+    }
 
-                        parsed_whitespace = true;
-                        break;
+    bool parse_container(json_type type, value_type close, std::size_t depth) {
+        if (depth == max_depth) {
+            return fail("JSON nested too deeply");
+        }
+        const std::size_t index = tape_.size();
+        add(type, pos_, 0);
+        ++pos_;
+        skip_whitespace();
+        if (pos_ != last_ && *pos_ == close) {
+            ++pos_;
+        } else {
+            for (;;) {
+                if (type == json_type::object) {
+                    skip_whitespace();
+                    if (pos_ == last_ || *pos_ != '"') {
+                        return fail("Expected a string key");
                     }
-                }
-
-                if (!parsed_whitespace) {
-                    if (current_text.empty()) {
-                        current_text_position = input_position;
+                    if (!parse_string()) {
+                        return false;
                     }
-                    current_text.append(1, input[input_position]);
-                    input_position++;
+                    skip_whitespace();
+                    if (pos_ == last_ || *pos_ != ':') {
+                        return fail("Expected ':'");
+                    }
+                    ++pos_;
+                }
+                if (!parse_value(depth + 1)) {
+                    return false;
+                }
+                skip_whitespace();
+                if (pos_ != last_ && *pos_ == ',') {
+                    ++pos_;
+                } else if (pos_ != last_ && *pos_ == close) {
+                    ++pos_;
+                    break;
+                } else {
+                    return fail(type == json_type::object ? "Expected ',' or '}'" : "Expected ',' or ']'");
                 }
             }
+        }
+        entry& e = tape_[index];
+        e.size = tape_.size() - index;
+        e.length = static_cast<std::size_t>(pos_ - e.text);
+        return true;
+    }
 
-            if (!parse_tag) {
-                continue;
+    // Runs of plain characters are skipped with find_json_string_special,
+    // which looks at 16 or 32 bytes at a time
+    bool parse_string() {
+        const value_type* text = ++pos_;
+        bool escaped = false;
+        for (;;) {
+            pos_ += find_json_string_special(pos_, static_cast<std::size_t>(last_ - pos_));
+            if (pos_ == last_) {
+                return fail("Unterminated string");
+            }
+            if (*pos_ == '"') {
+                break;
             }
+            if (*pos_ != '\\') {
+                return fail("Control character in string");
+            }
+            escaped = true;
+            if (last_ - pos_ < 2) {
+                pos_ = last_;
+                return fail("Unterminated string");
+            }
+            const value_type ch = pos_[1];
+            if (ch == 'u') {
+                if (last_ - pos_ < 6 || json_hex_digit(pos_[2]) < 0 || json_hex_digit(pos_[3]) < 0 || json_hex_digit(pos_[4]) < 0 || json_hex_digit(pos_[5]) < 0) {
+                    return fail("Invalid \\u escape");
+                }
+                pos_ += 6;
+            } else if (ch == '"' || ch == '\\' || ch == '/' || ch == 'b' || ch == 'f' || ch == 'n' || ch == 'r' || ch == 't') {
+                pos_ += 2;
+            } else {
+                return fail("Invalid escape");
+            }
+        }
+        add(json_type::string, text, static_cast<std::size_t>(pos_ - text), escaped);
+        ++pos_;
+        return true;
+    }
 
-            // Find the next tag start delimiter
-            const string_size_type tag_location_start = input_position;
+    bool digits() {
+        const value_type* start = pos_;
+        while (pos_ != last_ && *pos_ >= '0' && *pos_ <= '9') {
+            ++pos_;
+        }
+        return pos_ != start;
+    }
 
-            // Find the next tag end delimiter
-            string_size_type tag_contents_location{tag_location_start + ctx.delim_set.begin.size()};
-            const bool tag_is_unescaped_var{current_delimiter_is_brace && tag_location_start != (input_size - 2) && input.at(tag_contents_location) == ctx.delim_set.begin.at(0)};
-            const string_type& current_tag_delimiter_end{tag_is_unescaped_var ? brace_delimiter_end_unescaped : ctx.delim_set.end};
-            const auto current_tag_delimiter_end_size = current_tag_delimiter_end.size();
-            if (tag_is_unescaped_var) {
-                ++tag_contents_location;
+    bool parse_number() {
+        const value_type* text = pos_;
+        if (*pos_ == '-') {
+            ++pos_;
+        }
+        if (pos_ != last_ && *pos_ == '0') {
+            ++pos_;
+        } else if (!digits()) {
+            return fail("Invalid number");
+        }
+        if (pos_ != last_ && *pos_ == '.') {
+            ++pos_;
+            if (!digits()) {
+                return fail("Invalid number");
             }
-            const string_size_type tag_location_end{input.find(current_tag_delimiter_end, tag_contents_location)};
-            if (tag_location_end == string_type::npos) {
-                streamstring ss;
-                ss << "Unclosed tag at " << tag_location_start;
-                error_message.assign(ss.str());
-                return;
+        }
+        if (pos_ != last_ && (*pos_ == 'e' || *pos_ == 'E')) {
+            ++pos_;
+            if (pos_ != last_ && (*pos_ == '+' || *pos_ == '-')) {
+                ++pos_;
             }
+            if (!digits()) {
+                return fail("Invalid number");
+            }
+        }
+        add(json_type::number, text, static_cast<std::size_t>(pos_ - text));
+        return true;
+    }
 
-            // Parse tag
-            const string_type tag_contents{trim(string_type{input, tag_contents_location, tag_location_end - tag_contents_location})};
-            component<string_type> comp;
-            if (!tag_contents.empty() && tag_contents[0] == '=') {
-                if (!parse_set_delimiter_tag(tag_contents, ctx.delim_set)) {
-                    streamstring ss;
-                    ss << "Invalid set delimiter tag at " << tag_location_start;
-                    error_message.assign(ss.str());
-                    return;
-                }
-                current_delimiter_is_brace = ctx.delim_set.is_default();
-                comp.tag.type = tag_type::set_delimiter;
-                comp.tag.delim_set.reset(new delimiter_set<string_type>(ctx.delim_set));
+    const value_type* first_;
+    const value_type* pos_;
+    const value_type* last_;
+    std::vector<entry> tape_;
+    string_type error_message_;
+};
+
+template <typename string_type>
+const std::size_t basic_json_document<string_type>::max_depth;
+
+template <typename string_type>
+basic_data<string_type> basic_data<string_type>::from_json(const typename string_type::value_type* text, std::size_t size, string_type* error_message) {
+    const basic_json_document<string_type> document{text, size};
+    if (error_message) {
+        *error_message = document.error_message();
+    }
+    basic_data data{type::invalid};
+    if (document.is_valid()) {
+        data.assign_json(document.tape().front());
+    }
+    return data;
+}
+
+template <typename string_type>
+void basic_data<string_type>::assign_json(const json_entry<typename string_type::value_type>& entry) {
+    using entry_type = json_entry<typename string_type::value_type>;
+    const entry_type* last = &entry + entry.size;
+    switch (entry.type) {
+        case json_type::object: {
+            *this = basic_data{type::object};
+            auto& obj = object_storage();
+            obj.reserve(json_count(entry) / 2);
+            for (const entry_type* key = &entry + 1; key < last; key += 1 + key[1].size) {
+                // a repeated key keeps the last value
+                obj[json_string<string_type>(*key)].assign_json(key[1]);
             }
-            if (comp.tag.type != tag_type::set_delimiter) {
-                parse_tag_contents(tag_is_unescaped_var, tag_contents, comp.tag);
+            break;
+        }
+        case json_type::array: {
+            *this = basic_data{type::list};
+            auto& list = list_storage();
+            list.reserve(json_count(entry));
+            for (const entry_type* item = &entry + 1; item < last; item += item->size) {
+                list.emplace_back(false);
+                list.back().assign_json(*item);
             }
-            comp.position = tag_location_start;
-            sections.back()->children.push_back(comp);
+            break;
+        }
+        case json_type::string:
+            *this = basic_data{json_string<string_type>(entry)};
+            break;
+        case json_type::number:
+            *this = json_number<string_type>(entry);
+            break;
+        case json_type::bool_true:
+            *this = basic_data{true};
+            break;
+        case json_type::bool_false:
+        case json_type::null:
+            *this = basic_data{false};
+            break;
+    }
+}
 
-            // Start next search after this tag
-            input_position = tag_location_end + current_tag_delimiter_end_size;
+template <typename string_type>
+class delimiter_set {
+public:
+    string_type begin;
+    string_type end;
+    delimiter_set()
+        : begin(default_begin)
+        , end(default_end)
+    {}
+    bool is_default() const { return begin == default_begin && end == default_end; }
+    static const string_type default_begin;
+    static const string_type default_end;
+};
 
-            // Push or pop sections
-            if (comp.tag.is_section_begin()) {
+template <typename string_type>
+const string_type delimiter_set<string_type>::default_begin(2, '{');
+template <typename string_type>
+const string_type delimiter_set<string_type>::default_end(2, '}');
+
+template <typename string_type>
+class basic_context {
+public:
+    virtual ~basic_context() = default;
+    virtual void push(const basic_data<string_type>* data) = 0;
+    virtual void pop() = 0;
+
+    virtual const basic_data<string_type>* get(const string_type& name) const = 0;
+    virtual const basic_data<string_type>* get_partial(const string_type& name) const = 0;
+
+    // Called by the renderer with the tag names split and hashed by the
+    // parser. Override it to avoid handling the name in get() every time.
+    virtual const basic_data<string_type>* resolve(const tag_path<string_type>& path) const {
+        return get(path.name());
+    }
+
+    // Let the renderer remember which item a name was found in, so it only
+    // looks in the items pushed since. depth() is the number of items, and
+    // resolve_from() resolves path in the items from index first (counting
+    // from the bottom) to the top, innermost first, setting level to the
+    // index of the item it was found in. Contexts that return 0 from depth()
+    // are always asked with resolve().
+    virtual std::size_t depth() const {
+        return 0;
+    }
+
+    virtual const basic_data<string_type>* resolve_from(const tag_path<string_type>& path, std::size_t first, std::size_t& level) const {
+        (void)first;
+        level = 0;
+        return resolve(path);
+    }
+
+    // Returns a copy of the context for rendering part of a list section on
+    // another thread, or null if it can't be copied, in which case sections
+    // are rendered serially. See basic_mustache::set_parallel_sections().
+    virtual std::unique_ptr<basic_context> clone() const {
+        return nullptr;
+    }
+};
+
+// The data a context looks names up in. Items are pushed and popped at the
+// back and iterated from the back, so the innermost section comes first.
+// Stacks up to inline_size deep are stored in the object, so rendering most
+// templates doesn't allocate for the stack.
+template <typename value_type>
+class context_stack {
+public:
+    using const_iterator = std::reverse_iterator<const value_type*>;
+
+    static const std::size_t inline_size = 16;
+
+    context_stack() {}
+
+    context_stack(const context_stack& other) {
+        *this = other;
+    }
+
+    context_stack& operator=(const context_stack& other) {
+        if (this != &other) {
+            size_ = 0;
+            reserve(other.size_);
+            std::copy(other.data_, other.data_ + other.size_, data_);
+            size_ = other.size_;
+        }
+        return *this;
+    }
+
+    void push_back(const value_type& value) {
+        if (size_ == capacity_) {
+            reserve(capacity_ * 2);
+        }
+        data_[size_++] = value;
+    }
+
+    void pop_back() {
+        assert(size_ > 0);
+        --size_;
+    }
+
+    const value_type& back() const {
+        assert(size_ > 0);
+        return data_[size_ - 1];
+    }
+
+    const value_type& operator[](std::size_t index) const {
+        return data_[index];
+    }
+
+    std::size_t size() const {
+        return size_;
+    }
+
+    bool empty() const {
+        return size_ == 0;
+    }
+
+    const_iterator begin() const {
+        return const_iterator{data_ + size_};
+    }
+
+    const_iterator end() const {
+        return const_iterator{data_};
+    }
+
+private:
+    void reserve(std::size_t capacity) {
+        if (capacity <= capacity_) {
+            return;
+        }
+        std::unique_ptr<value_type[]> heap{new value_type[capacity]};
+        std::copy(data_, data_ + size_, heap.get());
+        heap_ = std::move(heap);
+        data_ = heap_.get();
+        capacity_ = capacity;
+    }
+
+    value_type inline_[inline_size];
+    std::unique_ptr<value_type[]> heap_;
+    value_type* data_ = inline_;
+    std::size_t size_ = 0;
+    std::size_t capacity_ = inline_size;
+};
+
+template <typename value_type>
+const std::size_t context_stack<value_type>::inline_size;
+
+// The default context. get() is where subclasses change how names are found,
+// so resolve() and resolve_from() call it, depth() returns 0 so the lookup
+// cache isn't used, and clone() returns null. The contexts basic_mustache
+// makes for rendering data, and subclasses that call use_key_lookup(),
+// instead look the split names up directly, cache lookups, and can be
+// cloned. Subclasses that call it must not override get(), get_partial()
+// or clone().
+//
+// Fields of bound structs (see basic_data::bind()) are converted to data
+// when they're first looked up, and kept until the item they were found in
+// is popped.
+template <typename string_type>
+class context : public basic_context<string_type> {
+public:
+    context(const basic_data<string_type>* data) {
+        push(data);
+    }
+
+    context() {
+    }
+
+    virtual void push(const basic_data<string_type>* data) override {
+        items_.push_back(data);
+    }
+
+    virtual void pop() override {
+        items_.pop_back();
+        // the next item pushed reuses the level's storage
+        if (bound_.size() > items_.size() && bound_[items_.size()]) {
+            bound_[items_.size()]->clear();
+        }
+    }
+
+    virtual const basic_data<string_type>* get(const string_type& name) const override {
+        // process {{.}} name
+        if (name.size() == 1 && name.at(0) == '.') {
+            return items_.back();
+        }
+        if (name.find('.') == string_type::npos) {
+            // process normal name without having to split which is slower
+            for (std::size_t index = items_.size(); index > 0; --index) {
+                const auto var = child(items_[index - 1], name, index - 1);
+                if (var) {
+                    return var;
+                }
+            }
+            return nullptr;
+        }
+        // process x.y-like name
+        const auto names = split(name, '.');
+        for (std::size_t index = items_.size(); index > 0; --index) {
+            auto var = items_[index - 1];
+            for (const auto& n : names) {
+                var = child(var, n, index - 1);
+                if (!var) {
+                    break;
+                }
+            }
+            if (var) {
+                return var;
+            }
+        }
+        return nullptr;
+    }
+
+    virtual const basic_data<string_type>* resolve(const tag_path<string_type>& path) const override {
+        if (!key_lookup_) {
+            return this->get(path.name());
+        }
+        return resolve_keys(path);
+    }
+
+    virtual std::size_t depth() const override {
+        return key_lookup_ ? items_.size() : 0;
+    }
+
+    virtual const basic_data<string_type>* resolve_from(const tag_path<string_type>& path, std::size_t first, std::size_t& level) const override {
+        if (!key_lookup_) {
+            level = 0;
+            return this->get(path.name());
+        }
+        return resolve_keys_from(path, first, level);
+    }
+
+    virtual const basic_data<string_type>* get_partial(const string_type& name) const override {
+        for (std::size_t index = items_.size(); index > 0; --index) {
+            const auto var = child(items_[index - 1], name, index - 1);
+            if (var) {
+                return var;
+            }
+        }
+        return nullptr;
+    }
+
+    virtual std::unique_ptr<basic_context<string_type>> clone() const override {
+        if (!key_lookup_) {
+            return nullptr;
+        }
+        context* copy = new context;
+        copy->items_ = items_;
+        copy->key_lookup_ = true;
+        return std::unique_ptr<basic_context<string_type>>{copy};
+    }
+
+    context(const context&) = delete;
+    context& operator= (const context&) = delete;
+
+protected:
+    // Look names up without calling get(), see above
+    void use_key_lookup() {
+        key_lookup_ = true;
+    }
+
+    // The lookups resolve() and resolve_from() use after use_key_lookup()
+    const basic_data<string_type>* resolve_keys(const tag_path<string_type>& path) const {
+        if (path.is_dot()) {
+            return items_.back();
+        }
+        std::size_t level;
+        return find(path, 0, level);
+    }
+
+    std::size_t resolve_depth() const {
+        return items_.size();
+    }
+
+    const basic_data<string_type>* resolve_keys_from(const tag_path<string_type>& path, std::size_t first, std::size_t& level) const {
+        return find(path, first, level);
+    }
+
+private:
+    template <typename>
+    friend class basic_mustache;
+    template <typename>
+    friend class basic_chunked_render;
+
+    class bound_field {
+    public:
+        const void* address;
+        void (*make)(const void* field, basic_data<string_type>& out);
+        basic_data<string_type> value;
+    };
+
+    const basic_data<string_type>* find(const tag_path<string_type>& path, std::size_t first, std::size_t& level) const {
+        for (std::size_t index = items_.size(); index > first; --index) {
+            auto var = items_[index - 1];
+            for (const auto& key : path.keys()) {
+                var = child(var, key, index - 1);
+                if (!var) {
+                    break;
+                }
+            }
+            if (var) {
+                level = index - 1;
+                return var;
+            }
+        }
+        return nullptr;
+    }
+
+    // Looks key up in var, which was found in the item at level
+    template <typename key_type>
+    const basic_data<string_type>* child(const basic_data<string_type>* var, const key_type& key, std::size_t level) const {
+        const auto found = var->get(key);
+        if (found || !var->is_bound()) {
+            return found;
+        }
+        return bound_child(*var, key_name(key), level);
+    }
+
+    static const string_type& key_name(const string_type& name) {
+        return name;
+    }
+
+    static const string_type& key_name(const tag_key<string_type>& key) {
+        return key.name;
+    }
+
+    const basic_data<string_type>* bound_child(const basic_data<string_type>& var, const string_type& name, std::size_t level) const {
+        const auto& binding = var.bound_binding();
+        const void* address;
+        void (*make)(const void* field, basic_data<string_type>& out);
+        if (binding.lookup) {
+            address = binding.lookup(var.bound_object(), name, make);
+            if (!address) {
+                return nullptr;
+            }
+        } else {
+            const auto field = binding.find(name);
+            if (!field) {
+                return nullptr;
+            }
+            address = field->address(var.bound_object());
+            make = field->make;
+        }
+        if (bound_.size() <= level) {
+            bound_.resize(level + 1);
+        }
+        auto& fields = bound_[level];
+        if (!fields) {
+            fields.reset(new std::deque<bound_field>);
+        }
+        for (const auto& existing : *fields) {
+            if (existing.address == address && existing.make == make) {
+                return &existing.value;
+            }
+        }
+        fields->emplace_back();
+        bound_field& added = fields->back();
+        added.address = address;
+        added.make = make;
+        make(address, added.value);
+        return &added.value;
+    }
+
+    context_stack<const basic_data<string_type>*> items_;
+    // Converted bound fields for each level of items_, which the renderer
+    // may hold pointers to until that level is popped
+    mutable std::vector<std::unique_ptr<std::deque<bound_field>>> bound_;
+    bool key_lookup_ = false;
+};
+
+// Holds a line with a partial on it while it's rendered. Whether such a line
+// is standalone depends on what the partial expands to, so it can only be
+// decided at the end of the line. All other lines are resolved by the parser
+// and stream straight to the output. Only leading whitespace is held: once
+// the line has anything else it can't be removed, so it's flushed and the
+// rest of it streams too.
+template <typename string_type>
+class line_buffer_state {
+public:
+    string_type data;
+    bool contained_section_tag = false;
+    bool active = false;
+    bool flushed = false;
+
+    bool buffering() const {
+        return active && !flushed;
+    }
+
+    bool operator==(const line_buffer_state& other) const {
+        return active == other.active && flushed == other.flushed && contained_section_tag == other.contained_section_tag && data == other.data;
+    }
+
+    bool is_empty_or_contains_only_whitespace() const {
+        for (const auto ch : data) {
+            // don't look at newlines
+            if (ch != ' ' && ch != '\t') {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void clear() {
+        data.clear();
+        contained_section_tag = false;
+        active = false;
+        flushed = false;
+    }
+};
+
+template <typename string_type>
+class context_internal {
+public:
+    basic_context<string_type>& ctx;
+    delimiter_set<string_type> delim_set;
+    line_buffer_state<string_type> line_buffer;
+    string_type error_message;
+    // Reused by custom escape functions
+    string_type escape_buffer;
+    // Set when the delimiters changed, which lambdas after them depend on,
+    // so a parallel section must be serial
+    bool order_dependent = false;
+    // Whether a buffered line ended, and whether the first one was flushed
+    // before that, which tells a parallel chunk if it depends on how the
+    // line before it ended
+    bool line_ended = false;
+    bool first_line_flushed = false;
+    // Number of lazy list sections being rendered. Their items are replaced
+    // by the next one, so sinks get copies of data strings while it's set.
+    std::size_t lazy_sections = 0;
+
+    context_internal(basic_context<string_type>& a_ctx)
+        : ctx(a_ctx)
+    {
+    }
+
+    // Gets ready for another render, keeping the buffers
+    void reset() {
+        if (!delim_set.is_default()) {
+            delim_set = {};
+        }
+        line_buffer.clear();
+        error_message.clear();
+        order_dependent = false;
+        line_ended = false;
+        first_line_flushed = false;
+        lazy_sections = 0;
+    }
+};
+
+enum class tag_type {
+    text,
+    variable,
+    unescaped_variable,
+    section_begin,
+    section_end,
+    section_begin_inverted,
+    comment,
+    partial,
+    set_delimiter,
+};
+
+template <typename string_type>
+class mstch_tag /* gcc doesn't allow "tag tag;" so rename the class :( */ {
+public:
+    tag_path<string_type> path;
+    tag_type type = tag_type::text;
+    text_view<string_type> section_text;
+    std::shared_ptr<delimiter_set<string_type>> delim_set;
+    bool is_section_begin() const {
+        return type == tag_type::section_begin || type == tag_type::section_begin_inverted;
+    }
+    bool is_section_end() const {
+        return type == tag_type::section_end;
+    }
+};
+
+template <typename string_type>
+class component {
+private:
+    using string_size_type = typename string_type::size_type;
+
+public:
+    text_view<string_type> text;
+    mstch_tag<string_type> tag;
+    std::vector<component> children;
+    string_size_type position = string_type::npos;
+    // Newline ending a standalone line. It's not rendered.
+    bool standalone = false;
+    // Part of a line that has a partial on it, see line_buffer_state.
+    bool dynamic_line = false;
+    // Same for the section end tag, which is removed once parsing is done
+    bool section_end_dynamic_line = false;
+
+    enum class walk_control {
+        walk, // "continue" is reserved :/
+        stop,
+        skip,
+    };
+    using walk_callback = std::function<walk_control(component&)>;
+
+    component() {}
+    component(const text_view<string_type>& t, string_size_type p) : text(t), position(p) {}
+
+    bool is_text() const {
+        return tag.type == tag_type::text;
+    }
+
+    bool is_newline() const {
+        return is_text() && ((text.size() == 2 && text[0] == '\r' && text[1] == '\n') ||
+        (text.size() == 1 && (text[0] == '\n' || text[0] == '\r')));
+    }
+
+    bool is_non_newline_whitespace() const {
+        return is_text() && !is_newline() && text.size() == 1 && (text[0] == ' ' || text[0] == '\t');
+    }
+
+    void walk_children(const walk_callback& callback) {
+        for (auto& child : children) {
+            if (child.walk(callback) != walk_control::walk) {
+                break;
+            }
+        }
+    }
+
+private:
+    walk_control walk(const walk_callback& callback) {
+        walk_control control{callback(*this)};
+        if (control == walk_control::stop) {
+            return control;
+        } else if (control == walk_control::skip) {
+            return walk_control::walk;
+        }
+        for (auto& child : children) {
+            control = child.walk(callback);
+            if (control == walk_control::stop) {
+                return control;
+            }
+        }
+        return control;
+    }
+};
+
+enum class opcode : unsigned char {
+    text,
+    variable,
+    unescaped_variable,
+    section_begin,
+    section_begin_inverted,
+    section_end,
+    partial,
+    set_delimiter,
+};
+
+// basic_mustache compiles the component tree into a flat array of these.
+// Sections are bracketed by a begin and an end instruction that hold each
+// other's index, so the section body can be skipped or looped over without
+// recursion.
+template <typename string_type>
+class instruction {
+public:
+    opcode op = opcode::text;
+    // Same as component::standalone and component::dynamic_line
+    bool standalone = false;
+    bool dynamic_line = false;
+    // The text to render, or the section text for a section begin
+    text_view<string_type> text;
+    // Index into the template's tags, for everything but text
+    std::size_t tag = 0;
+    // Index of the matching section begin/end
+    std::size_t jump = 0;
+
+    bool is_newline() const {
+        return op == opcode::text && ((text.size() == 2 && text[0] == '\r' && text[1] == '\n') ||
+            (text.size() == 1 && (text[0] == '\n' || text[0] == '\r')));
+    }
+};
+
+template <typename string_type>
+class parser {
+public:
+    parser(const string_type& input, context_internal<string_type>& ctx, component<string_type>& root_component, string_type& error_message)
+    {
+        parse(input, ctx, root_component, error_message);
+    }
+
+private:
+    void parse(const string_type& input, context_internal<string_type>& ctx, component<string_type>& root_component, string_type& error_message) const {
+        using string_size_type = typename string_type::size_type;
+        using char_type = typename string_type::value_type;
+        using streamstring = std::basic_ostringstream<typename string_type::value_type>;
+
+        const string_type brace_delimiter_end_unescaped(3, '}');
+        const string_size_type input_size{input.size()};
+
+        bool current_delimiter_is_brace{ctx.delim_set.is_default()};
+
+        const char_type* const input_data = input.data();
+        std::vector<component<string_type>*> sections{&root_component};
+        std::vector<string_size_type> section_starts;
+
+        // Plain text is always contiguous in the input, so only its start
+        // position needs to be tracked until the run ends.
+        string_size_type current_text_position = string_type::npos;
+        string_size_type input_position = 0;
+
+        // Spaces and tabs are part of the text run. A run of only spaces and
+        // tabs may be on a standalone line, so it's split into a component
+        // per character for mark_lines(). A run with anything else in it
+        // can't be, and stays in one piece.
+        const auto process_current_text = [&current_text_position, &input_position, &sections, input_data]() {
+            if (current_text_position != string_type::npos) {
+                const char_type* const first = input_data + current_text_position;
+                const char_type* const last = input_data + input_position;
+                auto& children = sections.back()->children;
+                if (std::all_of(first, last, [](char_type ch) { return ch == ' ' || ch == '\t'; })) {
+                    for (const char_type* it = first; it != last; ++it) {
+                        children.push_back(component<string_type>{{it, 1}, static_cast<string_size_type>(it - input_data)});
+                    }
+                } else {
+                    children.push_back(component<string_type>{{first, static_cast<string_size_type>(last - first)}, current_text_position});
+                }
+                current_text_position = string_type::npos;
+            }
+        };
+
+        while (input_position != input_size) {
+            // Skip ahead to the next character that can start a tag or a newline
+            const char_type stop_chars[5] = {ctx.delim_set.begin[0], '\n', '\r', '\n', '\r'};
+            const string_size_type text_size = find_first_of_any(input_data + input_position, input_size - input_position, stop_chars);
+            if (text_size > 0) {
+                if (current_text_position == string_type::npos) {
+                    current_text_position = input_position;
+                }
+                input_position += text_size;
+                if (input_position == input_size) {
+                    break;
+                }
+            }
+
+            const char_type ch = input[input_position];
+            if (ch == ctx.delim_set.begin[0] && input.compare(input_position, ctx.delim_set.begin.size(), ctx.delim_set.begin) != 0) {
+                // Looks like a tag start delimiter but isn't one
+                if (current_text_position == string_type::npos) {
+                    current_text_position = input_position;
+                }
+                input_position++;
+                continue;
+            }
+
+            process_current_text();
+
+            if (ch != ctx.delim_set.begin[0]) {
+                const string_size_type newline_size = (ch == '\r' && input_position + 1 != input_size && input[input_position + 1] == '\n') ? 2 : 1;
+                const component<string_type> comp{{input_data + input_position, newline_size}, input_position};
+                sections.back()->children.push_back(comp);
+                input_position += newline_size;
+                continue;
+            }
+
+            // Find the next tag start delimiter
+            const string_size_type tag_location_start = input_position;
+
+            // Find the next tag end delimiter
+            string_size_type tag_contents_location{tag_location_start + ctx.delim_set.begin.size()};
+            const bool tag_is_unescaped_var{current_delimiter_is_brace && tag_location_start != (input_size - 2) && input.at(tag_contents_location) == ctx.delim_set.begin.at(0)};
+            const string_type& current_tag_delimiter_end{tag_is_unescaped_var ? brace_delimiter_end_unescaped : ctx.delim_set.end};
+            const auto current_tag_delimiter_end_size = current_tag_delimiter_end.size();
+            if (tag_is_unescaped_var) {
+                ++tag_contents_location;
+            }
+            const string_size_type tag_location_end{input.find(current_tag_delimiter_end, tag_contents_location)};
+            if (tag_location_end == string_type::npos) {
+                streamstring ss;
+                ss << "Unclosed tag at " << tag_location_start;
+                error_message.assign(ss.str());
+                return;
+            }
+
+            // Parse tag
+            const text_view<string_type> tag_contents{trim(text_view<string_type>{input_data + tag_contents_location, tag_location_end - tag_contents_location})};
+            component<string_type> comp;
+            if (!tag_contents.empty() && tag_contents[0] == '=') {
+                if (!parse_set_delimiter_tag(tag_contents, ctx.delim_set)) {
+                    streamstring ss;
+                    ss << "Invalid set delimiter tag at " << tag_location_start;
+                    error_message.assign(ss.str());
+                    return;
+                }
+                current_delimiter_is_brace = ctx.delim_set.is_default();
+                comp.tag.type = tag_type::set_delimiter;
+                comp.tag.delim_set.reset(new delimiter_set<string_type>(ctx.delim_set));
+            }
+            if (comp.tag.type != tag_type::set_delimiter) {
+                parse_tag_contents(tag_is_unescaped_var, tag_contents, comp.tag);
+            }
+            comp.position = tag_location_start;
+            sections.back()->children.push_back(comp);
+
+            // Start next search after this tag
+            input_position = tag_location_end + current_tag_delimiter_end_size;
+
+            // Push or pop sections
+            if (comp.tag.is_section_begin()) {
                 sections.push_back(&sections.back()->children.back());
                 section_starts.push_back(input_position);
             } else if (comp.tag.is_section_end()) {
                 if (sections.size() == 1) {
                     streamstring ss;
-                    ss << "Unopened section \"" << comp.tag.name << "\" at " << comp.position;
+                    ss << "Unopened section \"" << comp.tag.path.name() << "\" at " << comp.position;
                     error_message.assign(ss.str());
                     return;
                 }
-                sections.back()->tag.section_text.reset(new string_type(input.substr(section_starts.back(), tag_location_start - section_starts.back())));
-                sections.pop_back();
-                section_starts.pop_back();
+                sections.back()->tag.section_text = {input_data + section_starts.back(), tag_location_start - section_starts.back()};
+                sections.pop_back();
+                section_starts.pop_back();
+            }
+        }
+
+        process_current_text();
+
+        mark_lines(root_component);
+
+        // Check for sections without an ending tag
+        root_component.walk_children([&error_message](component<string_type>& comp) -> typename component<string_type>::walk_control {
+            if (!comp.tag.is_section_begin()) {
+                return component<string_type>::walk_control::walk;
+            }
+            if (comp.children.empty() || !comp.children.back().tag.is_section_end() || comp.children.back().tag.path.name() != comp.tag.path.name()) {
+                streamstring ss;
+                ss << "Unclosed section \"" << comp.tag.path.name() << "\" at " << comp.position;
+                error_message.assign(ss.str());
+                return component<string_type>::walk_control::stop;
+            }
+            comp.section_end_dynamic_line = comp.children.back().dynamic_line;
+            comp.children.pop_back(); // remove now useless end section component
+            return component<string_type>::walk_control::walk;
+        });
+        if (!error_message.empty()) {
+            return;
+        }
+    }
+
+    // A line with only whitespace, section tags, comments and set delimiter
+    // tags on it, and at least one section tag, is a standalone line: its
+    // whitespace is removed and its newline is marked so it isn't rendered.
+    // Lines with a partial on them are marked as dynamic, see
+    // line_buffer_state.
+    void mark_lines(component<string_type>& root_component) const {
+        std::vector<component<string_type>*> line;
+        const auto process_line = [&line]() {
+            bool has_section_tag = false;
+            bool has_partial = false;
+            bool only_whitespace_and_tags = true;
+            for (const auto comp : line) {
+                switch (comp->tag.type) {
+                    case tag_type::text:
+                        if (!comp->is_newline() && !comp->is_non_newline_whitespace()) {
+                            only_whitespace_and_tags = false;
+                        }
+                        break;
+                    case tag_type::section_begin:
+                    case tag_type::section_begin_inverted:
+                    case tag_type::section_end:
+                        has_section_tag = true;
+                        break;
+                    case tag_type::comment:
+                    case tag_type::set_delimiter:
+                        break;
+                    case tag_type::partial:
+                        has_partial = true;
+                        only_whitespace_and_tags = false;
+                        break;
+                    default:
+                        only_whitespace_and_tags = false;
+                        break;
+                }
+            }
+            for (const auto comp : line) {
+                if (has_section_tag && only_whitespace_and_tags) {
+                    comp->standalone = comp->is_text();
+                } else if (has_partial) {
+                    comp->dynamic_line = true;
+                }
+            }
+            line.clear();
+        };
+        root_component.walk_children([&line, &process_line](component<string_type>& comp) -> typename component<string_type>::walk_control {
+            line.push_back(&comp);
+            if (comp.is_newline()) {
+                process_line();
+            }
+            return component<string_type>::walk_control::walk;
+        });
+        process_line();
+        remove_standalone_whitespace(root_component);
+    }
+
+    void remove_standalone_whitespace(component<string_type>& comp) const {
+        auto& children = comp.children;
+        children.erase(std::remove_if(children.begin(), children.end(), [](const component<string_type>& child) {
+            return child.standalone && child.is_non_newline_whitespace();
+        }), children.end());
+        for (auto& child : children) {
+            remove_standalone_whitespace(child);
+        }
+    }
+
+    bool is_set_delimiter_valid(const string_type& delimiter) const {
+        // "Custom delimiters may not contain whitespace or the equals sign."
+        for (const auto ch : delimiter) {
+            if (ch == '=' || std::isspace(ch)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool parse_set_delimiter_tag(const text_view<string_type>& contents, delimiter_set<string_type>& delimiter_set) const {
+        // Smallest legal tag is "=X X="
+        if (contents.size() < 5) {
+            return false;
+        }
+        if (contents[contents.size() - 1] != '=') {
+            return false;
+        }
+        const auto contents_substr = trim(text_view<string_type>{contents.data() + 1, contents.size() - 2}).str();
+        const auto spacepos = contents_substr.find(' ');
+        if (spacepos == string_type::npos) {
+            return false;
+        }
+        const auto nonspace = contents_substr.find_first_not_of(' ', spacepos + 1);
+        assert(nonspace != string_type::npos);
+        const string_type begin = contents_substr.substr(0, spacepos);
+        const string_type end = contents_substr.substr(nonspace, contents_substr.size() - nonspace);
+        if (!is_set_delimiter_valid(begin) || !is_set_delimiter_valid(end)) {
+            return false;
+        }
+        delimiter_set.begin = begin;
+        delimiter_set.end = end;
+        return true;
+    }
+
+    void parse_tag_contents(bool is_unescaped_var, const text_view<string_type>& contents, mstch_tag<string_type>& tag) const {
+        string_type name;
+        if (is_unescaped_var) {
+            tag.type = tag_type::unescaped_variable;
+            name = contents.str();
+        } else if (contents.empty()) {
+            tag.type = tag_type::variable;
+        } else {
+            switch (contents[0]) {
+                case '#':
+                    tag.type = tag_type::section_begin;
+                    break;
+                case '^':
+                    tag.type = tag_type::section_begin_inverted;
+                    break;
+                case '/':
+                    tag.type = tag_type::section_end;
+                    break;
+                case '>':
+                    tag.type = tag_type::partial;
+                    break;
+                case '&':
+                    tag.type = tag_type::unescaped_variable;
+                    break;
+                case '!':
+                    tag.type = tag_type::comment;
+                    break;
+                default:
+                    tag.type = tag_type::variable;
+                    break;
+            }
+            if (tag.type == tag_type::comment) {
+                return;
+            }
+            if (tag.type == tag_type::variable) {
+                name = contents.str();
+            } else {
+                name = trim(text_view<string_type>{contents.data() + 1, contents.size() - 1}).str();
+            }
+        }
+        tag.path = tag_path<string_type>{std::move(name)};
+    }
+};
+
+// Output sinks for basic_mustache::render_to(). A sink is any type with
+//
+//     void append(const value_type* data, std::size_t size);
+//     void reserve(std::size_t size);
+//
+// where reserve() is a hint of how much output is coming and may do nothing.
+// The renderer is a template on the sink type, so appending isn't a virtual
+// or std::function call.
+
+// Appends to a string
+template <typename string_type>
+class basic_string_sink {
+public:
+    using value_type = typename string_type::value_type;
+
+    explicit basic_string_sink(string_type& str) : str_(str) {}
+
+    void append(const value_type* data, std::size_t size) {
+        str_.append(data, size);
+    }
+
+    void reserve(std::size_t size) {
+        if (str_.capacity() < str_.size() + size) {
+            str_.reserve(str_.size() + size);
+        }
+    }
+
+private:
+    string_type& str_;
+};
+
+// Writes to a stream buffer with sputn()
+template <typename string_type>
+class basic_streambuf_sink {
+public:
+    using value_type = typename string_type::value_type;
+
+    explicit basic_streambuf_sink(std::basic_streambuf<value_type>& buf) : buf_(buf) {}
+
+    void append(const value_type* data, std::size_t size) {
+        if (buf_.sputn(data, static_cast<std::streamsize>(size)) != static_cast<std::streamsize>(size)) {
+            failed_ = true;
+        }
+    }
+
+    void reserve(std::size_t) {}
+
+    // Whether the stream buffer didn't take some of the output
+    bool failed() const {
+        return failed_;
+    }
+
+private:
+    std::basic_streambuf<value_type>& buf_;
+    bool failed_ = false;
+};
+
+// Writes to a caller-provided buffer. Output that doesn't fit is dropped.
+template <typename string_type>
+class basic_fixed_buffer_sink {
+public:
+    using value_type = typename string_type::value_type;
+
+    basic_fixed_buffer_sink(value_type* buffer, std::size_t capacity) : buffer_(buffer), capacity_(capacity) {}
+
+    void append(const value_type* data, std::size_t size) {
+        const std::size_t room = capacity_ - size_;
+        if (size > room) {
+            size = room;
+            truncated_ = true;
+        }
+        std::copy(data, data + size, buffer_ + size_);
+        size_ += size;
+    }
+
+    void reserve(std::size_t) {}
+
+    const value_type* data() const {
+        return buffer_;
+    }
+
+    std::size_t size() const {
+        return size_;
+    }
+
+    // Whether some of the output didn't fit
+    bool truncated() const {
+        return truncated_;
+    }
+
+private:
+    value_type* buffer_;
+    std::size_t capacity_;
+    std::size_t size_ = 0;
+    bool truncated_ = false;
+};
+
+// Hands output to a std::function in pieces of about flush_size, so the
+// function isn't called for every fragment. Call flush() at the end.
+template <typename string_type>
+class basic_handler_sink {
+public:
+    using value_type = typename string_type::value_type;
+    using handler_type = std::function<void(const string_type&)>;
+
+    static const std::size_t flush_size = 4096;
+
+    explicit basic_handler_sink(const handler_type& handler) : handler_(handler) {}
+
+    void append(const value_type* data, std::size_t size) {
+        buffer_.append(data, size);
+        if (buffer_.size() >= flush_size) {
+            flush();
+        }
+    }
+
+    void reserve(std::size_t) {}
+
+    void flush() {
+        if (!buffer_.empty()) {
+            handler_(buffer_);
+            buffer_.clear();
+        }
+    }
+
+private:
+    handler_type handler_;
+    string_type buffer_;
+};
+
+template <typename string_type>
+const std::size_t basic_handler_sink<string_type>::flush_size;
+
+// Collects output as a list of (pointer, size) fragments instead of copying
+// it, for writing with writev() or sendmsg(). Besides append() the sink has
+//
+//     void append_ref(const value_type* data, std::size_t size);
+//     void retain(std::shared_ptr<const void> owner);
+//
+// which the renderer uses for template text and the strings of data values.
+// Those fragments point into the template, its partials and the data, so
+// the template and data must outlive the fragments; retain() keeps cached
+// partials alive. Escaped and lambda output is copied into blocks owned by
+// the sink, as are temporary strings and references shorter than
+// min_ref_size, so short pieces next to each other end up in one fragment.
+template <typename string_type>
+class basic_fragment_sink {
+public:
+    using value_type = typename string_type::value_type;
+
+    class fragment {
+    public:
+        const value_type* data;
+        std::size_t size;
+    };
+
+    static const std::size_t block_size = 4096;
+
+    explicit basic_fragment_sink(std::size_t min_ref_size = 64) : min_ref_size_(min_ref_size) {}
+
+    basic_fragment_sink(const basic_fragment_sink&) = delete;
+    basic_fragment_sink& operator=(const basic_fragment_sink&) = delete;
+
+    void append(const value_type* data, std::size_t size) {
+        if (size == 0) {
+            return;
+        }
+        if (block_used_ + size > block_capacity_) {
+            block_capacity_ = std::max(block_size, size);
+            blocks_.emplace_back(new value_type[block_capacity_]);
+            block_used_ = 0;
+        }
+        value_type* dest = blocks_.back().get() + block_used_;
+        std::copy(data, data + size, dest);
+        block_used_ += size;
+        add(dest, size);
+    }
+
+    void append_ref(const value_type* data, std::size_t size) {
+        if (size < min_ref_size_) {
+            append(data, size);
+        } else {
+            add(data, size);
+        }
+    }
+
+    void retain(std::shared_ptr<const void> owner) {
+        owners_.push_back(std::move(owner));
+    }
+
+    void reserve(std::size_t) {}
+
+    const std::vector<fragment>& fragments() const {
+        return fragments_;
+    }
+
+    // Total size of the fragments
+    std::size_t size() const {
+        return size_;
+    }
+
+    string_type str() const {
+        string_type result;
+        result.reserve(size_);
+        for (const auto& frag : fragments_) {
+            result.append(frag.data, frag.size);
+        }
+        return result;
+    }
+
+    void clear() {
+        fragments_.clear();
+        owners_.clear();
+        size_ = 0;
+        // keep the newest block for the next render
+        if (blocks_.size() > 1) {
+            blocks_.erase(blocks_.begin(), blocks_.end() - 1);
+        }
+        block_used_ = 0;
+    }
+
+private:
+    void add(const value_type* data, std::size_t size) {
+        if (size == 0) {
+            return;
+        }
+        size_ += size;
+        if (!fragments_.empty()) {
+            fragment& last = fragments_.back();
+            if (last.data + last.size == data) {
+                last.size += size;
+                return;
+            }
+        }
+        fragments_.push_back({data, size});
+    }
+
+    std::size_t min_ref_size_;
+    std::vector<fragment> fragments_;
+    std::vector<std::unique_ptr<value_type[]>> blocks_;
+    std::size_t block_used_ = 0;
+    std::size_t block_capacity_ = 0;
+    std::vector<std::shared_ptr<const void>> owners_;
+    std::size_t size_ = 0;
+};
+
+template <typename string_type>
+const std::size_t basic_fragment_sink<string_type>::block_size;
+
+#if defined(__unix__) || defined(__APPLE__)
+
+// Writes the fragments to a file descriptor with writev(), IOV_MAX at a
+// time. Short writes and EINTR are retried. Returns false on any other
+// error, with errno set, or if writev() writes nothing while data is left.
+template <typename string_type>
+bool write_fragments(int fd, const basic_fragment_sink<string_type>& sink) {
+#ifdef IOV_MAX
+    const std::size_t max_iov = IOV_MAX;
+#else
+    const std::size_t max_iov = 1024;
+#endif
+    using value_type = typename string_type::value_type;
+    const auto& fragments = sink.fragments();
+    std::vector<struct iovec> iov;
+    iov.reserve(std::min(fragments.size(), max_iov));
+    std::size_t next = 0;
+    while (next < fragments.size() || !iov.empty()) {
+        while (iov.size() < max_iov && next < fragments.size()) {
+            const auto& frag = fragments[next++];
+            if (frag.size == 0) {
+                continue;
+            }
+            struct iovec vec;
+            vec.iov_base = const_cast<value_type*>(frag.data);
+            vec.iov_len = frag.size * sizeof(value_type);
+            iov.push_back(vec);
+        }
+        if (iov.empty()) {
+            break;
+        }
+        const ssize_t written = ::writev(fd, iov.data(), static_cast<int>(iov.size()));
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        // nothing written while there's data left would repeat forever
+        if (written == 0) {
+            return false;
+        }
+        // drop what was written, and keep the rest for the next call
+        std::size_t remaining = static_cast<std::size_t>(written);
+        std::size_t done = 0;
+        while (done < iov.size() && remaining >= iov[done].iov_len) {
+            remaining -= iov[done].iov_len;
+            ++done;
+        }
+        if (done < iov.size()) {
+            iov[done].iov_base = static_cast<char*>(iov[done].iov_base) + remaining;
+            iov[done].iov_len -= remaining;
+        }
+        iov.erase(iov.begin(), iov.begin() + static_cast<std::ptrdiff_t>(done));
+    }
+    return true;
+}
+
+#endif
+
+// Whether a sink has append_ref() and retain(), like basic_fragment_sink
+template <typename sink_type>
+class sink_has_append_ref {
+    template <typename T>
+    static auto test(int) -> decltype(std::declval<T&>().append_ref(nullptr, std::size_t{}), std::true_type{});
+    template <typename>
+    static std::false_type test(...);
+public:
+    static const bool value = decltype(test<sink_type>(0))::value;
+};
+
+template <typename sink_type>
+const bool sink_has_append_ref<sink_type>::value;
+
+// Whether a sink has flush(), like basic_handler_sink
+template <typename sink_type>
+class sink_has_flush {
+    template <typename T>
+    static auto test(int) -> decltype(std::declval<T&>().flush(), std::true_type{});
+    template <typename>
+    static std::false_type test(...);
+public:
+    static const bool value = decltype(test<sink_type>(0))::value;
+};
+
+template <typename sink_type>
+const bool sink_has_flush<sink_type>::value;
+
+// Returned by basic_mustache::try_render
+template <typename string_type>
+class basic_render_result {
+public:
+    string_type output;
+    string_type error_message;
+
+    bool is_valid() const {
+        return error_message.empty();
+    }
+};
+
+// A render of basic_mustache::render_batch() that failed
+template <typename string_type>
+class basic_batch_error {
+public:
+    std::size_t index; // position of the data in the batch
+    string_type error_message;
+};
+
+// Returned by basic_mustache::render_batch()
+template <typename string_type>
+class basic_batch_result {
+public:
+    std::size_t renders = 0;
+    double seconds = 0;
+    // In the order of the data
+    std::vector<basic_batch_error<string_type>> errors;
+
+    bool is_valid() const {
+        return errors.empty();
+    }
+
+    double renders_per_second() const {
+        return seconds > 0 ? static_cast<double>(renders) / seconds : 0;
+    }
+};
+
+class partial_cache_stats {
+public:
+    std::size_t hits = 0;
+    std::size_t misses = 0;
+    std::size_t size = 0;
+};
+
+// Compiled partials, so a partial that's expanded many times is only parsed
+// once. Entries are keyed by the partial's name and a hash of its text, so a
+// partial that returns different text is parsed again. Once there are more
+// than max_size entries the least recently used one is dropped.
+//
+// Templates are rendered from many threads at once, so the cache is guarded
+// by a mutex. Each render also keeps the partials it has used in a memo, so
+// a partial expanded for every item of a list only takes the lock once.
+template <typename template_type>
+class partial_cache {
+public:
+    using string_type = typename template_type::string_type;
+    using template_ptr = std::shared_ptr<const template_type>;
+
+    static const std::size_t default_max_size = 128;
+
+private:
+    class key_type {
+    public:
+        string_type name;
+        std::size_t hash;
+
+        bool operator==(const key_type& other) const {
+            return hash == other.hash && name == other.name;
+        }
+    };
+
+    class key_hash {
+    public:
+        std::size_t operator()(const key_type& key) const {
+            return std::hash<string_type>{}(key.name) ^ (key.hash * 31);
+        }
+    };
+
+public:
+    class entry {
+    public:
+        key_type key;
+        template_ptr tmpl;
+    };
+
+    // The partials used by one render, or by several renders one after
+    // another. Each entry has the render it was last used in, so sinks that
+    // keep partials alive are given them once per render.
+    class memo {
+    public:
+        class used_entry {
+        public:
+            key_type key;
+            template_ptr tmpl;
+            std::size_t render;
+        };
+
+        std::vector<used_entry> entries;
+        std::size_t hits = 0;
+        std::size_t render = 0;
+    };
+
+    partial_cache() {}
+
+    // Copies start out empty, only the size is copied.
+    partial_cache(const partial_cache& other) : max_size_(other.max_size_.load()) {}
+
+    partial_cache& operator=(const partial_cache& other) {
+        if (this != &other) {
+            invalidate();
+            max_size_ = other.max_size_.load();
+        }
+        return *this;
+    }
+
+    // Sets first_use if the partial hasn't been used in the memo's current
+    // render yet
+    template_ptr get(const string_type& name, const string_type& text, memo& used, bool& first_use) {
+        const key_type key{name, std::hash<string_type>{}(text)};
+        const bool enabled = max_size_ != 0;
+        first_use = true;
+        if (enabled) {
+            for (auto& e : used.entries) {
+                if (e.key == key && *e.tmpl->source_ == text) {
+                    ++used.hits;
+                    first_use = e.render != used.render;
+                    e.render = used.render;
+                    return e.tmpl;
+                }
+            }
+        }
+        template_ptr tmpl = find(key, text);
+        if (!tmpl) {
+            // Parse outside of the lock. If another thread parses the same
+            // partial meanwhile, the later one wins, which is harmless.
+            tmpl = std::make_shared<const template_type>(text);
+            insert(key, tmpl);
+        }
+        if (enabled) {
+            used.entries.push_back({key, tmpl, used.render});
+        }
+        return tmpl;
+    }
+
+    // Adds the hits counted in a render's memo
+    void finish(const memo& used) {
+        hits_ += used.hits;
+    }
+
+    void set_max_size(std::size_t size) {
+        std::lock_guard<std::mutex> lock{mutex_};
+        max_size_ = size;
+        trim();
+    }
+
+    void invalidate() {
+        std::lock_guard<std::mutex> lock{mutex_};
+        entries_.clear();
+        index_.clear();
+    }
+
+    void invalidate(const string_type& name) {
+        std::lock_guard<std::mutex> lock{mutex_};
+        for (auto it = entries_.begin(); it != entries_.end();) {
+            if (it->key.name == name) {
+                index_.erase(it->key);
+                it = entries_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    partial_cache_stats stats() const {
+        std::lock_guard<std::mutex> lock{mutex_};
+        partial_cache_stats stats;
+        stats.hits = hits_;
+        stats.misses = misses_;
+        stats.size = entries_.size();
+        return stats;
+    }
+
+private:
+    template_ptr find(const key_type& key, const string_type& text) {
+        std::lock_guard<std::mutex> lock{mutex_};
+        const auto it = index_.find(key);
+        if (it != index_.end() && *it->second->tmpl->source_ == text) {
+            entries_.splice(entries_.begin(), entries_, it->second);
+            ++hits_;
+            return it->second->tmpl;
+        }
+        ++misses_;
+        return nullptr;
+    }
+
+    void insert(const key_type& key, const template_ptr& tmpl) {
+        std::lock_guard<std::mutex> lock{mutex_};
+        const auto it = index_.find(key);
+        if (it != index_.end()) {
+            // Same hash but different text, or parsed by another thread
+            entries_.erase(it->second);
+            index_.erase(it);
+        }
+        entries_.push_front({key, tmpl});
+        index_[key] = entries_.begin();
+        trim();
+    }
+
+    void trim() {
+        while (entries_.size() > max_size_) {
+            index_.erase(entries_.back().key);
+            entries_.pop_back();
+        }
+    }
+
+    std::list<entry> entries_;
+    std::unordered_map<key_type, typename std::list<entry>::iterator, key_hash> index_;
+    std::atomic<std::size_t> max_size_{default_max_size};
+    std::atomic<std::size_t> hits_{0};
+    std::atomic<std::size_t> misses_{0};
+    mutable std::mutex mutex_;
+};
+
+template <typename template_type>
+const std::size_t partial_cache<template_type>::default_max_size;
+
+// Threads for rendering list sections in parallel, see
+// basic_mustache::set_parallel_sections(). The thread calling for_each()
+// takes part in the work, so a pool of size 4 starts 3 threads. A pool can
+// be shared by any number of templates and rendering threads.
+class thread_pool {
+public:
+    explicit thread_pool(std::size_t size = std::thread::hardware_concurrency())
+        : size_(std::max<std::size_t>(size, 1))
+    {
+        for (std::size_t i = 1; i < size_; ++i) {
+            threads_.emplace_back([this]() {
+                work();
+            });
+        }
+    }
+
+    ~thread_pool() {
+        {
+            std::lock_guard<std::mutex> lock{mutex_};
+            stopping_ = true;
+        }
+        wake_.notify_all();
+        for (auto& thread : threads_) {
+            thread.join();
+        }
+    }
+
+    thread_pool(const thread_pool&) = delete;
+    thread_pool& operator=(const thread_pool&) = delete;
+
+    std::size_t size() const {
+        return size_;
+    }
+
+    // Calls fn(0) to fn(count - 1) and returns once they've all returned.
+    // Each thread claims the next index when it's free, so uneven items
+    // even out. The first exception thrown by fn is rethrown here.
+    void for_each(std::size_t count, const std::function<void(std::size_t)>& fn) {
+        if (count == 0) {
+            return;
+        }
+        const auto current = std::make_shared<job>(count, fn);
+        if (!threads_.empty() && count > 1) {
+            {
+                std::lock_guard<std::mutex> lock{mutex_};
+                jobs_.push_back(current);
+            }
+            wake_.notify_all();
+        }
+        help(*current);
+        {
+            std::unique_lock<std::mutex> lock{current->mutex};
+            current->finished.wait(lock, [&current]() {
+                return current->remaining == 0;
+            });
+        }
+        {
+            std::lock_guard<std::mutex> lock{mutex_};
+            const auto it = std::find(jobs_.begin(), jobs_.end(), current);
+            if (it != jobs_.end()) {
+                jobs_.erase(it);
+            }
+        }
+        if (current->error) {
+            std::rethrow_exception(current->error);
+        }
+    }
+
+private:
+    class job {
+    public:
+        job(std::size_t a_count, const std::function<void(std::size_t)>& a_fn)
+            : fn(a_fn), count(a_count), remaining(a_count) {}
+
+        const std::function<void(std::size_t)>& fn;
+        const std::size_t count;
+        std::atomic<std::size_t> next{0};
+        std::size_t remaining; // guarded by mutex
+        std::exception_ptr error;
+        std::mutex mutex;
+        std::condition_variable finished;
+    };
+
+    static void help(job& current) {
+        for (;;) {
+            const std::size_t index = current.next++;
+            if (index >= current.count) {
+                return;
+            }
+            std::exception_ptr error;
+            try {
+                current.fn(index);
+            } catch (...) {
+                error = std::current_exception();
+            }
+            std::lock_guard<std::mutex> lock{current.mutex};
+            if (error && !current.error) {
+                current.error = error;
+            }
+            if (--current.remaining == 0) {
+                current.finished.notify_all();
+            }
+        }
+    }
+
+    void work() {
+        for (;;) {
+            std::shared_ptr<job> current;
+            {
+                std::unique_lock<std::mutex> lock{mutex_};
+                wake_.wait(lock, [this]() {
+                    return stopping_ || !jobs_.empty();
+                });
+                if (stopping_) {
+                    return;
+                }
+                current = jobs_.front();
+                if (current->next >= current->count) {
+                    // every index is taken, the caller removes it when done
+                    jobs_.pop_front();
+                    continue;
+                }
+            }
+            help(*current);
+        }
+    }
+
+    const std::size_t size_;
+    std::vector<std::thread> threads_;
+    std::deque<std::shared_ptr<job>> jobs_;
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    bool stopping_ = false;
+};
+
+template <typename string_type>
+class basic_chunked_render;
+
+#if defined(KAINJOW_MUSTACHE_COROUTINES)
+
+// Returned by basic_mustache::render_generator(). A range of the chunks of
+// the output, each rendered when the iterator gets to it. Once the range
+// has been gone through, is_valid() and error_message() tell whether the
+// render failed.
+template <typename string_type>
+class basic_chunk_generator {
+public:
+    class promise_type {
+    public:
+        basic_chunk_generator get_return_object() {
+            return basic_chunk_generator{std::coroutine_handle<promise_type>::from_promise(*this)};
+        }
+        std::suspend_always initial_suspend() noexcept {
+            return {};
+        }
+        std::suspend_always final_suspend() noexcept {
+            return {};
+        }
+        std::suspend_always yield_value(const string_type& chunk) noexcept {
+            chunk_ = &chunk;
+            return {};
+        }
+        void return_value(string_type error_message) {
+            error_message_ = std::move(error_message);
+        }
+        void unhandled_exception() {
+            throw;
+        }
+
+    private:
+        friend class basic_chunk_generator;
+
+        const string_type* chunk_ = nullptr;
+        string_type error_message_;
+    };
+
+    using handle_type = std::coroutine_handle<promise_type>;
+
+    class iterator {
+    public:
+        using iterator_category = std::input_iterator_tag;
+        using value_type = string_type;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const string_type*;
+        using reference = const string_type&;
+
+        iterator() {}
+        explicit iterator(handle_type handle) : handle_(handle) {}
+
+        reference operator*() const {
+            return *handle_.promise().chunk_;
+        }
+        pointer operator->() const {
+            return handle_.promise().chunk_;
+        }
+        iterator& operator++() {
+            handle_.resume();
+            return *this;
+        }
+        void operator++(int) {
+            ++*this;
+        }
+        bool operator==(std::default_sentinel_t) const {
+            return !handle_ || handle_.done();
+        }
+
+    private:
+        handle_type handle_;
+    };
+
+    explicit basic_chunk_generator(handle_type handle) : handle_(handle) {}
+
+    basic_chunk_generator(basic_chunk_generator&& other) noexcept : handle_(other.handle_) {
+        other.handle_ = nullptr;
+    }
+
+    basic_chunk_generator& operator=(basic_chunk_generator&& other) noexcept {
+        if (this != &other) {
+            if (handle_) {
+                handle_.destroy();
+            }
+            handle_ = other.handle_;
+            other.handle_ = nullptr;
+        }
+        return *this;
+    }
+
+    ~basic_chunk_generator() {
+        if (handle_) {
+            handle_.destroy();
+        }
+    }
+
+    iterator begin() {
+        handle_.resume();
+        return iterator{handle_};
+    }
+
+    std::default_sentinel_t end() const {
+        return {};
+    }
+
+    bool is_valid() const {
+        return handle_.promise().error_message_.empty();
+    }
+
+    const string_type& error_message() const {
+        return handle_.promise().error_message_;
+    }
+
+private:
+    handle_type handle_;
+};
+
+#endif
+
+template <typename StringType>
+class basic_mustache {
+public:
+    using string_type = StringType;
+
+    basic_mustache(const string_type& input)
+        : basic_mustache() {
+        context<string_type> ctx;
+        context_internal<string_type> context{ctx};
+        parse(input, context);
+    }
+
+    bool is_valid() const {
+        return error_message_.empty();
+    }
+
+    const string_type& error_message() const {
+        return error_message_;
+    }
+
+    using escape_handler = std::function<string_type(const string_type&)>;
+    void set_custom_escape(const escape_handler& escape_fn) {
+        escape_ = escape_fn;
+        escape_append_ = [escape_fn](const string_type& text, string_type& out) {
+            out.append(escape_fn(text));
+        };
+    }
+
+    // Same as set_custom_escape, but escape_fn appends the escaped text to
+    // out instead of returning a new string, so rendering a variable doesn't
+    // create a temporary. out is a buffer that's reused for the whole render.
+    using escape_append_handler = std::function<void(const string_type& text, string_type& out)>;
+    void set_custom_escape_append(const escape_append_handler& escape_fn) {
+        escape_append_ = escape_fn;
+        escape_ = [escape_fn](const string_type& text) {
+            string_type out;
+            escape_fn(text, out);
+            return out;
+        };
+    }
+
+    // Partials are parsed the first time they're used and kept for later
+    // expansions and renders. A partial whose text changes is parsed again,
+    // but the old version stays cached until it's evicted or invalidated.
+    // A size of 0 turns caching off.
+    void set_partial_cache_size(std::size_t size) {
+        partials_.set_max_size(size);
+    }
+
+    void invalidate_partials() {
+        partials_.invalidate();
+    }
+
+    void invalidate_partial(const string_type& name) {
+        partials_.invalidate(name);
+    }
+
+    partial_cache_stats partial_cache_statistics() const {
+        return partials_.stats();
+    }
+
+    // Renders list sections with at least min_items items on the threads of
+    // pool. The list is split into chunks, each rendered with a copy of the
+    // context into its own buffer, and the buffers are written out in order,
+    // so the output is the same as rendering serially. Lambdas and partial
+    // functions are then called from several threads at once.
+    //
+    // Sections are rendered serially if the context can't be copied (see
+    // basic_context::clone()), or if they depend on the output before them:
+    // set delimiter tags, also in the partials the section uses, and lines
+    // that are only known to be standalone when rendering. When that's only
+    // found after rendering, as with lines and partial functions that set
+    // delimiters, the parallel result is dropped and the section rendered
+    // again serially, so lambdas and partial functions in it may be called
+    // twice. A null pool turns this off.
+    void set_parallel_sections(std::shared_ptr<thread_pool> pool, std::size_t min_items = 1024) {
+        pool_ = std::move(pool);
+        parallel_min_items_ = std::max<std::size_t>(min_items, 1);
+    }
+
+    template <typename stream_type>
+    stream_type& render(const basic_data<string_type>& data, stream_type& stream) {
+        if (is_valid()) {
+            context<string_type> ctx{&data};
+            ctx.use_key_lookup();
+            render_stream(ctx, stream);
+        }
+        return stream;
+    }
+
+    string_type render(const basic_data<string_type>& data) {
+        string_type output;
+        if (is_valid()) {
+            context<string_type> ctx{&data};
+            ctx.use_key_lookup();
+            basic_string_sink<string_type> sink{output};
+            render_sink(ctx, sink);
+        }
+        return output;
+    }
+
+    template <typename stream_type>
+    stream_type& render(basic_context<string_type>& ctx, stream_type& stream) {
+        render_stream(ctx, stream);
+        return stream;
+    }
+
+    string_type render(basic_context<string_type>& ctx) {
+        string_type output;
+        basic_string_sink<string_type> sink{output};
+        render_sink(ctx, sink);
+        return output;
+    }
+
+    using render_handler = std::function<void(const string_type&)>;
+    void render(const basic_data<string_type>& data, const render_handler& handler) {
+        if (!is_valid()) {
+            return;
+        }
+        context<string_type> ctx{&data};
+        ctx.use_key_lookup();
+        basic_handler_sink<string_type> sink{handler};
+        render_sink(ctx, sink);
+        sink.flush();
+    }
+
+    // The render() overloads above keep render errors in error_message(), so
+    // they can't be used on the same template from several threads. These
+    // don't change the template and return errors in the result instead, so
+    // one template can be rendered from any number of threads at once.
+    basic_render_result<string_type> try_render(const basic_data<string_type>& data) const {
+        context<string_type> ctx{&data};
+        ctx.use_key_lookup();
+        return try_render(ctx);
+    }
+
+    basic_render_result<string_type> try_render(const basic_data<string_type>& data, const render_handler& handler) const {
+        context<string_type> ctx{&data};
+        ctx.use_key_lookup();
+        return try_render(ctx, handler);
+    }
+
+    basic_render_result<string_type> try_render(basic_context<string_type>& ctx) const {
+        string_type output;
+        basic_string_sink<string_type> sink{output};
+        auto result = render_to(ctx, sink);
+        result.output = std::move(output);
+        return result;
+    }
+
+    basic_render_result<string_type> try_render(basic_context<string_type>& ctx, const render_handler& handler) const {
+        basic_handler_sink<string_type> sink{handler};
+        auto result = render_to(ctx, sink);
+        sink.flush();
+        return result;
+    }
+
+    // Same as try_render(), but writes the output to a sink such as
+    // basic_string_sink, basic_streambuf_sink or basic_fixed_buffer_sink.
+    template <typename sink_type>
+    basic_render_result<string_type> render_to(const basic_data<string_type>& data, sink_type& sink) const {
+        context<string_type> ctx{&data};
+        ctx.use_key_lookup();
+        return render_to(ctx, sink);
+    }
+
+    template <typename sink_type>
+    basic_render_result<string_type> render_to(basic_context<string_type>& ctx, sink_type& sink) const {
+        basic_render_result<string_type> result;
+        if (!is_valid()) {
+            result.error_message = error_message_;
+            return result;
+        }
+        context_internal<string_type> context{ctx};
+        render(sink, context);
+        result.error_message = std::move(context.error_message);
+        return result;
+    }
+
+    // Renders the template once for each data in [first, last), which must
+    // be random access iterators, into the sink returned by make_sink(i) for
+    // the data at first[i]. make_sink may return a sink or a reference to
+    // one. The renders are spread across the threads of pool, each of which
+    // reuses its context and interpreter state for all of its data, so
+    // there's no per-render setup besides the sink. make_sink is called from
+    // several of the pool's threads at once, once for each index, so it must
+    // be safe to call concurrently, for example by only using what belongs
+    // to index i, and each sink must be independent of the others. Sinks
+    // with flush(), like basic_handler_sink, are flushed after their render.
+    template <typename iterator_type, typename sink_factory_type>
+    basic_batch_result<string_type> render_batch(iterator_type first, iterator_type last, sink_factory_type make_sink, thread_pool& pool) const {
+        const auto start = std::chrono::steady_clock::now();
+        const std::size_t count = static_cast<std::size_t>(last - first);
+        const std::size_t tasks = std::min(count, pool.size() * 4);
+        std::vector<std::vector<basic_batch_error<string_type>>> task_errors(tasks);
+        pool.for_each(tasks, [&](std::size_t task) {
+            render_batch(first, count * task / tasks, count * (task + 1) / tasks, make_sink, task_errors[task]);
+        });
+        basic_batch_result<string_type> result;
+        result.renders = count;
+        for (auto& errors : task_errors) {
+            std::move(errors.begin(), errors.end(), std::back_inserter(result.errors));
+        }
+        result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        return result;
+    }
+
+    // Same as above on the calling thread
+    template <typename iterator_type, typename sink_factory_type>
+    basic_batch_result<string_type> render_batch(iterator_type first, iterator_type last, sink_factory_type make_sink) const {
+        const auto start = std::chrono::steady_clock::now();
+        basic_batch_result<string_type> result;
+        result.renders = static_cast<std::size_t>(last - first);
+        render_batch(first, 0, result.renders, make_sink, result.errors);
+        result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        return result;
+    }
+
+    // Renders the template a chunk at a time, see basic_chunked_render. The
+    // template and data must outlive the returned object.
+    basic_chunked_render<string_type> render_chunks(const basic_data<string_type>& data, std::size_t chunk_size = basic_chunked_render<string_type>::default_chunk_size) const {
+        return {*this, data, chunk_size};
+    }
+
+    basic_chunked_render<string_type> render_chunks(basic_context<string_type>& ctx, std::size_t chunk_size = basic_chunked_render<string_type>::default_chunk_size) const {
+        return {*this, ctx, chunk_size};
+    }
+
+#if defined(KAINJOW_MUSTACHE_COROUTINES)
+    // The same as render_chunks() as a coroutine:
+    //
+    //     for (const auto& chunk : tmpl.render_generator(data)) {
+    //         send(chunk);
+    //     }
+    basic_chunk_generator<string_type> render_generator(const basic_data<string_type>& data, std::size_t chunk_size = basic_chunked_render<string_type>::default_chunk_size) const {
+        basic_chunked_render<string_type> chunks{*this, data, chunk_size};
+        while (chunks.next()) {
+            co_yield chunks.chunk();
+        }
+        co_return chunks.error_message();
+    }
+#endif
+
+    basic_mustache()
+        : escape_(html_escape<string_type>)
+    {
+    }
+    
+private:
+    using string_size_type = typename string_type::size_type;
+
+    friend class partial_cache<basic_mustache>;
+    friend class basic_chunked_render<string_type>;
+
+
+    basic_mustache(const string_type& input, context_internal<string_type>& ctx)
+        : basic_mustache() {
+        parse(input, ctx);
+    }
+
+    void parse(const string_type& input, context_internal<string_type>& ctx) {
+        source_ = std::make_shared<const string_type>(input);
+        component<string_type> root_component;
+        parser<string_type> parser{*source_, ctx, root_component, error_message_};
+        if (is_valid()) {
+            compile(root_component);
+        }
+    }
+
+    void compile(const component<string_type>& comp) {
+        for (const auto& child : comp.children) {
+            if (child.is_text()) {
+                compile_text(child);
+                continue;
+            }
+            instruction<string_type> ins;
+            ins.dynamic_line = child.dynamic_line;
+            switch (child.tag.type) {
+                case tag_type::variable:
+                    ins.op = opcode::variable;
+                    break;
+                case tag_type::unescaped_variable:
+                    ins.op = opcode::unescaped_variable;
+                    break;
+                case tag_type::section_begin:
+                    ins.op = opcode::section_begin;
+                    break;
+                case tag_type::section_begin_inverted:
+                    ins.op = opcode::section_begin_inverted;
+                    break;
+                case tag_type::partial:
+                    ins.op = opcode::partial;
+                    break;
+                case tag_type::set_delimiter:
+                    ins.op = opcode::set_delimiter;
+                    break;
+                default:
+                    // Comments leave nothing to render
+                    continue;
+            }
+            ins.tag = tags_.size();
+            tags_.push_back(child.tag);
+            if (!child.tag.is_section_begin()) {
+                code_.push_back(ins);
+                continue;
+            }
+            ins.text = child.tag.section_text;
+            const auto begin = code_.size();
+            code_.push_back(ins);
+            compile(child);
+            instruction<string_type> end;
+            end.op = opcode::section_end;
+            end.dynamic_line = child.section_end_dynamic_line;
+            end.tag = ins.tag;
+            end.jump = begin;
+            code_[begin].jump = code_.size();
+            code_.push_back(end);
+        }
+    }
+
+    void compile_text(const component<string_type>& comp) {
+        // Join runs of plain text so they're rendered with a single append
+        if (!comp.standalone && !comp.dynamic_line && !code_.empty()) {
+            auto& last = code_.back();
+            if (last.op == opcode::text && !last.standalone && !last.dynamic_line && last.text.end() == comp.text.begin()) {
+                last.text = text_view<string_type>{last.text.data(), last.text.size() + comp.text.size()};
+                return;
+            }
+        }
+        instruction<string_type> ins;
+        ins.standalone = comp.standalone;
+        ins.dynamic_line = comp.dynamic_line;
+        ins.text = comp.text;
+        code_.push_back(ins);
+    }
+
+    void set_error(const context_internal<string_type>& ctx) {
+        if (!ctx.error_message.empty()) {
+            error_message_ = ctx.error_message;
+        }
+    }
+
+    template <typename sink_type>
+    void render_sink(basic_context<string_type>& ctx, sink_type& sink) {
+        context_internal<string_type> context{ctx};
+        render(sink, context);
+        set_error(context);
+    }
+
+    // Standard streams are written through their stream buffer, anything
+    // else with operator<<.
+    template <typename stream_type>
+    void render_stream(basic_context<string_type>& ctx, stream_type& stream) {
+        render_stream(ctx, stream, std::is_base_of<std::basic_ostream<typename string_type::value_type>, stream_type>{});
+    }
+
+    template <typename stream_type>
+    void render_stream(basic_context<string_type>& ctx, stream_type& stream, std::true_type) {
+        if (stream.rdbuf() == nullptr) {
+            render_stream(ctx, stream, std::false_type{});
+            return;
+        }
+        basic_streambuf_sink<string_type> sink{*stream.rdbuf()};
+        render_sink(ctx, sink);
+        if (sink.failed()) {
+            stream.setstate(std::ios_base::badbit);
+        }
+    }
+
+    template <typename stream_type>
+    void render_stream(basic_context<string_type>& ctx, stream_type& stream, std::false_type) {
+        const render_handler handler = [&stream](const string_type& str) {
+            stream << str;
+        };
+        basic_handler_sink<string_type> sink{handler};
+        render_sink(ctx, sink);
+        sink.flush();
+    }
+
+    string_type render(context_internal<string_type>& ctx) const {
+        string_type output;
+        basic_string_sink<string_type> sink{output};
+        render(sink, ctx);
+        return output;
+    }
+
+    using partial_memo = typename partial_cache<basic_mustache>::memo;
+
+    template <typename sink_type>
+    void render(sink_type& sink, context_internal<string_type>& ctx) const {
+        run_state state;
+        render(sink, ctx, state);
+    }
+
+    // The source and current item of a lazy list section. The item is
+    // pushed to the context, so it's allocated to stay in place.
+    class lazy_section {
+    public:
+        basic_list_source<string_type> source;
+        basic_data<string_type> item;
+    };
+
+    // A section that's being rendered
+    class section_state {
+    public:
+        std::size_t begin;                   // index of the section begin instruction
+        const basic_data<string_type>* list; // list being iterated, or null
+        std::size_t item;                    // index of the current list item
+        std::size_t end;                     // index after the last item to render
+        bool pushed;                         // whether a context was pushed for it
+        std::unique_ptr<lazy_section> lazy;  // the lazy list being iterated, or null
+    };
+
+    // Starts pulling the items of a lazy list. Returns null if it's empty.
+    static std::unique_ptr<lazy_section> open_lazy_list(const basic_data<string_type>& var) {
+        if (!var.lazy_list_value()) {
+            return nullptr;
+        }
+        std::unique_ptr<lazy_section> lazy{new lazy_section{var.lazy_list_value()(), basic_data<string_type>{}}};
+        if (!lazy->source || !lazy->source(lazy->item)) {
+            return nullptr;
+        }
+        return lazy;
+    }
+
+    // A template that's being run, this one or a partial
+    class frame {
+    public:
+        const basic_mustache* program;
+        std::shared_ptr<const basic_mustache> owner; // keeps a partial alive
+        std::size_t pc;                              // next instruction
+        std::size_t lookups;                         // index of its tags' lookup_entry
+    };
+
+    // Where a tag's name was last found. The result holds for the context
+    // items up to level as long as the item at level is the same one, which
+    // is the case while its id is unchanged, since items are only pushed and
+    // popped at the top. Only the items above it need to be searched again.
+    class lookup_entry {
+    public:
+        std::size_t level = 0;
+        std::size_t id = 0; // 0 if nothing is cached
+        const basic_data<string_type>* result = nullptr;
+    };
+
+    // Where a template's lookup entries start. Partials are kept alive until
+    // the render is done, so another partial can't get the same address and
+    // be given their entries.
+    class lookup_offset_entry {
+    public:
+        const basic_mustache* program;
+        std::shared_ptr<const basic_mustache> owner;
+        std::size_t offset;
+    };
+
+    // Everything the interpreter needs to carry on, so a render can be
+    // suspended between any two instructions and resumed later.
+    class run_state {
+    public:
+        std::vector<frame> frames;
+        std::vector<section_state> sections;
+        partial_memo partials;
+        bool failed = false;
+        bool parallel = true; // whether list sections may use the thread pool
+        // Lookup cache, used when the context supports resolve_from()
+        bool cache_lookups = false;
+        std::vector<lookup_entry> lookups;
+        std::vector<lookup_offset_entry> lookup_offsets;
+        std::size_t base_depth = 0;         // items in the context before the render
+        std::vector<std::size_t> level_ids; // ids of the items pushed since
+        std::size_t next_id = 1;
+        // A lazy list an inverted section found wasn't empty, with its first
+        // item, for the next section on the same list. Dropped when the
+        // context changes, since the data it was found at may be replaced.
+        const basic_data<string_type>* opened_list = nullptr;
+        std::unique_ptr<lazy_section> opened;
+    };
+
+    class never_suspend {
+    public:
+        bool operator()() const {
+            return false;
+        }
+    };
+
+    template <typename sink_type>
+    void render(sink_type& sink, context_internal<string_type>& ctx, run_state& state) const {
+        sink.reserve(source_ ? source_->size() : 0);
+        start(state, ctx);
+        run(sink, ctx, state, never_suspend{});
+        finish(sink, ctx, state);
+    }
+
+    // Renders first[begin] to first[end - 1] with one context and state
+    template <typename iterator_type, typename sink_factory_type>
+    void render_batch(iterator_type first, std::size_t begin, std::size_t end, sink_factory_type& make_sink, std::vector<basic_batch_error<string_type>>& errors) const {
+        context<string_type> ctx;
+        ctx.use_key_lookup();
+        context_internal<string_type> internal{ctx};
+        run_state state;
+        // the batch already keeps the threads busy
+        state.parallel = false;
+        for (std::size_t index = begin; index < end; ++index) {
+            auto&& sink = make_sink(index);
+            if (!is_valid()) {
+                errors.push_back({index, error_message_});
+                continue;
+            }
+            ctx.push(&first[static_cast<std::ptrdiff_t>(index)]);
+            render(sink, internal, state);
+            ctx.pop();
+            flush(sink, std::integral_constant<bool, sink_has_flush<typename std::decay<decltype(sink)>::type>::value>{});
+            if (!internal.error_message.empty()) {
+                errors.push_back({index, std::move(internal.error_message)});
+            }
+            internal.reset();
+        }
+    }
+
+    // Starts a render with state, which may have been used for another one
+    void start(run_state& state, context_internal<string_type>& ctx) const {
+        state.frames.clear();
+        state.sections.clear();
+        state.failed = false;
+        state.lookups.clear();
+        state.lookup_offsets.clear();
+        state.level_ids.clear();
+        // partials in the memo are retained again by this render's sink
+        ++state.partials.render;
+        state.base_depth = ctx.ctx.depth();
+        state.cache_lookups = state.base_depth > 0;
+        state.frames.push_back({this, nullptr, 0, lookup_offset(state, *this)});
+    }
+
+    // Returns where program's lookup entries start, adding them the first
+    // time it runs. owner is what keeps a partial alive.
+    static std::size_t lookup_offset(run_state& state, const basic_mustache& program, const std::shared_ptr<const basic_mustache>& owner = nullptr) {
+        if (!state.cache_lookups) {
+            return 0;
+        }
+        for (const auto& offset : state.lookup_offsets) {
+            if (offset.program == &program) {
+                return offset.offset;
+            }
+        }
+        const std::size_t offset = state.lookups.size();
+        state.lookups.resize(offset + program.tags_.size());
+        state.lookup_offsets.push_back({&program, owner, offset});
+        return offset;
+    }
+
+    // Takes the lazy list opened for var by an inverted section, or opens it
+    static std::unique_ptr<lazy_section> take_lazy_list(run_state& state, const basic_data<string_type>& var) {
+        if (state.opened_list == &var) {
+            state.opened_list = nullptr;
+            return std::move(state.opened);
+        }
+        return open_lazy_list(var);
+    }
+
+    // Whether the lazy list var has any items, keeping the first one for
+    // the next section on it
+    static bool has_lazy_items(run_state& state, const basic_data<string_type>& var) {
+        if (state.opened_list != &var) {
+            state.opened = open_lazy_list(var);
+            state.opened_list = state.opened ? &var : nullptr;
+            return state.opened != nullptr;
+        }
+        return true;
+    }
+
+    static void drop_opened_list(run_state& state) {
+        state.opened_list = nullptr;
+        state.opened.reset();
+    }
+
+    static void push_context(context_internal<string_type>& ctx, run_state& state, const basic_data<string_type>* data) {
+        drop_opened_list(state);
+        ctx.ctx.push(data);
+        if (state.cache_lookups) {
+            state.level_ids.push_back(state.next_id++);
+        }
+    }
+
+    static void pop_context(context_internal<string_type>& ctx, run_state& state) {
+        drop_opened_list(state);
+        ctx.ctx.pop();
+        if (state.cache_lookups) {
+            state.level_ids.pop_back();
+        }
+    }
+
+    // Resolves a tag's path, searching only the context items that were
+    // pushed since it was last found
+    static const basic_data<string_type>* resolve(context_internal<string_type>& ctx, run_state& state, std::size_t entry_index, const tag_path<string_type>& path) {
+        if (!state.cache_lookups || path.is_dot()) {
+            return ctx.ctx.resolve(path);
+        }
+        const std::size_t depth = state.base_depth + state.level_ids.size();
+        const auto level_id = [&state](std::size_t level) -> std::size_t {
+            // the items below the render never change during it
+            return level < state.base_depth ? std::size_t{1} : state.level_ids[level - state.base_depth] + 1;
+        };
+        lookup_entry& entry = state.lookups[entry_index];
+        std::size_t found = 0;
+        if (entry.id != 0 && entry.level < depth && level_id(entry.level) == entry.id) {
+            if (entry.level + 1 < depth) {
+                const auto var = ctx.ctx.resolve_from(path, entry.level + 1, found);
+                if (var) {
+                    return var;
+                }
+            }
+            return entry.result;
+        }
+        const auto var = ctx.ctx.resolve_from(path, 0, found);
+        // Remember the result for the items below the top one, which is the
+        // one that changes for every list item
+        if (depth >= 2 && (!var || found < depth - 1)) {
+            entry.level = depth - 2;
+            entry.id = level_id(depth - 2);
+            entry.result = var;
+        }
+        return var;
+    }
+
+    template <typename sink_type>
+    void finish(sink_type& sink, context_internal<string_type>& ctx, run_state& state) const {
+        partials_.finish(state.partials);
+        drop_opened_list(state);
+        // the memo is kept for the next render with the same state
+        state.partials.hits = 0;
+        // process the last line
+        if (ctx.line_buffer.active) {
+            render_current_line(sink, ctx, {});
+        }
+    }
+
+    // Runs instructions until the render is done or suspend() returns true,
+    // which it's asked after each one. Returns whether the render is done.
+    // Partials are run as frames of the same loop, with this template's
+    // escape function and partial cache.
+    template <typename sink_type, typename suspend_type>
+    bool run(sink_type& sink, context_internal<string_type>& ctx, run_state& state, const suspend_type& suspend) const {
+        auto& sections = state.sections;
+        while (!state.frames.empty() && !state.failed) {
+            const std::size_t top = state.frames.size() - 1;
+            const basic_mustache& program = *state.frames[top].program;
+            const auto& code = program.code_;
+            const auto& tags = program.tags_;
+            const std::size_t count = code.size();
+            std::size_t pc = state.frames[top].pc;
+            const std::size_t lookups = state.frames[top].lookups;
+            bool called = false;
+            while (pc < count) {
+                const instruction<string_type>& ins = code[pc];
+                if (ins.dynamic_line) {
+                    ctx.line_buffer.active = true;
+                }
+                const basic_data<string_type>* var = nullptr;
+                bool failed = false;
+                switch (ins.op) {
+                    case opcode::text:
+                        render_text(sink, ctx, ins);
+                        break;
+                    case opcode::variable:
+                    case opcode::unescaped_variable:
+                        if ((var = resolve(ctx, state, lookups + ins.tag, tags[ins.tag].path)) != nullptr) {
+                            failed = !render_variable(sink, var, ctx, ins.op == opcode::variable);
+                        }
+                        break;
+                    case opcode::section_begin:
+                        var = resolve(ctx, state, lookups + ins.tag, tags[ins.tag].path);
+                        if (var && (var->is_lambda() || var->is_lambda2())) {
+                            failed = !render_lambda(sink, var, ctx, render_lambda_escape::optional, ins.text.str(), true);
+                            pc = ins.jump;
+                        } else if (!var || var->is_false() || var->is_empty_list()) {
+                            pc = ins.jump;
+                        } else if (var->is_lazy_list()) {
+                            std::unique_ptr<lazy_section> lazy = take_lazy_list(state, *var);
+                            if (!lazy) {
+                                pc = ins.jump;
+                                break;
+                            }
+                            mark_section_tag(ctx);
+                            ++ctx.lazy_sections;
+                            const basic_data<string_type>* item = &lazy->item;
+                            sections.push_back({pc, nullptr, 0, 0, true, std::move(lazy)});
+                            push_context(ctx, state, item);
+                        } else {
+                            // account for the section begin tag
+                            mark_section_tag(ctx);
+                            if (var->is_non_empty_list()) {
+                                const std::size_t size = var->list_value().size();
+                                if (state.parallel && pool_ && size >= parallel_min_items_ && render_parallel(sink, ctx, program, pc, var, failed)) {
+                                    pc = ins.jump;
+                                    break;
+                                }
+                                sections.push_back({pc, var, 0, size, true, nullptr});
+                                push_context(ctx, state, &var->list_value().front());
+                            } else {
+                                sections.push_back({pc, nullptr, 0, 0, true, nullptr});
+                                push_context(ctx, state, var);
+                            }
+                        }
+                        break;
+                    case opcode::section_begin_inverted:
+                        var = resolve(ctx, state, lookups + ins.tag, tags[ins.tag].path);
+                        if (var && !var->is_false() && !var->is_empty_list() && (!var->is_lazy_list() || has_lazy_items(state, *var))) {
+                            pc = ins.jump;
+                        } else {
+                            // account for the section begin tag
+                            mark_section_tag(ctx);
+                            sections.push_back({pc, nullptr, 0, 0, var != nullptr, nullptr});
+                            if (var) {
+                                push_context(ctx, state, var);
+                            }
+                        }
+                        break;
+                    case opcode::section_end: {
+                        // account for the section end tag
+                        mark_section_tag(ctx);
+                        section_state& section = sections.back();
+                        if (section.pushed) {
+                            pop_context(ctx, state);
+                        }
+                        if (section.list && ++section.item < section.end) {
+                            mark_section_tag(ctx);
+                            push_context(ctx, state, &section.list->list_value()[section.item]);
+                            pc = section.begin;
+                        } else if (section.lazy && section.lazy->source(section.lazy->item)) {
+                            mark_section_tag(ctx);
+                            push_context(ctx, state, &section.lazy->item);
+                            pc = section.begin;
+                        } else {
+                            if (section.lazy) {
+                                --ctx.lazy_sections;
+                            }
+                            sections.pop_back();
+                        }
+                        break;
+                    }
+                    case opcode::partial: {
+                        // the partial's frame goes on top, so continue after it
+                        state.frames[top].pc = pc + 1;
+                        const std::size_t frames = state.frames.size();
+                        failed = !push_partial(sink, ctx, tags[ins.tag].path.name(), state);
+                        called = state.frames.size() != frames;
+                        break;
+                    }
+                    case opcode::set_delimiter:
+                        ctx.delim_set = *tags[ins.tag].delim_set;
+                        ctx.order_dependent = true;
+                        break;
+                }
+                if (failed) {
+                    state.failed = true;
+                    break;
+                }
+                ++pc;
+                if (called) {
+                    break;
+                }
+                if (suspend()) {
+                    state.frames[top].pc = pc;
+                    return false;
+                }
             }
-        }
-
-        process_current_text();
-
-        // Check for sections without an ending tag
-        root_component.walk_children([&error_message](component<string_type>& comp) -> typename component<string_type>::walk_control {
-            if (!comp.tag.is_section_begin()) {
-                return component<string_type>::walk_control::walk;
+            if (state.failed) {
+                break;
             }
-            if (comp.children.empty() || !comp.children.back().tag.is_section_end() || comp.children.back().tag.name != comp.tag.name) {
-                streamstring ss;
-                ss << "Unclosed section \"" << comp.tag.name << "\" at " << comp.position;
-                error_message.assign(ss.str());
-                return component<string_type>::walk_control::stop;
+            if (called) {
+                if (suspend()) {
+                    return false;
+                }
+            } else {
+                state.frames.pop_back();
             }
-            comp.children.pop_back(); // remove now useless end section component
-            return component<string_type>::walk_control::walk;
-        });
-        if (!error_message.empty()) {
-            return;
         }
-    }
-
-    bool is_set_delimiter_valid(const string_type& delimiter) const {
-        // "Custom delimiters may not contain whitespace or the equals sign."
-        for (const auto ch : delimiter) {
-            if (ch == '=' || std::isspace(ch)) {
-                return false;
+        if (state.failed) {
+            // Rendering stopped on an error, so leave the context as it was
+            for (const auto& section : sections) {
+                if (section.pushed) {
+                    pop_context(ctx, state);
+                }
+                if (section.lazy) {
+                    --ctx.lazy_sections;
+                }
             }
+            sections.clear();
+            state.frames.clear();
+            drop_opened_list(state);
         }
         return true;
     }
 
-    bool parse_set_delimiter_tag(const string_type& contents, delimiter_set<string_type>& delimiter_set) const {
-        // Smallest legal tag is "=X X="
-        if (contents.size() < 5) {
+    // Renders the list section starting at begin in chunks on the thread pool.
+    // Returns false if it has to be rendered serially instead.
+    template <typename sink_type>
+    bool render_parallel(sink_type& sink, context_internal<string_type>& ctx, const basic_mustache& program, std::size_t begin, const basic_data<string_type>* list, bool& failed) const {
+        const std::size_t end = program.code_[begin].jump;
+        std::vector<const basic_mustache*> checked;
+        if (sets_delimiters(ctx.ctx, program, begin + 1, end, checked)) {
             return false;
         }
-        if (contents.back() != '=') {
+        std::unique_ptr<basic_context<string_type>> first_ctx = ctx.ctx.clone();
+        if (!first_ctx) {
             return false;
         }
-        const auto contents_substr = trim(contents.substr(1, contents.size() - 2));
-        const auto spacepos = contents_substr.find(' ');
-        if (spacepos == string_type::npos) {
-            return false;
+        class chunk_result {
+        public:
+            string_type output;
+            string_type error_message;
+            line_buffer_state<string_type> line;
+            bool first_line_flushed = false;
+            bool order_dependent = false;
+        };
+        // The first chunk continues the current line. The others start as if
+        // the chunk before them ended between lines, which is checked below.
+        line_buffer_state<string_type> start;
+        start.active = ctx.line_buffer.active;
+        start.contained_section_tag = ctx.line_buffer.active;
+        const auto& items = list->list_value();
+        const std::size_t min_chunk_items = 16;
+        const std::size_t chunk_items = std::max(min_chunk_items, items.size() / (pool_->size() * 4));
+        const std::size_t chunks = (items.size() + chunk_items - 1) / chunk_items;
+        std::vector<chunk_result> results(chunks);
+        pool_->for_each(chunks, [&](std::size_t index) {
+            const std::size_t first = index * chunk_items;
+            std::unique_ptr<basic_context<string_type>> chunk_ctx = index == 0 ? std::move(first_ctx) : ctx.ctx.clone();
+            context_internal<string_type> chunk{*chunk_ctx};
+            chunk.delim_set = ctx.delim_set;
+            chunk.line_buffer = index == 0 ? ctx.line_buffer : start;
+            chunk_result& result = results[index];
+            basic_string_sink<string_type> chunk_sink{result.output};
+            run_state state;
+            state.parallel = false;
+            state.base_depth = chunk_ctx->depth();
+            state.cache_lookups = state.base_depth > 0;
+            state.frames.push_back({&program, nullptr, begin + 1, lookup_offset(state, program)});
+            state.sections.push_back({begin, list, first, std::min(items.size(), first + chunk_items), true, nullptr});
+            push_context(chunk, state, &items[first]);
+            // stop at the end of the section
+            run(chunk_sink, chunk, state, [&state]() {
+                return state.sections.empty();
+            });
+            partials_.finish(state.partials);
+            result.error_message = std::move(chunk.error_message);
+            result.line = std::move(chunk.line_buffer);
+            result.first_line_flushed = chunk.first_line_flushed;
+            result.order_dependent = chunk.order_dependent;
+        });
+        for (std::size_t index = 0; index < chunks; ++index) {
+            const chunk_result& result = results[index];
+            if (result.order_dependent) {
+                return false;
+            }
+            // The chunk rendered as it would have serially if the chunk before
+            // it ended the way it started, or if both flushed the line they
+            // share, as the first line's leading whitespace was all it held
+            if (index > 0) {
+                const auto& before = results[index - 1].line;
+                if (!(before == start) && !(before.flushed && start.active && result.first_line_flushed)) {
+                    return false;
+                }
+            }
         }
-        const auto nonspace = contents_substr.find_first_not_of(' ', spacepos + 1);
-        assert(nonspace != string_type::npos);
-        const string_type begin = contents_substr.substr(0, spacepos);
-        const string_type end = contents_substr.substr(nonspace, contents_substr.size() - nonspace);
-        if (!is_set_delimiter_valid(begin) || !is_set_delimiter_valid(end)) {
-            return false;
+        ctx.line_buffer = std::move(results.back().line);
+        for (const auto& result : results) {
+            sink.append(result.output.data(), result.output.size());
+            if (!result.error_message.empty()) {
+                ctx.error_message = result.error_message;
+                failed = true;
+                break;
+            }
         }
-        delimiter_set.begin = begin;
-        delimiter_set.end = end;
         return true;
     }
 
-    void parse_tag_contents(bool is_unescaped_var, const string_type& contents, mstch_tag<string_type>& tag) const {
-        if (is_unescaped_var) {
-            tag.type = tag_type::unescaped_variable;
-            tag.name = contents;
-        } else if (contents.empty()) {
-            tag.type = tag_type::variable;
-            tag.name.clear();
-        } else {
-            switch (contents.at(0)) {
-                case '#':
-                    tag.type = tag_type::section_begin;
-                    break;
-                case '^':
-                    tag.type = tag_type::section_begin_inverted;
-                    break;
-                case '/':
-                    tag.type = tag_type::section_end;
-                    break;
-                case '>':
-                    tag.type = tag_type::partial;
-                    break;
-                case '&':
-                    tag.type = tag_type::unescaped_variable;
-                    break;
-                case '!':
-                    tag.type = tag_type::comment;
-                    break;
-                default:
-                    tag.type = tag_type::variable;
-                    break;
+    // Whether the code from first to last sets delimiters, itself or in the
+    // partials it uses. Partial functions aren't called for this, so
+    // delimiters they set are only found when rendering.
+    bool sets_delimiters(const basic_context<string_type>& ctx, const basic_mustache& program, std::size_t first, std::size_t last, std::vector<const basic_mustache*>& checked) const {
+        checked.push_back(&program);
+        for (std::size_t pc = first; pc < last; ++pc) {
+            const auto& ins = program.code_[pc];
+            if (ins.op == opcode::set_delimiter) {
+                return true;
             }
-            if (tag.type == tag_type::variable) {
-                tag.name = contents;
-            } else {
-                string_type name{contents};
-                name.erase(name.begin());
-                tag.name = trim(name);
+            if (ins.op != opcode::partial) {
+                continue;
+            }
+            const string_type& name = program.tags_[ins.tag].path.name();
+            const basic_data<string_type>* var = ctx.get_partial(name);
+            if (var == nullptr || !var->is_string_like()) {
+                continue;
+            }
+            partial_memo used;
+            bool first_use;
+            const auto tmpl = partials_.get(name, var->is_string() ? var->string_value() : var->text_value().str(), used, first_use);
+            if (std::find(checked.begin(), checked.end(), tmpl.get()) == checked.end() && sets_delimiters(ctx, *tmpl, 0, tmpl->code_.size(), checked)) {
+                return true;
             }
         }
-    }
-};
-
-template <typename StringType>
-class basic_mustache {
-public:
-    using string_type = StringType;
-
-    basic_mustache(const string_type& input)
-        : basic_mustache() {
-        context<string_type> ctx;
-        context_internal<string_type> context{ctx};
-        parser<string_type> parser{input, context, root_component_, error_message_};
+        return false;
     }
 
-    bool is_valid() const {
-        return error_message_.empty();
+    template <typename sink_type>
+    bool push_partial(sink_type& sink, context_internal<string_type>& ctx, const string_type& name, run_state& state) const {
+        const basic_data<string_type>* var = ctx.ctx.get_partial(name);
+        if (var == nullptr || (!var->is_partial() && !var->is_string_like())) {
+            return true;
+        }
+        const auto& partial_result = var->is_partial() ? var->partial_value()() : var->is_string() ? var->string_value() : var->text_value().str();
+        bool first_use;
+        auto tmpl = partials_.get(name, partial_result, state.partials, first_use);
+        if (!tmpl->is_valid()) {
+            ctx.error_message = tmpl->error_message();
+            return false;
+        }
+        // The cache may drop the partial while the sink still points to its
+        // text. Partials already used in this render were retained then.
+        if (first_use) {
+            retain(sink, tmpl, std::integral_constant<bool, sink_has_append_ref<sink_type>::value>{});
+        }
+        const basic_mustache* program = tmpl.get();
+        const std::size_t lookups = lookup_offset(state, *program, tmpl);
+        state.frames.push_back({program, std::move(tmpl), 0, lookups});
+        return true;
     }
 
-    const string_type& error_message() const {
-        return error_message_;
+    template <typename sink_type>
+    void render_current_line(sink_type& sink, context_internal<string_type>& ctx, const text_view<string_type>& newline) const {
+        // We're at the end of a buffered line, so check the line buffer state
+        // to see if the line had tags in it, and also if the line is now empty
+        // or contains whitespace only. if this situation is true, skip the line.
+        if (ctx.line_buffer.flushed || !ctx.line_buffer.contained_section_tag || !ctx.line_buffer.is_empty_or_contains_only_whitespace()) {
+            sink.append(ctx.line_buffer.data.data(), ctx.line_buffer.data.size());
+            sink.append(newline.data(), newline.size());
+        }
+        ctx.line_buffer.clear();
+        ctx.line_ended = true;
     }
 
-    using escape_handler = std::function<string_type(const string_type&)>;
-    void set_custom_escape(const escape_handler& escape_fn) {
-        escape_ = escape_fn;
+    // Writes out the buffered line if the text appended to it from the given
+    // position has more than whitespace, after which the line streams.
+    template <typename sink_type>
+    void flush_line(sink_type& sink, context_internal<string_type>& ctx, std::size_t from) const {
+        auto& line = ctx.line_buffer;
+        const auto other = std::find_if(line.data.begin() + static_cast<std::ptrdiff_t>(from), line.data.end(), [](typename string_type::value_type ch) {
+            return ch != ' ' && ch != '\t';
+        });
+        if (other == line.data.end()) {
+            return;
+        }
+        sink.append(line.data.data(), line.data.size());
+        line.data.clear();
+        line.flushed = true;
+        if (!ctx.line_ended) {
+            ctx.first_line_flushed = true;
+        }
     }
 
-    template <typename stream_type>
-    stream_type& render(const basic_data<string_type>& data, stream_type& stream) {
-        render(data, [&stream](const string_type& str) {
-            stream << str;
-        });
-        return stream;
+    template <typename sink_type>
+    void render_result(sink_type& sink, context_internal<string_type>& ctx, const string_type& text) const {
+        render_result(sink, ctx, text_view<string_type>{text.data(), text.size()});
     }
 
-    string_type render(const basic_data<string_type>& data) {
-        std::basic_ostringstream<typename string_type::value_type> ss;
-        return render(data, ss).str();
+    template <typename sink_type>
+    void render_result(sink_type& sink, context_internal<string_type>& ctx, const text_view<string_type>& text) const {
+        if (ctx.line_buffer.buffering()) {
+            const std::size_t from = ctx.line_buffer.data.size();
+            ctx.line_buffer.data.append(text.data(), text.size());
+            flush_line(sink, ctx, from);
+        } else {
+            sink.append(text.data(), text.size());
+        }
     }
 
-    template <typename stream_type>
-    stream_type& render(basic_context<string_type>& ctx, stream_type& stream) {
-        context_internal<string_type> context{ctx};
-        render([&stream](const string_type& str) {
-            stream << str;
-        }, context);
-        return stream;
+    // Renders text that outlives the render, i.e. template text or the string
+    // of a data value, which sinks like basic_fragment_sink can point to
+    // rather than copy.
+    template <typename sink_type>
+    void render_ref(sink_type& sink, context_internal<string_type>& ctx, const text_view<string_type>& text) const {
+        if (ctx.line_buffer.buffering()) {
+            const std::size_t from = ctx.line_buffer.data.size();
+            ctx.line_buffer.data.append(text.data(), text.size());
+            flush_line(sink, ctx, from);
+        } else {
+            append_ref(sink, text.data(), text.size(), std::integral_constant<bool, sink_has_append_ref<sink_type>::value>{});
+        }
     }
 
-    string_type render(basic_context<string_type>& ctx) {
-        std::basic_ostringstream<typename string_type::value_type> ss;
-        return render(ctx, ss).str();
+    template <typename sink_type>
+    static void append_ref(sink_type& sink, const typename string_type::value_type* data, std::size_t size, std::true_type) {
+        sink.append_ref(data, size);
     }
 
-    using render_handler = std::function<void(const string_type&)>;
-    void render(const basic_data<string_type>& data, const render_handler& handler) {
-        if (!is_valid()) {
-            return;
-        }
-        context<string_type> ctx{&data};
-        context_internal<string_type> context{ctx};
-        render(handler, context);
+    template <typename sink_type>
+    static void append_ref(sink_type& sink, const typename string_type::value_type* data, std::size_t size, std::false_type) {
+        sink.append(data, size);
     }
 
-    basic_mustache()
-        : escape_(html_escape<string_type>)
-    {
+    template <typename sink_type>
+    static void retain(sink_type& sink, std::shared_ptr<const void> owner, std::true_type) {
+        sink.retain(std::move(owner));
     }
-    
-private:
-    using string_size_type = typename string_type::size_type;
 
+    template <typename sink_type>
+    static void retain(sink_type&, std::shared_ptr<const void>, std::false_type) {}
 
-    basic_mustache(const string_type& input, context_internal<string_type>& ctx)
-        : basic_mustache() {
-        parser<string_type> parser{input, ctx, root_component_, error_message_};
+    template <typename sink_type>
+    static void flush(sink_type& sink, std::true_type) {
+        sink.flush();
     }
 
-    string_type render(context_internal<string_type>& ctx) {
-        std::basic_ostringstream<typename string_type::value_type> ss;
-        render([&ss](const string_type& str) {
-            ss << str;
-        }, ctx);
-        return ss.str();
-    }
+    template <typename sink_type>
+    static void flush(sink_type&, std::false_type) {}
 
-    void render(const render_handler& handler, context_internal<string_type>& ctx, bool root_renderer = true) {
-        root_component_.walk_children([&handler, &ctx, this](component<string_type>& comp) -> typename component<string_type>::walk_control {
-            return render_component(handler, ctx, comp);
+    template <typename sink_type>
+    void render_text(sink_type& sink, context_internal<string_type>& ctx, const instruction<string_type>& comp) const {
+        if (comp.standalone) {
+            // A partial on a dynamic line expanded to a standalone line
+            if (ctx.line_buffer.buffering() && ctx.line_buffer.is_empty_or_contains_only_whitespace()) {
+                ctx.line_buffer.clear();
+                ctx.line_ended = true;
+            }
+            return;
+        }
+        if (!ctx.line_buffer.active) {
+            render_ref(sink, ctx, comp.text);
+            return;
+        }
+        if (comp.is_newline()) {
+            render_current_line(sink, ctx, comp.text);
+            return;
+        }
+        // Merged text may finish the buffered line and start new ones
+        const auto& text = comp.text;
+        const auto newline = std::find_if(text.begin(), text.end(), [](typename string_type::value_type ch) {
+            return ch == '\n' || ch == '\r';
         });
-        // process the last line, but only for the top-level renderer
-        if (root_renderer) {
-            render_current_line(handler, ctx, nullptr);
+        if (newline == text.end()) {
+            render_ref(sink, ctx, text);
+            return;
         }
+        const auto newline_end = newline + ((*newline == '\r' && newline + 1 != text.end() && newline[1] == '\n') ? 2 : 1);
+        render_result(sink, ctx, text_view<string_type>{text.begin(), static_cast<string_size_type>(newline - text.begin())});
+        render_current_line(sink, ctx, {newline, static_cast<string_size_type>(newline_end - newline)});
+        render_ref(sink, ctx, text_view<string_type>{newline_end, static_cast<string_size_type>(text.end() - newline_end)});
     }
 
-    void render_current_line(const render_handler& handler, context_internal<string_type>& ctx, const component<string_type>* comp) const {
-        // We're at the end of a line, so check the line buffer state to see
-        // if the line had tags in it, and also if the line is now empty or
-        // contains whitespace only. if this situation is true, skip the line.
-        bool output = true;
-        if (ctx.line_buffer.contained_section_tag && ctx.line_buffer.is_empty_or_contains_only_whitespace()) {
-            output = false;
+    template <typename sink_type>
+    void render_escaped(sink_type& sink, context_internal<string_type>& ctx, const string_type& text, bool outlives_render) const {
+        if (escape_append_) {
+            render_custom_escaped(sink, ctx, text);
+        } else {
+            render_escaped(sink, ctx, text_view<string_type>{text.data(), text.size()}, outlives_render);
         }
-        if (output) {
-            handler(ctx.line_buffer.data);
-            if (comp) {
-                handler(comp->text);
+    }
+
+    template <typename sink_type>
+    void render_escaped(sink_type& sink, context_internal<string_type>& ctx, const text_view<string_type>& text, bool outlives_render) const {
+        if (escape_append_) {
+            // custom escape functions take a string
+            render_custom_escaped(sink, ctx, text.str());
+        } else if (ctx.line_buffer.buffering()) {
+            const std::size_t from = ctx.line_buffer.data.size();
+            html_escape_append(text.data(), text.size(), ctx.line_buffer.data);
+            flush_line(sink, ctx, from);
+        } else {
+            // the text up to the first character to escape is used as is
+            const std::size_t run = find_first_of_any(text.data(), text.size(), html_escape_chars<typename string_type::value_type>());
+            if (outlives_render) {
+                append_ref(sink, text.data(), run, std::integral_constant<bool, sink_has_append_ref<sink_type>::value>{});
+            } else {
+                sink.append(text.data(), run);
+            }
+            if (run < text.size()) {
+                html_escape_append(text.data() + run, text.size() - run, sink);
             }
         }
-        ctx.line_buffer.clear();
     }
 
-    void render_result(context_internal<string_type>& ctx, const string_type& text) const {
-        ctx.line_buffer.data.append(text);
+    template <typename sink_type>
+    void render_custom_escaped(sink_type& sink, context_internal<string_type>& ctx, const string_type& text) const {
+        if (ctx.line_buffer.buffering()) {
+            const std::size_t from = ctx.line_buffer.data.size();
+            escape_append_(text, ctx.line_buffer.data);
+            flush_line(sink, ctx, from);
+        } else {
+            ctx.escape_buffer.clear();
+            escape_append_(text, ctx.escape_buffer);
+            sink.append(ctx.escape_buffer.data(), ctx.escape_buffer.size());
+        }
     }
 
-    typename component<string_type>::walk_control render_component(const render_handler& handler, context_internal<string_type>& ctx, component<string_type>& comp) {
-        if (comp.is_text()) {
-            if (comp.is_newline()) {
-                render_current_line(handler, ctx, &comp);
-            } else {
-                render_result(ctx, comp.text);
-            }
-            return component<string_type>::walk_control::walk;
+    void escape_append(const string_type& text, string_type& out) const {
+        if (escape_append_) {
+            escape_append_(text, out);
+        } else {
+            html_escape_append(text.data(), text.size(), out);
         }
+    }
 
-        const mstch_tag<string_type>& tag{comp.tag};
-        const basic_data<string_type>* var = nullptr;
-        switch (tag.type) {
-            case tag_type::variable:
-            case tag_type::unescaped_variable:
-                if ((var = ctx.ctx.get(tag.name)) != nullptr) {
-                    if (!render_variable(handler, var, ctx, tag.type == tag_type::variable)) {
-                        return component<string_type>::walk_control::stop;
-                    }
-                }
-                break;
-            case tag_type::section_begin:
-                if ((var = ctx.ctx.get(tag.name)) != nullptr) {
-                    if (var->is_lambda() || var->is_lambda2()) {
-                        if (!render_lambda(handler, var, ctx, render_lambda_escape::optional, *comp.tag.section_text, true)) {
-                            return component<string_type>::walk_control::stop;
-                        }
-                    } else if (!var->is_false() && !var->is_empty_list()) {
-                        render_section(handler, ctx, comp, var);
-                    }
-                }
-                return component<string_type>::walk_control::skip;
-            case tag_type::section_begin_inverted:
-                if ((var = ctx.ctx.get(tag.name)) == nullptr || var->is_false() || var->is_empty_list()) {
-                    render_section(handler, ctx, comp, var);
-                }
-                return component<string_type>::walk_control::skip;
-            case tag_type::partial:
-                if ((var = ctx.ctx.get_partial(tag.name)) != nullptr && (var->is_partial() || var->is_string())) {
-                    const auto& partial_result = var->is_partial() ? var->partial_value()() : var->string_value();
-                    basic_mustache tmpl{partial_result};
-                    tmpl.set_custom_escape(escape_);
-                    if (!tmpl.is_valid()) {
-                        error_message_ = tmpl.error_message();
-                    } else {
-                        tmpl.render(handler, ctx, false);
-                        if (!tmpl.is_valid()) {
-                            error_message_ = tmpl.error_message();
-                        }
-                    }
-                    if (!tmpl.is_valid()) {
-                        return component<string_type>::walk_control::stop;
-                    }
-                }
-                break;
-            case tag_type::set_delimiter:
-                ctx.delim_set = *comp.tag.delim_set;
-                break;
-            default:
-                break;
-        }
+    void copy_escape(const basic_mustache& other) {
+        escape_ = other.escape_;
+        escape_append_ = other.escape_append_;
+    }
 
-        return component<string_type>::walk_control::walk;
+    void mark_section_tag(context_internal<string_type>& ctx) const {
+        if (ctx.line_buffer.active) {
+            ctx.line_buffer.contained_section_tag = true;
+        }
     }
 
     enum class render_lambda_escape {
@@ -1064,17 +5053,18 @@ private:
         optional,
     };
 
-    bool render_lambda(const render_handler& handler, const basic_data<string_type>* var, context_internal<string_type>& ctx, render_lambda_escape escape, const string_type& text, bool parse_with_same_context) {
+    template <typename sink_type>
+    bool render_lambda(sink_type& sink, const basic_data<string_type>* var, context_internal<string_type>& ctx, render_lambda_escape escape, const string_type& text, bool parse_with_same_context) const {
         const typename basic_renderer<string_type>::type2 render2 = [this, &ctx, parse_with_same_context, escape](const string_type& text, bool escaped) {
             const auto process_template = [this, &ctx, escape, escaped](basic_mustache& tmpl) -> string_type {
                 if (!tmpl.is_valid()) {
-                    error_message_ = tmpl.error_message();
+                    ctx.error_message = tmpl.error_message();
                     return {};
                 }
                 context_internal<string_type> render_ctx{ctx.ctx}; // start a new line_buffer
                 const auto str = tmpl.render(render_ctx);
-                if (!tmpl.is_valid()) {
-                    error_message_ = tmpl.error_message();
+                if (!render_ctx.error_message.empty()) {
+                    ctx.error_message = render_ctx.error_message;
                     return {};
                 }
                 bool do_escape = false;
@@ -1093,11 +5083,11 @@ private:
             };
             if (parse_with_same_context) {
                 basic_mustache tmpl{text, ctx};
-                tmpl.set_custom_escape(escape_);
+                tmpl.copy_escape(*this);
                 return process_template(tmpl);
             }
             basic_mustache tmpl{text};
-            tmpl.set_custom_escape(escape_);
+            tmpl.copy_escape(*this);
             return process_template(tmpl);
         };
         const typename basic_renderer<string_type>::type1 render = [&render2](const string_type& text) {
@@ -1105,72 +5095,187 @@ private:
         };
         if (var->is_lambda2()) {
             const basic_renderer<string_type> renderer{render, render2};
-            render_result(ctx, var->lambda2_value()(text, renderer));
+            render_result(sink, ctx, var->lambda2_value()(text, renderer));
         } else {
-            render_current_line(handler, ctx, nullptr);
-            render_result(ctx, render(var->lambda_value()(text)));
+            if (ctx.line_buffer.active) {
+                render_current_line(sink, ctx, {});
+            }
+            render_result(sink, ctx, render(var->lambda_value()(text)));
         }
-        return error_message_.empty();
+        return ctx.error_message.empty();
     }
 
-    bool render_variable(const render_handler& handler, const basic_data<string_type>* var, context_internal<string_type>& ctx, bool escaped) {
+    template <typename sink_type>
+    bool render_variable(sink_type& sink, const basic_data<string_type>* var, context_internal<string_type>& ctx, bool escaped) const {
         if (var->is_string()) {
             const auto& varstr = var->string_value();
-            render_result(ctx, escaped ? escape_(varstr) : varstr);
+            const bool outlives_render = !var->is_temporary() && ctx.lazy_sections == 0;
+            if (escaped) {
+                render_escaped(sink, ctx, varstr, outlives_render);
+            } else if (!outlives_render) {
+                render_result(sink, ctx, varstr);
+            } else {
+                render_ref(sink, ctx, text_view<string_type>{varstr.data(), varstr.size()});
+            }
+        } else if (var->is_borrowed_string()) {
+            const auto text = var->borrowed_string_value();
+            const bool outlives_render = ctx.lazy_sections == 0;
+            if (escaped) {
+                render_escaped(sink, ctx, text, outlives_render);
+            } else if (!outlives_render) {
+                render_result(sink, ctx, text);
+            } else {
+                render_ref(sink, ctx, text);
+            }
+        } else if (var->is_number()) {
+            // numbers have nothing to escape
+            char text[number_buffer_size];
+            const std::size_t size = format_number(*var, text);
+            typename string_type::value_type chars[number_buffer_size];
+            std::copy(text, text + size, chars);
+            render_result(sink, ctx, text_view<string_type>{chars, size});
         } else if (var->is_lambda()) {
             const render_lambda_escape escape_opt = escaped ? render_lambda_escape::escape : render_lambda_escape::unescape;
-            return render_lambda(handler, var, ctx, escape_opt, {}, false);
+            return render_lambda(sink, var, ctx, escape_opt, {}, false);
         } else if (var->is_lambda2()) {
             using streamstring = std::basic_ostringstream<typename string_type::value_type>;
             streamstring ss;
             ss << "Lambda with render argument is not allowed for regular variables";
-            error_message_ = ss.str();
+            ctx.error_message = ss.str();
             return false;
         }
         return true;
     }
 
-    void render_section(const render_handler& handler, context_internal<string_type>& ctx, component<string_type>& incomp, const basic_data<string_type>* var) {
-        const auto callback = [&handler, &ctx, this](component<string_type>& comp) -> typename component<string_type>::walk_control {
-            return render_component(handler, ctx, comp);
-        };
-        if (var && var->is_non_empty_list()) {
-            for (const auto& item : var->list_value()) {
-                // account for the section begin tag
-                ctx.line_buffer.contained_section_tag = true;
+private:
+    string_type error_message_;
+    // The instructions refer to the text in here. It's shared so that copies
+    // of a template don't duplicate it.
+    std::shared_ptr<const string_type> source_;
+    std::vector<instruction<string_type>> code_;
+    std::vector<mstch_tag<string_type>> tags_;
+    mutable partial_cache<basic_mustache> partials_;
+    escape_handler escape_;
+    // Null for html_escape, which is written straight to the output
+    escape_append_handler escape_append_;
+    std::shared_ptr<thread_pool> pool_;
+    std::size_t parallel_min_items_ = 0;
+};
 
-                const context_pusher<string_type> ctxpusher{ctx, &item};
-                incomp.walk_children(callback);
+// Renders a template a chunk at a time, so large output can be sent as
+// it's produced and a slow reader holds the render back. Each call to next()
+// runs the template until chunk_size characters are ready or the render is
+// over, suspending between two instructions, also inside list sections and
+// partials. Memory use stays around chunk_size plus the largest value or
+// lambda result, which is produced whole.
+//
+//     auto chunks = tmpl.render_chunks(data);
+//     while (chunks.next()) {
+//         send(chunks.chunk());
+//     }
+//     if (!chunks.is_valid()) { ... }
+//
+// The template and data (or context) must outlive the render.
+template <typename string_type>
+class basic_chunked_render {
+public:
+    static const std::size_t default_chunk_size = 16384;
 
-                // ctx may have been cleared. account for the section end tag
-                ctx.line_buffer.contained_section_tag = true;
-            }
-        } else if (var) {
-            // account for the section begin tag
-            ctx.line_buffer.contained_section_tag = true;
+    basic_chunked_render(const basic_mustache<string_type>& tmpl, const basic_data<string_type>& data, std::size_t chunk_size = default_chunk_size)
+        : basic_chunked_render(tmpl, make_context(data), chunk_size)
+    {
+    }
 
-            const context_pusher<string_type> ctxpusher{ctx, var};
-            incomp.walk_children(callback);
+    basic_chunked_render(const basic_mustache<string_type>& tmpl, basic_context<string_type>& ctx, std::size_t chunk_size = default_chunk_size)
+        : tmpl_(&tmpl)
+        , chunk_size_(std::max<std::size_t>(chunk_size, 1))
+        , state_(new state{ctx})
+    {
+        start();
+    }
 
-            // ctx may have been cleared. account for the section end tag
-            ctx.line_buffer.contained_section_tag = true;
-        } else {
-            // account for the section begin tag
-            ctx.line_buffer.contained_section_tag = true;
+    // Renders the next chunk. Returns false when there's no more output,
+    // because the render is over or has failed.
+    bool next() {
+        state& st = *state_;
+        st.chunk.clear();
+        if (st.done) {
+            return false;
+        }
+        basic_string_sink<string_type> sink{st.chunk};
+        const string_type& chunk = st.chunk;
+        const std::size_t limit = chunk_size_;
+        if (tmpl_->run(sink, st.ctx, st.run, [&chunk, limit]() {
+            return chunk.size() >= limit;
+        })) {
+            tmpl_->finish(sink, st.ctx, st.run);
+            st.done = true;
+        }
+        return !st.chunk.empty();
+    }
 
-            incomp.walk_children(callback);
+    // The output of the last call to next()
+    const string_type& chunk() const {
+        return state_->chunk;
+    }
 
-            // ctx may have been cleared. account for the section end tag
-            ctx.line_buffer.contained_section_tag = true;
-        }
+    bool done() const {
+        return state_->done;
+    }
+
+    bool is_valid() const {
+        return state_->ctx.error_message.empty();
+    }
+
+    const string_type& error_message() const {
+        return state_->ctx.error_message;
     }
 
 private:
-    string_type error_message_;
-    component<string_type> root_component_;
-    escape_handler escape_;
+    class state {
+    public:
+        std::unique_ptr<basic_context<string_type>> owned_ctx;
+        context_internal<string_type> ctx;
+        typename basic_mustache<string_type>::run_state run;
+        string_type chunk;
+        bool done = false;
+
+        explicit state(basic_context<string_type>& a_ctx) : ctx(a_ctx) {}
+    };
+
+    static std::unique_ptr<basic_context<string_type>> make_context(const basic_data<string_type>& data) {
+        context<string_type>* ctx = new context<string_type>{&data};
+        ctx->use_key_lookup();
+        return std::unique_ptr<basic_context<string_type>>{ctx};
+    }
+
+    basic_chunked_render(const basic_mustache<string_type>& tmpl, std::unique_ptr<basic_context<string_type>> ctx, std::size_t chunk_size)
+        : basic_chunked_render(tmpl, *ctx, chunk_size)
+    {
+        state_->owned_ctx = std::move(ctx);
+    }
+
+    void start() {
+        state& st = *state_;
+        if (!tmpl_->is_valid()) {
+            st.ctx.error_message = tmpl_->error_message();
+            st.done = true;
+            return;
+        }
+        st.chunk.reserve(chunk_size_);
+        // a parallel section would be rendered whole, past the chunk size
+        st.run.parallel = false;
+        tmpl_->start(st.run, st.ctx);
+    }
+
+    const basic_mustache<string_type>* tmpl_;
+    std::size_t chunk_size_;
+    std::unique_ptr<state> state_;
 };
 
+template <typename string_type>
+const std::size_t basic_chunked_render<string_type>::default_chunk_size;
+
 using mustache = basic_mustache<std::string>;
 using data = basic_data<mustache::string_type>;
 using object = basic_object<mustache::string_type>;
@@ -1179,7 +5284,23 @@ using partial = basic_partial<mustache::string_type>;
 using renderer = basic_renderer<mustache::string_type>;
 using lambda = basic_lambda<mustache::string_type>;
 using lambda2 = basic_lambda2<mustache::string_type>;
+using lazy_list = basic_lazy_list<mustache::string_type>;
+using shape = basic_shape<mustache::string_type>;
+using list_source = basic_list_source<mustache::string_type>;
 using lambda_t = basic_lambda_t<mustache::string_type>;
+using render_result = basic_render_result<mustache::string_type>;
+using string_sink = basic_string_sink<mustache::string_type>;
+using streambuf_sink = basic_streambuf_sink<mustache::string_type>;
+using fixed_buffer_sink = basic_fixed_buffer_sink<mustache::string_type>;
+using handler_sink = basic_handler_sink<mustache::string_type>;
+using fragment_sink = basic_fragment_sink<mustache::string_type>;
+using chunked_render = basic_chunked_render<mustache::string_type>;
+using batch_result = basic_batch_result<mustache::string_type>;
+using batch_error = basic_batch_error<mustache::string_type>;
+using json_document = basic_json_document<mustache::string_type>;
+#if defined(KAINJOW_MUSTACHE_COROUTINES)
+using chunk_generator = basic_chunk_generator<mustache::string_type>;
+#endif
 
 using mustachew = basic_mustache<std::wstring>;
 using dataw = basic_data<mustachew::string_type>;
@@ -1187,4 +5308,62 @@ using dataw = basic_data<mustachew::string_type>;
 } // namespace mustache
 } // namespace kainjow
 
+// Lists the fields of a struct so it can be rendered with basic_data::bind():
+//
+//     struct item { std::string name; int count; std::vector<item> children; };
+//     KAINJOW_MUSTACHE_FIELDS(item, name, count, children)
+//
+// Use it in the struct's namespace, after the struct. Fields can be strings,
+// bools, numbers, other bound structs, std::vector and std::optional of any
+// of those. Up to 32 fields are supported.
+#define KAINJOW_MUSTACHE_FIELDS(struct_type, ...) \
+    template <typename string_type> \
+    const ::kainjow::mustache::basic_binding<string_type>& mustache_fields(const struct_type*, const string_type*) { \
+        static const ::kainjow::mustache::basic_field<string_type> fields[] = { \
+            KAINJOW_MUSTACHE_EXPAND(KAINJOW_MUSTACHE_CONCAT(KAINJOW_MUSTACHE_FIELDS_, KAINJOW_MUSTACHE_COUNT(__VA_ARGS__))(struct_type, __VA_ARGS__)) \
+        }; \
+        static const ::kainjow::mustache::basic_binding<string_type> binding{fields, sizeof(fields) / sizeof(fields[0]), nullptr}; \
+        return binding; \
+    }
+
+#define KAINJOW_MUSTACHE_FIELD(struct_type, field) \
+    {#field, sizeof(#field) - 1, [](const void* object) -> const void* { return &static_cast<const struct_type*>(object)->field; }, &::kainjow::mustache::make_bound_data<string_type, decltype(struct_type::field)>}
+#define KAINJOW_MUSTACHE_EXPAND(x) x
+#define KAINJOW_MUSTACHE_CONCAT_(a, b) a##b
+#define KAINJOW_MUSTACHE_CONCAT(a, b) KAINJOW_MUSTACHE_CONCAT_(a, b)
+#define KAINJOW_MUSTACHE_COUNT_(_1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11, _12, _13, _14, _15, _16, _17, _18, _19, _20, _21, _22, _23, _24, _25, _26, _27, _28, _29, _30, _31, _32, count, ...) count
+#define KAINJOW_MUSTACHE_COUNT(...) KAINJOW_MUSTACHE_EXPAND(KAINJOW_MUSTACHE_COUNT_(__VA_ARGS__, 32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17, 16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1))
+#define KAINJOW_MUSTACHE_FIELDS_1(struct_type, field) KAINJOW_MUSTACHE_FIELD(struct_type, field)
+#define KAINJOW_MUSTACHE_FIELDS_2(struct_type, field, ...) KAINJOW_MUSTACHE_FIELD(struct_type, field), KAINJOW_MUSTACHE_EXPAND(KAINJOW_MUSTACHE_FIELDS_1(struct_type, __VA_ARGS__))
+#define KAINJOW_MUSTACHE_FIELDS_3(struct_type, field, ...) KAINJOW_MUSTACHE_FIELD(struct_type, field), KAINJOW_MUSTACHE_EXPAND(KAINJOW_MUSTACHE_FIELDS_2(struct_type, __VA_ARGS__))
+#define KAINJOW_MUSTACHE_FIELDS_4(struct_type, field, ...) KAINJOW_MUSTACHE_FIELD(struct_type, field), KAINJOW_MUSTACHE_EXPAND(KAINJOW_MUSTACHE_FIELDS_3(struct_type, __VA_ARGS__))
+#define KAINJOW_MUSTACHE_FIELDS_5(struct_type, field, ...) KAINJOW_MUSTACHE_FIELD(struct_type, field), KAINJOW_MUSTACHE_EXPAND(KAINJOW_MUSTACHE_FIELDS_4(struct_type, __VA_ARGS__))
+#define KAINJOW_MUSTACHE_FIELDS_6(struct_type, field, ...) KAINJOW_MUSTACHE_FIELD(struct_type, field), KAINJOW_MUSTACHE_EXPAND(KAINJOW_MUSTACHE_FIELDS_5(struct_type, __VA_ARGS__))
+#define KAINJOW_MUSTACHE_FIELDS_7(struct_type, field, ...) KAINJOW_MUSTACHE_FIELD(struct_type, field), KAINJOW_MUSTACHE_EXPAND(KAINJOW_MUSTACHE_FIELDS_6(struct_type, __VA_ARGS__))
+#define KAINJOW_MUSTACHE_FIELDS_8(struct_type, field, ...) KAINJOW_MUSTACHE_FIELD(struct_type, field), KAINJOW_MUSTACHE_EXPAND(KAINJOW_MUSTACHE_FIELDS_7(struct_type, __VA_ARGS__))
+#define KAINJOW_MUSTACHE_FIELDS_9(struct_type, field, ...) KAINJOW_MUSTACHE_FIELD(struct_type, field), KAINJOW_MUSTACHE_EXPAND(KAINJOW_MUSTACHE_FIELDS_8(struct_type, __VA_ARGS__))
+#define KAINJOW_MUSTACHE_FIELDS_10(struct_type, field, ...) KAINJOW_MUSTACHE_FIELD(struct_type, field), KAINJOW_MUSTACHE_EXPAND(KAINJOW_MUSTACHE_FIELDS_9(struct_type, __VA_ARGS__))
+#define KAINJOW_MUSTACHE_FIELDS_11(struct_type, field, ...) KAINJOW_MUSTACHE_FIELD(struct_type, field), KAINJOW_MUSTACHE_EXPAND(KAINJOW_MUSTACHE_FIELDS_10(struct_type, __VA_ARGS__))
+#define KAINJOW_MUSTACHE_FIELDS_12(struct_type, field, ...) KAINJOW_MUSTACHE_FIELD(struct_type, field), KAINJOW_MUSTACHE_EXPAND(KAINJOW_MUSTACHE_FIELDS_11(struct_type, __VA_ARGS__))
+#define KAINJOW_MUSTACHE_FIELDS_13(struct_type, field, ...) KAINJOW_MUSTACHE_FIELD(struct_type, field), KAINJOW_MUSTACHE_EXPAND(KAINJOW_MUSTACHE_FIELDS_12(struct_type, __VA_ARGS__))
+#define KAINJOW_MUSTACHE_FIELDS_14(struct_type, field, ...) KAINJOW_MUSTACHE_FIELD(struct_type, field), KAINJOW_MUSTACHE_EXPAND(KAINJOW_MUSTACHE_FIELDS_13(struct_type, __VA_ARGS__))
+#define KAINJOW_MUSTACHE_FIELDS_15(struct_type, field, ...) KAINJOW_MUSTACHE_FIELD(struct_type, field), KAINJOW_MUSTACHE_EXPAND(KAINJOW_MUSTACHE_FIELDS_14(struct_type, __VA_ARGS__))
+#define KAINJOW_MUSTACHE_FIELDS_16(struct_type, field, ...) KAINJOW_MUSTACHE_FIELD(struct_type, field), KAINJOW_MUSTACHE_EXPAND(KAINJOW_MUSTACHE_FIELDS_15(struct_type, __VA_ARGS__))
+#define KAINJOW_MUSTACHE_FIELDS_17(struct_type, field, ...) KAINJOW_MUSTACHE_FIELD(struct_type, field), KAINJOW_MUSTACHE_EXPAND(KAINJOW_MUSTACHE_FIELDS_16(struct_type, __VA_ARGS__))
+#define KAINJOW_MUSTACHE_FIELDS_18(struct_type, field, ...) KAINJOW_MUSTACHE_FIELD(struct_type, field), KAINJOW_MUSTACHE_EXPAND(KAINJOW_MUSTACHE_FIELDS_17(struct_type, __VA_ARGS__))
+#define KAINJOW_MUSTACHE_FIELDS_19(struct_type, field, ...) KAINJOW_MUSTACHE_FIELD(struct_type, field), KAINJOW_MUSTACHE_EXPAND(KAINJOW_MUSTACHE_FIELDS_18(struct_type, __VA_ARGS__))
+#define KAINJOW_MUSTACHE_FIELDS_20(struct_type, field, ...) KAINJOW_MUSTACHE_FIELD(struct_type, field), KAINJOW_MUSTACHE_EXPAND(KAINJOW_MUSTACHE_FIELDS_19(struct_type, __VA_ARGS__))
+#define KAINJOW_MUSTACHE_FIELDS_21(struct_type, field, ...) KAINJOW_MUSTACHE_FIELD(struct_type, field), KAINJOW_MUSTACHE_EXPAND(KAINJOW_MUSTACHE_FIELDS_20(struct_type, __VA_ARGS__))
+#define KAINJOW_MUSTACHE_FIELDS_22(struct_type, field, ...) KAINJOW_MUSTACHE_FIELD(struct_type, field), KAINJOW_MUSTACHE_EXPAND(KAINJOW_MUSTACHE_FIELDS_21(struct_type, __VA_ARGS__))
+#define KAINJOW_MUSTACHE_FIELDS_23(struct_type, field, ...) KAINJOW_MUSTACHE_FIELD(struct_type, field), KAINJOW_MUSTACHE_EXPAND(KAINJOW_MUSTACHE_FIELDS_22(struct_type, __VA_ARGS__))
+#define KAINJOW_MUSTACHE_FIELDS_24(struct_type, field, ...) KAINJOW_MUSTACHE_FIELD(struct_type, field), KAINJOW_MUSTACHE_EXPAND(KAINJOW_MUSTACHE_FIELDS_23(struct_type, __VA_ARGS__))
+#define KAINJOW_MUSTACHE_FIELDS_25(struct_type, field, ...) KAINJOW_MUSTACHE_FIELD(struct_type, field), KAINJOW_MUSTACHE_EXPAND(KAINJOW_MUSTACHE_FIELDS_24(struct_type, __VA_ARGS__))
+#define KAINJOW_MUSTACHE_FIELDS_26(struct_type, field, ...) KAINJOW_MUSTACHE_FIELD(struct_type, field), KAINJOW_MUSTACHE_EXPAND(KAINJOW_MUSTACHE_FIELDS_25(struct_type, __VA_ARGS__))
+#define KAINJOW_MUSTACHE_FIELDS_27(struct_type, field, ...) KAINJOW_MUSTACHE_FIELD(struct_type, field), KAINJOW_MUSTACHE_EXPAND(KAINJOW_MUSTACHE_FIELDS_26(struct_type, __VA_ARGS__))
+#define KAINJOW_MUSTACHE_FIELDS_28(struct_type, field, ...) KAINJOW_MUSTACHE_FIELD(struct_type, field), KAINJOW_MUSTACHE_EXPAND(KAINJOW_MUSTACHE_FIELDS_27(struct_type, __VA_ARGS__))
+#define KAINJOW_MUSTACHE_FIELDS_29(struct_type, field, ...) KAINJOW_MUSTACHE_FIELD(struct_type, field), KAINJOW_MUSTACHE_EXPAND(KAINJOW_MUSTACHE_FIELDS_28(struct_type, __VA_ARGS__))
+#define KAINJOW_MUSTACHE_FIELDS_30(struct_type, field, ...) KAINJOW_MUSTACHE_FIELD(struct_type, field), KAINJOW_MUSTACHE_EXPAND(KAINJOW_MUSTACHE_FIELDS_29(struct_type, __VA_ARGS__))
+#define KAINJOW_MUSTACHE_FIELDS_31(struct_type, field, ...) KAINJOW_MUSTACHE_FIELD(struct_type, field), KAINJOW_MUSTACHE_EXPAND(KAINJOW_MUSTACHE_FIELDS_30(struct_type, __VA_ARGS__))
+#define KAINJOW_MUSTACHE_FIELDS_32(struct_type, field, ...) KAINJOW_MUSTACHE_FIELD(struct_type, field), KAINJOW_MUSTACHE_EXPAND(KAINJOW_MUSTACHE_FIELDS_31(struct_type, __VA_ARGS__))
+
 #endif // KAINJOW_MUSTACHE_HPP
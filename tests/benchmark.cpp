@@ -0,0 +1,1282 @@
+/*
+ * Boost Software License - Version 1.0
+ *
+ * Copyright 2015-2020 Kevin Wojniak
+ *
+ * Permission is hereby granted, free of charge, to any person or organization
+ * obtaining a copy of the software and accompanying documentation covered by
+ * this license (the "Software") to use, reproduce, display, distribute,
+ * execute, and transmit the Software, and to prepare derivative works of the
+ * Software, and to permit third-parties to whom the Software is furnished to
+ * do so, all subject to the following:
+ *
+ * The copyright notices in the Software and this entire statement, including
+ * the above license grant, this restriction and the following disclaimer,
+ * must be included in all copies of the Software, in whole or in part, and
+ * all derivative works of the Software, unless such copies or derivative
+ * works are solely in the form of machine-executable object code generated by
+ * a source language processor.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, TITLE AND NON-INFRINGEMENT. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDERS OR ANYONE DISTRIBUTING THE SOFTWARE BE LIABLE
+ * FOR ANY DAMAGES OR OTHER LIABILITY, WHETHER IN CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include "mustache.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// Counts allocated bytes, for comparing how much memory data takes
+namespace {
+std::atomic<std::size_t> allocated_bytes{0};
+}
+
+void* operator new(std::size_t size) {
+    allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+    if (void* ptr = std::malloc(size == 0 ? 1 : size)) {
+        return ptr;
+    }
+    throw std::bad_alloc{};
+}
+
+// GCC doesn't see that these pair with the operator new above
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpragmas"
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void operator delete(void* ptr) noexcept {
+    std::free(ptr);
+}
+
+#if defined(__cpp_sized_deallocation)
+void operator delete(void* ptr, std::size_t) noexcept {
+    std::free(ptr);
+}
+#endif
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+using namespace kainjow::mustache;
+
+namespace {
+
+// Runs fn until at least min_seconds have passed and returns the average
+// seconds per call.
+template <typename Fn>
+double time_per_call(Fn fn, double min_seconds = 0.5) {
+    using clock = std::chrono::steady_clock;
+    std::size_t calls = 0;
+    const auto start = clock::now();
+    std::chrono::duration<double> elapsed{0};
+    do {
+        fn();
+        ++calls;
+        elapsed = clock::now() - start;
+    } while (elapsed.count() < min_seconds);
+    return elapsed.count() / static_cast<double>(calls);
+}
+
+void report(const char* name, std::size_t bytes, double seconds) {
+    std::printf("  %-32s %10.3f ms %10.1f MB/s\n", name, seconds * 1000.0, static_cast<double>(bytes) / seconds / (1024.0 * 1024.0));
+}
+
+// Keeps the optimizer from discarding results.
+volatile std::size_t sink_value;
+
+// A few hundred KB of HTML with the occasional tag, similar to a large page.
+std::string make_html_template(std::size_t target_size) {
+    std::string input;
+    while (input.size() < target_size) {
+        input +=
+            "<div class=\"row\">\n"
+            "    <span class=\"label\">Name:</span> <a href=\"/users/{{id}}\">{{name}}</a>\n"
+            "    <p>Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do eiusmod tempor incididunt ut labore.</p>\n"
+            "{{#items}}\n"
+            "\t<li>{{title}}</li>\n"
+            "{{/items}}\n"
+            "</div>\r\n";
+    }
+    return input;
+}
+
+// The text scanning done by parser::parse before find_first_of_any: compare
+// the begin delimiter and then each whitespace string at every position, and
+// append plain text one character at a time.
+std::size_t legacy_scan(const std::string& input) {
+    const std::string begin{"{{"};
+    const std::string end{"}}"};
+    const std::vector<std::string> whitespace{"\r\n", "\n", "\r", " ", "\t"};
+    std::string current_text;
+    current_text.reserve(input.size());
+    std::size_t pieces = 0;
+    for (std::size_t pos = 0; pos != input.size();) {
+        if (input.compare(pos, begin.size(), begin) == 0) {
+            pieces += current_text.empty() ? 0 : 1;
+            current_text.clear();
+            pos = input.find(end, pos) + end.size();
+            continue;
+        }
+        bool parsed_whitespace = false;
+        for (const auto& ws : whitespace) {
+            if (input.compare(pos, ws.size(), ws) == 0) {
+                pieces += current_text.empty() ? 1 : 2;
+                current_text.clear();
+                pos += ws.size();
+                parsed_whitespace = true;
+                break;
+            }
+        }
+        if (!parsed_whitespace) {
+            current_text.append(1, input[pos]);
+            pos++;
+        }
+    }
+    return pieces + (current_text.empty() ? 0 : 1);
+}
+
+// The scan parser::parse does with find_first_of_any: spaces and tabs are
+// skipped with the rest of the text, and a run is split into characters
+// only if it's all spaces and tabs.
+template <typename Finder>
+std::size_t vector_scan(const std::string& input, Finder finder) {
+    const char chars[5] = {'{', '\n', '\r', '\n', '\r'};
+    std::size_t text_start = std::string::npos;
+    std::size_t pieces = 0;
+    const auto end_text = [&](std::size_t pos) {
+        if (text_start != std::string::npos) {
+            const bool blank = input.find_first_not_of(" \t", text_start) >= pos;
+            pieces += blank ? pos - text_start : 1;
+            text_start = std::string::npos;
+        }
+    };
+    for (std::size_t pos = 0; pos != input.size();) {
+        const std::size_t n = finder(input.data() + pos, input.size() - pos, chars);
+        if (n > 0 && text_start == std::string::npos) {
+            text_start = pos;
+        }
+        pos += n;
+        if (pos == input.size()) {
+            break;
+        }
+        if (input.compare(pos, 2, "{{") == 0) {
+            end_text(pos);
+            pos = input.find("}}", pos) + 2;
+        } else if (input[pos] == '{') {
+            if (text_start == std::string::npos) {
+                text_start = pos;
+            }
+            pos++;
+        } else {
+            end_text(pos);
+            pieces++;
+            pos += (input.compare(pos, 2, "\r\n") == 0) ? 2 : 1;
+        }
+    }
+    end_text(input.size());
+    return pieces;
+}
+
+void benchmark_parse() {
+    const std::string input = make_html_template(512 * 1024);
+    std::printf("parse (%zu KB template)\n", input.size() / 1024);
+
+    using finder_type = std::size_t (*)(const char*, std::size_t, const char (&)[5]);
+    const finder_type scalar = find_first_of_any_scalar<char>;
+    const finder_type dispatched = find_first_of_any;
+    if (vector_scan(input, scalar) != vector_scan(input, dispatched) || vector_scan(input, scalar) > legacy_scan(input)) {
+        std::printf("  scan mismatch!\n");
+        return;
+    }
+
+    report("scan: legacy per-char compare", input.size(), time_per_call([&]{ sink_value = legacy_scan(input); }));
+    report("scan: scalar find_first_of_any", input.size(), time_per_call([&]{ sink_value = vector_scan(input, scalar); }));
+    report("scan: simd find_first_of_any", input.size(), time_per_call([&]{ sink_value = vector_scan(input, dispatched); }));
+    report("mustache constructor", input.size(), time_per_call([&]{
+        mustache tmpl{input};
+        sink_value = tmpl.is_valid() ? 1 : 0;
+    }));
+}
+
+// The renderer before templates were compiled: walks the component tree with
+// a std::function callback per node and recurses into sections. It handles
+// text, variables and sections, which is all the render benchmarks use.
+class tree_walker {
+public:
+    explicit tree_walker(const std::string& input) : source_(input) {
+        context<std::string> ctx;
+        context_internal<std::string> context{ctx};
+        parser<std::string> parser{source_, context, root_, error_message_};
+    }
+
+    std::string render(const data& data) {
+        context<std::string> ctx{&data};
+        std::string output;
+        walk(root_, ctx, output);
+        return output;
+    }
+
+private:
+    using walk_control = component<std::string>::walk_control;
+
+    void walk(component<std::string>& comp, basic_context<std::string>& ctx, std::string& output) {
+        comp.walk_children([&](component<std::string>& child) -> walk_control {
+            const data* var = nullptr;
+            switch (child.tag.type) {
+                case tag_type::text:
+                    if (!child.standalone) {
+                        output.append(child.text.data(), child.text.size());
+                    }
+                    break;
+                case tag_type::variable:
+                case tag_type::unescaped_variable:
+                    if ((var = ctx.get(child.tag.path.name())) != nullptr && var->is_string()) {
+                        output += child.tag.type == tag_type::variable ? html_escape(var->string_value()) : var->string_value();
+                    }
+                    break;
+                case tag_type::section_begin:
+                    if ((var = ctx.get(child.tag.path.name())) != nullptr && !var->is_false() && !var->is_empty_list()) {
+                        if (var->is_non_empty_list()) {
+                            for (const auto& item : var->list_value()) {
+                                ctx.push(&item);
+                                walk(child, ctx, output);
+                                ctx.pop();
+                            }
+                        } else {
+                            ctx.push(var);
+                            walk(child, ctx, output);
+                            ctx.pop();
+                        }
+                    }
+                    return walk_control::skip;
+                case tag_type::section_begin_inverted:
+                    if ((var = ctx.get(child.tag.path.name())) == nullptr || var->is_false() || var->is_empty_list()) {
+                        walk(child, ctx, output);
+                    }
+                    return walk_control::skip;
+                default:
+                    break;
+            }
+            return walk_control::walk;
+        });
+    }
+
+    std::string source_;
+    component<std::string> root_;
+    std::string error_message_;
+};
+
+void compare_renderers(const char* title, const std::string& input, const data& data) {
+    mustache tmpl{input};
+    tree_walker walker{input};
+    const std::string expected = walker.render(data);
+    if (tmpl.render(data) != expected) {
+        std::printf("  %s: render mismatch!\n", title);
+        return;
+    }
+    report("tree walker", expected.size(), time_per_call([&]{ sink_value = walker.render(data).size(); }));
+    report("instruction stream", expected.size(), time_per_call([&]{ sink_value = tmpl.render(data).size(); }));
+}
+
+// One list with many items and a handful of tags per item.
+void benchmark_render_wide() {
+    const std::string input =
+        "<ul>\n"
+        "{{#rows}}\n"
+        "  <li id=\"{{id}}\">{{name}} {{#admin}}(admin){{/admin}}{{^admin}}(user){{/admin}} - {{email}}</li>\n"
+        "{{/rows}}\n"
+        "</ul>\n";
+    data rows{data::type::list};
+    for (int i = 0; i < 10000; ++i) {
+        data row;
+        row.set("id", std::to_string(i));
+        row.set("name", "User " + std::to_string(i));
+        row.set("email", "user" + std::to_string(i) + "@example.com");
+        row.set("admin", i % 7 == 0);
+        rows << row;
+    }
+    data root;
+    root.set("rows", rows);
+    std::printf("render_wide (10000 rows)\n");
+    compare_renderers("render_wide", input, root);
+}
+
+// Sections nested a few hundred levels deep, iterated a few times each at the
+// innermost levels.
+void benchmark_render_deep() {
+    const int depth = 200;
+    std::string input;
+    data innermost{data::type::list};
+    for (int i = 0; i < 50; ++i) {
+        data item;
+        item.set("value", std::to_string(i));
+        innermost << item;
+    }
+    data level = innermost;
+    for (int i = 0; i < depth; ++i) {
+        input += "{{#level}}<{{name}}>";
+        data obj;
+        obj.set("level", level);
+        obj.set("name", std::to_string(depth - i));
+        level = std::move(obj);
+    }
+    input += "{{value}}";
+    for (int i = 0; i < depth; ++i) {
+        input += "{{/level}}";
+    }
+    data root;
+    root.set("level", level);
+    std::printf("render_deep (%d levels)\n", depth);
+    compare_renderers("render_deep", input, root);
+}
+
+// The default context as the renderer makes it for data, looking names up
+// without calling get().
+class key_lookup_context : public context<std::string> {
+public:
+    explicit key_lookup_context(const data* root) : context<std::string>(root) {
+        use_key_lookup();
+    }
+};
+
+// The context before it became a stack: items are inserted and erased at the
+// front of a vector, which moves the whole stack for every list item.
+class front_insert_context : public basic_context<std::string> {
+public:
+    explicit front_insert_context(const data* root) {
+        items_.push_back(root);
+    }
+
+    void push(const data* item) override {
+        items_.insert(items_.begin(), item);
+    }
+
+    void pop() override {
+        items_.erase(items_.begin());
+    }
+
+    const data* get(const std::string& name) const override {
+        for (const auto& item : items_) {
+            if (const auto var = item->get(name)) {
+                return var;
+            }
+        }
+        return nullptr;
+    }
+
+    const data* resolve(const tag_path<std::string>& path) const override {
+        if (path.is_dot()) {
+            return items_.front();
+        }
+        for (const auto& item : items_) {
+            auto var = item;
+            for (const auto& key : path.keys()) {
+                var = var->get(key);
+                if (!var) {
+                    break;
+                }
+            }
+            if (var) {
+                return var;
+            }
+        }
+        return nullptr;
+    }
+
+    const data* get_partial(const std::string& name) const override {
+        return get(name);
+    }
+
+private:
+    std::vector<const data*> items_;
+};
+
+// A long list inside sections nested 64 levels deep, as with a report
+// wrapped in many layers of layout. Every list item pushes and pops the
+// context below all of those levels.
+void benchmark_render_nested_lists() {
+    const int depth = 64;
+    data rows{data::type::list};
+    for (int i = 0; i < 10000; ++i) {
+        rows << data{"value", std::to_string(i)};
+    }
+    data level;
+    level.set("rows", rows);
+    level.set("name", "inner");
+    std::string input;
+    for (int i = 0; i < depth; ++i) {
+        input += "{{#level}}";
+        data outer;
+        outer.set("level", data{data::type::list});
+        outer["level"].push_back(std::move(level));
+        level = std::move(outer);
+    }
+    input += "{{#rows}}{{value}}{{/rows}}{{name}}";
+    for (int i = 0; i < depth; ++i) {
+        input += "{{/level}}";
+    }
+    const mustache tmpl{input};
+    const std::size_t bytes = tmpl.try_render(level).output.size();
+    std::printf("render_nested_lists (10000 items, %d levels)\n", depth);
+    report("front insert context", bytes, time_per_call([&]{
+        front_insert_context ctx{&level};
+        sink_value = tmpl.try_render(ctx).output.size();
+    }));
+    report("context stack", bytes, time_per_call([&]{
+        key_lookup_context ctx{&level};
+        sink_value = tmpl.try_render(ctx).output.size();
+    }));
+}
+
+// The default context with the renderer's lookup cache turned off.
+class uncached_context : public key_lookup_context {
+public:
+    explicit uncached_context(const data* root) : key_lookup_context(root) {}
+
+    std::size_t depth() const override {
+        return 0;
+    }
+};
+
+// Rows that mostly show site-wide fields found a few items down the context.
+void benchmark_render_outer_names() {
+    data rows{data::type::list};
+    for (int i = 0; i < 10000; ++i) {
+        rows << data{"id", std::to_string(i)};
+    }
+    data page;
+    page.set("rows", rows);
+    page.set("heading", "Orders");
+    data site;
+    site.set("name", "Example");
+    site.set("url", "https://example.com");
+    data root;
+    root.set("site", site);
+    root.set("page", page);
+    root.set("currency", "EUR");
+    const mustache tmpl{
+        "{{#page}}{{#rows}}"
+        "<a href=\"{{site.url}}/orders/{{id}}\">{{heading}} {{id}} ({{currency}}, {{site.name}}){{#admin}}!{{/admin}}</a>\n"
+        "{{/rows}}{{/page}}"};
+    const std::size_t bytes = tmpl.try_render(root).output.size();
+    std::printf("render_outer_names (10000 rows)\n");
+    report("resolve every time", bytes, time_per_call([&]{
+        uncached_context ctx{&root};
+        sink_value = tmpl.try_render(ctx).output.size();
+    }));
+    report("lookup cache", bytes, time_per_call([&]{
+        key_lookup_context ctx{&root};
+        sink_value = tmpl.try_render(ctx).output.size();
+    }));
+}
+
+// A list section that expands a row partial for every item.
+void benchmark_render_partials() {
+    const std::string input = "<table>\n{{#rows}}\n{{>row}}\n{{/rows}}\n</table>\n";
+    data rows{data::type::list};
+    for (int i = 0; i < 2000; ++i) {
+        data row;
+        row.set("id", std::to_string(i));
+        row.set("name", "Item " + std::to_string(i));
+        rows << row;
+    }
+    data root;
+    root.set("rows", rows);
+    root.set("row", partial{[]() {
+        return std::string{"  <tr><td>{{id}}</td><td>{{name}}</td><td>{{#active}}yes{{/active}}{{^active}}no{{/active}}</td></tr>"};
+    }});
+    std::printf("render_partials (2000 rows)\n");
+    mustache cached{input};
+    mustache uncached{input};
+    uncached.set_partial_cache_size(0);
+    const std::size_t bytes = cached.render(root).size();
+    report("partial parsed each time", bytes, time_per_call([&]{ sink_value = uncached.render(root).size(); }));
+    report("partial cached", bytes, time_per_call([&]{ sink_value = cached.render(root).size(); }));
+}
+
+// Dotted and plain names looked up through a few context levels.
+void benchmark_lookup() {
+    const std::vector<std::string> names{"user.profile.name", "user.profile.email", "title", "missing", "site.url"};
+    data profile;
+    profile.set("name", "Jane");
+    profile.set("email", "jane@example.com");
+    data user;
+    user.set("profile", profile);
+    data site;
+    site.set("url", "https://example.com");
+    data root;
+    root.set("user", user);
+    root.set("site", site);
+    data item;
+    item.set("title", "Item");
+    key_lookup_context ctx{&root};
+    ctx.push(&user);
+    ctx.push(&item);
+    std::vector<tag_path<std::string>> paths;
+    for (const auto& name : names) {
+        paths.emplace_back(name);
+    }
+    std::printf("lookup (%zu names, 3 levels)\n", names.size());
+    const std::size_t calls = 100000;
+    const std::size_t lookups = calls * names.size();
+    const auto report_lookups = [lookups](const char* name, double seconds) {
+        std::printf("  %-32s %10.1f ns/lookup\n", name, seconds * 1e9 / static_cast<double>(lookups));
+    };
+    report_lookups("context::get (split per lookup)", time_per_call([&]{
+        std::size_t found = 0;
+        for (std::size_t i = 0; i < calls; ++i) {
+            for (const auto& name : names) {
+                found += ctx.get(name) ? 1 : 0;
+            }
+        }
+        sink_value = found;
+    }));
+    report_lookups("context::resolve (tag_path)", time_per_call([&]{
+        std::size_t found = 0;
+        for (std::size_t i = 0; i < calls; ++i) {
+            for (const auto& path : paths) {
+                found += ctx.resolve(path) ? 1 : 0;
+            }
+        }
+        sink_value = found;
+    }));
+}
+
+// One template shared by an increasing number of threads, each rendering
+// its own data through try_render().
+void benchmark_threads() {
+    const mustache tmpl{
+        "<ul>\n"
+        "{{#rows}}\n"
+        "  {{>row}}\n"
+        "{{/rows}}\n"
+        "</ul>\n"};
+    data rows{data::type::list};
+    for (int i = 0; i < 1000; ++i) {
+        data row;
+        row.set("id", std::to_string(i));
+        row.set("name", "User <" + std::to_string(i) + ">");
+        rows << row;
+    }
+    data root;
+    root.set("rows", rows);
+    root.set("row", partial{[]() {
+        return std::string{"<li id=\"{{id}}\">{{name}}</li>"};
+    }});
+    const std::size_t bytes = tmpl.try_render(root).output.size();
+    const unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+    std::printf("threads (shared template, %u hardware threads)\n", cores);
+    const std::size_t renders_per_thread = 200;
+    double single = 0;
+    for (unsigned count = 1; count <= 64; count *= 2) {
+        const auto seconds = time_per_call([&]{
+            std::vector<std::thread> threads;
+            for (unsigned i = 0; i < count; ++i) {
+                threads.emplace_back([&]{
+                    for (std::size_t j = 0; j < renders_per_thread; ++j) {
+                        sink_value = tmpl.try_render(root).output.size();
+                    }
+                });
+            }
+            for (auto& thread : threads) {
+                thread.join();
+            }
+        }, 0.2);
+        const double renders_per_second = static_cast<double>(count * renders_per_thread) / seconds;
+        if (count == 1) {
+            single = renders_per_second;
+        }
+        std::printf("  %2u threads %12.0f renders/s %8.2fx %10.1f MB/s\n", count, renders_per_second, renders_per_second / single,
+            renders_per_second * static_cast<double>(bytes) / (1024.0 * 1024.0));
+    }
+}
+
+// html_escape before it used find_first_of_any: a switch per character and
+// single-character appends.
+std::string legacy_html_escape(const std::string& s) {
+    std::string ret;
+    ret.reserve(s.size() * 2);
+    for (const auto ch : s) {
+        switch (ch) {
+            case '&':
+                ret.append({'&','a','m','p',';'});
+                break;
+            case '<':
+                ret.append({'&','l','t',';'});
+                break;
+            case '>':
+                ret.append({'&','g','t',';'});
+                break;
+            case '\"':
+                ret.append({'&','q','u','o','t',';'});
+                break;
+            case '\'':
+                ret.append({'&','a','p','o','s',';'});
+                break;
+            default:
+                ret.append(1, ch);
+                break;
+        }
+    }
+    return ret;
+}
+
+// Text where about one in every `every` characters needs escaping (0 for none).
+std::string make_escape_input(std::size_t size, std::size_t every) {
+    const char specials[] = "&<>\"'";
+    std::string input;
+    input.reserve(size);
+    for (std::size_t i = 0; input.size() < size; ++i) {
+        input += (every != 0 && i % every == every / 2) ? specials[i % 5] : static_cast<char>('a' + i % 26);
+    }
+    return input;
+}
+
+void benchmark_escape() {
+    std::printf("escape\n");
+    const struct {
+        const char* name;
+        std::size_t size;
+        std::size_t every;
+    } cases[] = {
+        {"256 KB, none", 256 * 1024, 0},
+        {"256 KB, 1 in 1000", 256 * 1024, 1000},
+        {"256 KB, 1 in 100", 256 * 1024, 100},
+        {"256 KB, 1 in 10", 256 * 1024, 10},
+        {"256 KB, 1 in 2", 256 * 1024, 2},
+        {"24 B values, none", 24, 0},
+        {"24 B values, 1 in 10", 24, 10},
+    };
+    for (const auto& c : cases) {
+        // Short values are escaped many times per call to get measurable times
+        const std::size_t repeat = c.size < 1024 ? 10000 : 1;
+        const std::string input = make_escape_input(c.size, c.every);
+        if (html_escape(input) != legacy_html_escape(input)) {
+            std::printf("  %s: escape mismatch!\n", c.name);
+            continue;
+        }
+        char name[64];
+        std::snprintf(name, sizeof(name), "legacy: %s", c.name);
+        report(name, input.size() * repeat, time_per_call([&]{
+            for (std::size_t i = 0; i < repeat; ++i) {
+                sink_value = legacy_html_escape(input).size();
+            }
+        }, 0.2));
+        std::snprintf(name, sizeof(name), "html_escape: %s", c.name);
+        report(name, input.size() * repeat, time_per_call([&]{
+            for (std::size_t i = 0; i < repeat; ++i) {
+                sink_value = html_escape(input).size();
+            }
+        }, 0.2));
+    }
+}
+
+// The same render written to each kind of output.
+void benchmark_sinks() {
+    mustache tmpl{make_html_template(64 * 1024)};
+    data items{data::type::list};
+    for (int i = 0; i < 5; ++i) {
+        items << data{"title", "Item " + std::to_string(i)};
+    }
+    data root;
+    root.set("id", "42");
+    root.set("name", "Jane");
+    root.set("items", items);
+    const std::size_t bytes = tmpl.render(root).size();
+    std::vector<char> buffer(bytes);
+    std::printf("sinks (%zu KB output)\n", bytes / 1024);
+    report("render handler", bytes, time_per_call([&]{
+        std::size_t size = 0;
+        tmpl.render(root, [&size](const std::string& str) {
+            size += str.size();
+        });
+        sink_value = size;
+    }));
+    report("handler into ostringstream", bytes, time_per_call([&]{
+        std::ostringstream stream;
+        tmpl.render(root, [&stream](const std::string& str) {
+            stream << str;
+        });
+        sink_value = stream.str().size();
+    }));
+    report("ostream (streambuf sink)", bytes, time_per_call([&]{
+        std::ostringstream stream;
+        tmpl.render(root, stream);
+        sink_value = static_cast<std::size_t>(stream.tellp());
+    }));
+    report("string (string sink)", bytes, time_per_call([&]{
+        sink_value = tmpl.render(root).size();
+    }));
+    report("fixed buffer sink", bytes, time_per_call([&]{
+        fixed_buffer_sink sink{buffer.data(), buffer.size()};
+        tmpl.render_to(root, sink);
+        sink_value = sink.size();
+    }));
+    report("chunked render (16 KB chunks)", bytes, time_per_call([&]{
+        auto chunks = tmpl.render_chunks(root);
+        std::size_t size = 0;
+        while (chunks.next()) {
+            size += chunks.chunk().size();
+        }
+        sink_value = size;
+    }));
+    fragment_sink fragments;
+    report("fragment sink", bytes, time_per_call([&]{
+        fragments.clear();
+        tmpl.render_to(root, fragments);
+        sink_value = fragments.fragments().size();
+    }));
+#if defined(__unix__) || defined(__APPLE__)
+    const int fd = ::open("/dev/null", O_WRONLY);
+    if (fd >= 0) {
+        report("string + write()", bytes, time_per_call([&]{
+            const std::string str = tmpl.render(root);
+            sink_value = static_cast<std::size_t>(::write(fd, str.data(), str.size()));
+        }));
+        report("fragment sink + writev()", bytes, time_per_call([&]{
+            fragments.clear();
+            tmpl.render_to(root, fragments);
+            sink_value = write_fragments(fd, fragments) ? fragments.size() : 0;
+        }));
+        ::close(fd);
+    }
+#endif
+}
+
+// One large list section rendered serially and split across thread pools.
+void benchmark_parallel() {
+    const std::string text{
+        "<table>\n"
+        "{{#rows}}\n"
+        "<tr id=\"{{id}}\"><td>{{name}}</td><td>{{#active}}yes{{/active}}{{^active}}no{{/active}}</td></tr>\n"
+        "{{/rows}}\n"
+        "</table>\n"};
+    data rows{data::type::list};
+    for (int i = 0; i < 100000; ++i) {
+        data row;
+        row.set("id", std::to_string(i));
+        row.set("name", "User <" + std::to_string(i) + ">");
+        row.set("active", i % 3 == 0);
+        rows << std::move(row);
+    }
+    const data root{"rows", rows};
+    const mustache serial{text};
+    const std::size_t bytes = serial.try_render(root).output.size();
+    const unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+    std::printf("parallel (100000 rows, %u hardware threads)\n", cores);
+    report("serial", bytes, time_per_call([&]{
+        sink_value = serial.try_render(root).output.size();
+    }));
+    for (std::size_t size = 2; size <= 16; size *= 2) {
+        mustache parallel{text};
+        parallel.set_parallel_sections(std::make_shared<thread_pool>(size));
+        const std::string name = std::to_string(size) + " threads";
+        report(name.c_str(), bytes, time_per_call([&]{
+            sink_value = parallel.try_render(root).output.size();
+        }));
+    }
+}
+
+// Mail-merge: one template rendered for many small records.
+void benchmark_batch() {
+    const mustache tmpl{
+        "Dear {{name}},\n"
+        "\n"
+        "Your order #{{order}} of {{#items}}{{count}} x {{title}}, {{/items}}ships on {{date}}.\n"
+        "{{#vip}}Thanks for being a VIP!\n{{/vip}}"};
+    std::vector<data> records;
+    for (int i = 0; i < 20000; ++i) {
+        data record;
+        record.set("name", "Customer " + std::to_string(i));
+        record.set("order", std::to_string(100000 + i));
+        record.set("date", "2024-05-01");
+        record.set("vip", i % 10 == 0);
+        data items{data::type::list};
+        for (int j = 0; j < 3; ++j) {
+            data item;
+            item.set("count", std::to_string(j + 1));
+            item.set("title", "Widget & Co");
+            items << std::move(item);
+        }
+        record.set("items", std::move(items));
+        records.push_back(std::move(record));
+    }
+    std::size_t bytes = 0;
+    for (const auto& record : records) {
+        bytes += tmpl.try_render(record).output.size();
+    }
+    std::vector<std::string> outputs(records.size());
+    const auto make_sink = [&outputs](std::size_t i) {
+        outputs[i].clear();
+        return string_sink{outputs[i]};
+    };
+    const unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+    std::printf("batch (%zu records, %u hardware threads)\n", records.size(), cores);
+    report("render() each", bytes, time_per_call([&]{
+        mustache copy{tmpl};
+        for (std::size_t i = 0; i < records.size(); ++i) {
+            outputs[i] = copy.render(records[i]);
+        }
+    }));
+    report("render_batch, calling thread", bytes, time_per_call([&]{
+        sink_value = tmpl.render_batch(records.begin(), records.end(), make_sink).renders;
+    }));
+    for (std::size_t size = 2; size <= 8; size *= 2) {
+        thread_pool pool{size};
+        const std::string name = "render_batch, " + std::to_string(size) + " threads";
+        report(name.c_str(), bytes, time_per_call([&]{
+            sink_value = tmpl.render_batch(records.begin(), records.end(), make_sink, pool).renders;
+        }));
+    }
+}
+
+struct order_line {
+    std::string title;
+    int count;
+    double price;
+};
+KAINJOW_MUSTACHE_FIELDS(order_line, title, count, price)
+
+struct order {
+    std::string customer;
+    long id;
+    bool vip;
+    std::vector<order_line> lines;
+};
+KAINJOW_MUSTACHE_FIELDS(order, customer, id, vip, lines)
+
+struct order_page {
+    std::string heading;
+    std::vector<order> orders;
+};
+KAINJOW_MUSTACHE_FIELDS(order_page, heading, orders)
+
+data order_page_data(const order_page& page) {
+    data orders{data::type::list};
+    orders.reserve(page.orders.size());
+    for (const auto& o : page.orders) {
+        data lines{data::type::list};
+        lines.reserve(o.lines.size());
+        for (const auto& line : o.lines) {
+            data item;
+            item.set("title", line.title);
+            item.set("count", std::to_string(line.count));
+            std::ostringstream price;
+            price << line.price;
+            item.set("price", price.str());
+            lines << std::move(item);
+        }
+        data item;
+        item.set("customer", o.customer);
+        item.set("id", std::to_string(o.id));
+        item.set("vip", o.vip);
+        item.set("lines", std::move(lines));
+        orders << std::move(item);
+    }
+    data root;
+    root.set("heading", page.heading);
+    root.set("orders", std::move(orders));
+    return root;
+}
+
+// Domain structs rendered by copying them into data first, and bound with
+// KAINJOW_MUSTACHE_FIELDS.
+void benchmark_bound() {
+    order_page page;
+    page.heading = "Orders";
+    for (int i = 0; i < 5000; ++i) {
+        order o{"Customer " + std::to_string(i), 100000 + i, i % 10 == 0, {}};
+        for (int j = 0; j < 3; ++j) {
+            o.lines.push_back(order_line{"Widget & Co", j + 1, 9.5 + j});
+        }
+        page.orders.push_back(std::move(o));
+    }
+    const mustache tmpl{
+        "<h1>{{heading}}</h1>\n"
+        "{{#orders}}<div>#{{id}} {{customer}}{{#vip}} (VIP){{/vip}}\n"
+        "{{#lines}}  {{count}} x {{title}} at {{price}}\n{{/lines}}</div>\n{{/orders}}"};
+    const data converted = order_page_data(page);
+    const std::size_t bytes = tmpl.try_render(converted).output.size();
+    std::printf("bound (5000 orders)\n");
+    report("convert to data", bytes, time_per_call([&]{
+        sink_value = order_page_data(page).is_object();
+    }));
+    report("render converted data", bytes, time_per_call([&]{
+        sink_value = tmpl.try_render(converted).output.size();
+    }));
+    report("convert and render", bytes, time_per_call([&]{
+        sink_value = tmpl.try_render(order_page_data(page)).output.size();
+    }));
+    report("bind and render", bytes, time_per_call([&]{
+        sink_value = tmpl.try_render(data::bind(page)).output.size();
+    }));
+}
+
+// An export of 100000 rows, built as a list before rendering and pulled
+// one row at a time from a lazy list.
+void benchmark_lazy_list() {
+    int count = 100000;
+    const mustache tmpl{"{{#rows}}{{id}},{{name}},{{email}}\n{{/rows}}"};
+    const auto fill = [](data& row, int i) {
+        row["id"] = std::to_string(i);
+        row["name"] = "User " + std::to_string(i);
+        row["email"] = "user" + std::to_string(i) + "@example.com";
+    };
+    const auto build = [&]() {
+        data rows{data::type::list};
+        rows.reserve(count);
+        for (int i = 0; i < count; ++i) {
+            data row;
+            fill(row, i);
+            rows << std::move(row);
+        }
+        return data{"rows", std::move(rows)};
+    };
+    const lazy_list rows = [&]() -> list_source {
+        auto next = std::make_shared<int>(0);
+        return [&fill, count, next](data& row) {
+            if (*next == count) {
+                return false;
+            }
+            fill(row, (*next)++);
+            return true;
+        };
+    };
+    const data lazy{"rows", rows};
+    const std::size_t bytes = tmpl.try_render(lazy).output.size();
+    std::printf("lazy_list (%d rows)\n", count);
+    report("build list and render", bytes, time_per_call([&]{
+        sink_value = tmpl.try_render(build()).output.size();
+    }));
+    report("lazy list", bytes, time_per_call([&]{
+        sink_value = tmpl.try_render(lazy).output.size();
+    }));
+}
+
+// Rows of ids, counts and prices stored as strings and as numbers, built
+// and then rendered.
+void benchmark_numbers() {
+    const int count = 20000;
+    const mustache tmpl{"{{#rows}}{{id}} {{count}} {{price}}\n{{/rows}}"};
+    const auto build_strings = [count]() {
+        data rows{data::type::list};
+        rows.reserve(count);
+        for (int i = 0; i < count; ++i) {
+            data row;
+            row.set("id", std::to_string(1000000 + i));
+            row.set("count", std::to_string(i % 10));
+            std::ostringstream price;
+            price << (i % 1000) * 0.25;
+            row.set("price", price.str());
+            rows << std::move(row);
+        }
+        return data{"rows", std::move(rows)};
+    };
+    const auto build_numbers = [count]() {
+        data rows{data::type::list};
+        rows.reserve(count);
+        for (int i = 0; i < count; ++i) {
+            data row;
+            row.set("id", data::number(1000000 + i));
+            row.set("count", data::number(i % 10));
+            row.set("price", data::number((i % 1000) * 0.25));
+            rows << std::move(row);
+        }
+        return data{"rows", std::move(rows)};
+    };
+    const data strings = build_strings();
+    const data numbers = build_numbers();
+    const std::size_t bytes = tmpl.try_render(strings).output.size();
+    std::printf("numbers (%d rows)\n", count);
+    report("build with strings", bytes, time_per_call([&]{
+        sink_value = build_strings().is_object();
+    }));
+    report("build with numbers", bytes, time_per_call([&]{
+        sink_value = build_numbers().is_object();
+    }));
+    report("render strings", bytes, time_per_call([&]{
+        sink_value = tmpl.try_render(strings).output.size();
+    }));
+    report("render numbers", bytes, time_per_call([&]{
+        sink_value = tmpl.try_render(numbers).output.size();
+    }));
+}
+
+// Rows that show large blobs of text owned outside the data, copied into
+// the data and borrowed.
+void benchmark_borrowed() {
+    const int count = 10000;
+    std::vector<std::string> blobs;
+    for (int i = 0; i < 16; ++i) {
+        blobs.push_back(std::string(2048, static_cast<char>('a' + i)));
+    }
+    const mustache tmpl{"{{#rows}}<article>{{{body}}}</article>\n{{/rows}}"};
+    const auto build = [&](bool borrow) {
+        data rows{data::type::list};
+        rows.reserve(count);
+        for (int i = 0; i < count; ++i) {
+            const std::string& blob = blobs[static_cast<std::size_t>(i) % blobs.size()];
+            rows << data{"body", borrow ? data::borrow(blob) : data{blob}};
+        }
+        return data{"rows", std::move(rows)};
+    };
+    const data owned = build(false);
+    const data borrowed = build(true);
+    const std::size_t bytes = tmpl.try_render(owned).output.size();
+    std::printf("borrowed (%d rows of 2 KB)\n", count);
+    report("build with copies", bytes, time_per_call([&]{
+        sink_value = build(false).is_object();
+    }));
+    report("build borrowed", bytes, time_per_call([&]{
+        sink_value = build(true).is_object();
+    }));
+    report("render copies", bytes, time_per_call([&]{
+        sink_value = tmpl.try_render(owned).output.size();
+    }));
+    report("render borrowed", bytes, time_per_call([&]{
+        sink_value = tmpl.try_render(borrowed).output.size();
+    }));
+}
+
+// Rendering straight from a parsed JSON document, against building the same
+// values into data first, which is what rendering JSON took before.
+void benchmark_json() {
+    const int count = 10000;
+    const auto name = [](int i) { return "user " + std::to_string(i); };
+    const auto email = [](int i) { return "user" + std::to_string(i) + "@example.com"; };
+    std::string text = "{\"rows\": [\n";
+    for (int i = 0; i < count; ++i) {
+        text += i > 0 ? ",\n" : "";
+        text += "  {\"id\": " + std::to_string(i) + ", \"name\": \"" + name(i) + "\", \"email\": \"" + email(i) +
+            "\", \"active\": " + (i % 3 != 0 ? "true" : "false") + ", \"tags\": [\"a\", \"b\", \"c\"]}";
+    }
+    text += "\n]}";
+    const mustache tmpl{"{{#rows}}<tr><td>{{id}}</td><td>{{name}}</td><td>{{email}}</td>"
+        "{{#active}}<td>active</td>{{/active}}<td>{{#tags}}{{.}} {{/tags}}</td></tr>\n{{/rows}}"};
+    const auto build = [&] {
+        data rows{data::type::list};
+        rows.reserve(count);
+        for (int i = 0; i < count; ++i) {
+            data row;
+            row.set("id", data::number(i));
+            row.set("name", name(i));
+            row.set("email", email(i));
+            row.set("active", i % 3 != 0);
+            row.set("tags", data{data::type::list} << data{"a"} << data{"b"} << data{"c"});
+            rows << std::move(row);
+        }
+        return data{"rows", std::move(rows)};
+    };
+    const json_document doc{text};
+    const data root = doc.root();
+    const data built = build();
+    const std::size_t bytes = tmpl.try_render(built).output.size();
+    std::printf("json (%d rows, %zu KB of JSON)\n", count, text.size() / 1024);
+    report("parse document", text.size(), time_per_call([&]{
+        json_document parsed{text};
+        sink_value = parsed.tape().size();
+    }));
+    report("build data", bytes, time_per_call([&]{
+        sink_value = build().is_object();
+    }));
+    report("render document", bytes, time_per_call([&]{
+        sink_value = tmpl.try_render(root).output.size();
+    }));
+    report("render data", bytes, time_per_call([&]{
+        sink_value = tmpl.try_render(built).output.size();
+    }));
+    report("parse + render document", bytes, time_per_call([&]{
+        json_document parsed{text};
+        sink_value = tmpl.try_render(parsed.root()).output.size();
+    }));
+    report("build + render data", bytes, time_per_call([&]{
+        sink_value = tmpl.try_render(build()).output.size();
+    }));
+}
+
+// Loading JSON into data the simple way: build each value on its own, then
+// copy it into its parent, without sizing anything first.
+data naive_from_json(const json_entry<char>& entry) {
+    switch (entry.type) {
+        case json_type::object: {
+            data obj;
+            for (const json_entry<char>* key = &entry + 1; key < &entry + entry.size; key += 1 + key[1].size) {
+                const data value = naive_from_json(key[1]);
+                obj.set(json_string<std::string>(*key), value);
+            }
+            return obj;
+        }
+        case json_type::array: {
+            data list{data::type::list};
+            for (const json_entry<char>* item = &entry + 1; item < &entry + entry.size; item += item->size) {
+                const data value = naive_from_json(*item);
+                list.push_back(value);
+            }
+            return list;
+        }
+        case json_type::string:
+            return data{json_string<std::string>(entry)};
+        case json_type::number: {
+            const std::string number(entry.text, entry.length);
+            if (number.find_first_of(".eE") != std::string::npos) {
+                return data::number(std::stod(number));
+            }
+            return data::number(std::stoll(number));
+        }
+        case json_type::bool_true:
+            return data{true};
+        default:
+            return data{false};
+    }
+}
+
+void benchmark_from_json() {
+    const int count = 50000;
+    std::string text = "[\n";
+    for (int i = 0; i < count; ++i) {
+        const std::string n = std::to_string(i);
+        text += i > 0 ? ",\n" : "";
+        text += "  {\"id\": " + n + ", \"name\": \"user " + n + "\", \"email\": \"user" + n + "@example.com\", \"score\": " + n + ".5,"
+            " \"active\": true, \"address\": {\"city\": \"Springfield\", \"zip\": \"0" + n + "\"}, \"tags\": [\"a\", \"b\", \"c\"]}";
+    }
+    text += "\n]";
+    std::printf("from_json (%d rows, %zu KB of JSON)\n", count, text.size() / 1024);
+    report("parse document", text.size(), time_per_call([&]{
+        json_document doc{text};
+        sink_value = doc.tape().size();
+    }));
+    report("parse + naive builder", text.size(), time_per_call([&]{
+        json_document doc{text};
+        sink_value = naive_from_json(doc.tape().front()).list_value().size();
+    }));
+    report("from_json", text.size(), time_per_call([&]{
+        sink_value = data::from_json(text).list_value().size();
+    }));
+}
+
+// A list of rows with the same 12 keys, as ordinary objects and as objects
+// that share a shape.
+void benchmark_shapes() {
+    const int count = 200000;
+    const std::vector<std::string> keys{"id", "first", "last", "email", "phone", "street", "city", "state", "zip", "country", "company", "title"};
+    const auto row_shape = shape::make(keys);
+    std::string text{"{{#rows}}"};
+    for (const auto& key : keys) {
+        text += "{{" + key + "}},";
+    }
+    text += "\n{{/rows}}";
+    const mustache tmpl{text};
+    const auto build = [&](bool shaped) {
+        data rows{data::type::list};
+        rows.reserve(count);
+        for (int i = 0; i < count; ++i) {
+            list values;
+            values.reserve(keys.size());
+            values.emplace_back(i);
+            for (std::size_t k = 1; k < keys.size(); ++k) {
+                values.emplace_back(std::to_string(i % 1000));
+            }
+            if (shaped) {
+                rows << data{row_shape, std::move(values)};
+            } else {
+                data row;
+                row.reserve(keys.size());
+                for (std::size_t k = 0; k < keys.size(); ++k) {
+                    row.set(keys[k], std::move(values[k]));
+                }
+                rows << std::move(row);
+            }
+        }
+        return data{"rows", std::move(rows)};
+    };
+    const auto measure = [&](bool shaped) {
+        const std::size_t before = allocated_bytes.load();
+        const data rows = build(shaped);
+        return allocated_bytes.load() - before;
+    };
+    const data objects = build(false);
+    const data records = build(true);
+    const std::size_t bytes = tmpl.try_render(objects).output.size();
+    std::printf("shapes (%d rows of %zu keys)\n", count, keys.size());
+    std::printf("  %-32s %10.1f MB\n", "objects allocate", static_cast<double>(measure(false)) / (1024.0 * 1024.0));
+    std::printf("  %-32s %10.1f MB\n", "shaped objects allocate", static_cast<double>(measure(true)) / (1024.0 * 1024.0));
+    report("build objects", bytes, time_per_call([&]{
+        sink_value = build(false).is_object();
+    }));
+    report("build shaped objects", bytes, time_per_call([&]{
+        sink_value = build(true).is_object();
+    }));
+    report("render objects", bytes, time_per_call([&]{
+        sink_value = tmpl.try_render(objects).output.size();
+    }));
+    report("render shaped objects", bytes, time_per_call([&]{
+        sink_value = tmpl.try_render(records).output.size();
+    }));
+}
+
+struct benchmark {
+    const char* name;
+    void (*run)();
+};
+
+const benchmark benchmarks[] = {
+    {"parse", benchmark_parse},
+    {"render_wide", benchmark_render_wide},
+    {"render_deep", benchmark_render_deep},
+    {"render_nested_lists", benchmark_render_nested_lists},
+    {"render_outer_names", benchmark_render_outer_names},
+    {"render_partials", benchmark_render_partials},
+    {"lookup", benchmark_lookup},
+    {"threads", benchmark_threads},
+    {"escape", benchmark_escape},
+    {"sinks", benchmark_sinks},
+    {"parallel", benchmark_parallel},
+    {"batch", benchmark_batch},
+    {"bound", benchmark_bound},
+    {"lazy_list", benchmark_lazy_list},
+    {"numbers", benchmark_numbers},
+    {"borrowed", benchmark_borrowed},
+    {"json", benchmark_json},
+    {"from_json", benchmark_from_json},
+    {"shapes", benchmark_shapes},
+};
+
+} // namespace
+
+// Usage: mustache-benchmark [name...]
+// Runs the named benchmarks, or all of them when no names are given.
+int main(int argc, char** argv) {
+    for (const auto& b : benchmarks) {
+        bool selected = argc < 2;
+        for (int i = 1; i < argc; ++i) {
+            selected = selected || std::strcmp(argv[i], b.name) == 0;
+        }
+        if (selected) {
+            b.run();
+        }
+    }
+    return 0;
+}
@@ -31,6 +31,160 @@
 #define CATCH_CONFIG_MAIN
 #include "catch.hpp"
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <iterator>
+#include <limits>
+#include <mutex>
+#include <new>
+#include <set>
+#include <sstream>
+#include <thread>
+
+// Counts allocations for the data_allocations test. The array, nothrow and
+// aligned forms are replaced too, as sanitizers intercept each of them
+// rather than letting them call operator new(size_t).
+namespace {
+std::atomic<std::size_t> allocation_count{0};
+
+void* counted_alloc(std::size_t size) noexcept {
+    ++allocation_count;
+    return std::malloc(size == 0 ? 1 : size);
+}
+
+#if defined(__cpp_aligned_new)
+// The block from malloc is stored just before the aligned pointer
+void* counted_aligned_alloc(std::size_t size, std::align_val_t align) noexcept {
+    const std::size_t alignment = std::max(static_cast<std::size_t>(align), alignof(void*));
+    void* block = counted_alloc(size + alignment + sizeof(void*));
+    if (block == nullptr) {
+        return nullptr;
+    }
+    const std::uintptr_t start = reinterpret_cast<std::uintptr_t>(block) + sizeof(void*);
+    void** ptr = reinterpret_cast<void**>((start + alignment - 1) / alignment * alignment);
+    ptr[-1] = block;
+    return ptr;
+}
+
+void aligned_free(void* ptr) noexcept {
+    if (ptr != nullptr) {
+        std::free(static_cast<void**>(ptr)[-1]);
+    }
+}
+#endif
+}
+
+void* operator new(std::size_t size) {
+    if (void* ptr = counted_alloc(size)) {
+        return ptr;
+    }
+    throw std::bad_alloc{};
+}
+
+void* operator new[](std::size_t size) {
+    if (void* ptr = counted_alloc(size)) {
+        return ptr;
+    }
+    throw std::bad_alloc{};
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept {
+    return counted_alloc(size);
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept {
+    return counted_alloc(size);
+}
+
+// GCC doesn't see that these pair with the operator new above
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpragmas"
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void operator delete(void* ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, const std::nothrow_t&) noexcept {
+    std::free(ptr);
+}
+
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept {
+    std::free(ptr);
+}
+
+#if defined(__cpp_sized_deallocation)
+void operator delete(void* ptr, std::size_t) noexcept {
+    std::free(ptr);
+}
+
+void operator delete[](void* ptr, std::size_t) noexcept {
+    std::free(ptr);
+}
+#endif
+
+#if defined(__cpp_aligned_new)
+void* operator new(std::size_t size, std::align_val_t align) {
+    if (void* ptr = counted_aligned_alloc(size, align)) {
+        return ptr;
+    }
+    throw std::bad_alloc{};
+}
+
+void* operator new[](std::size_t size, std::align_val_t align) {
+    if (void* ptr = counted_aligned_alloc(size, align)) {
+        return ptr;
+    }
+    throw std::bad_alloc{};
+}
+
+void* operator new(std::size_t size, std::align_val_t align, const std::nothrow_t&) noexcept {
+    return counted_aligned_alloc(size, align);
+}
+
+void* operator new[](std::size_t size, std::align_val_t align, const std::nothrow_t&) noexcept {
+    return counted_aligned_alloc(size, align);
+}
+
+void operator delete(void* ptr, std::align_val_t) noexcept {
+    aligned_free(ptr);
+}
+
+void operator delete[](void* ptr, std::align_val_t) noexcept {
+    aligned_free(ptr);
+}
+
+void operator delete(void* ptr, std::align_val_t, const std::nothrow_t&) noexcept {
+    aligned_free(ptr);
+}
+
+void operator delete[](void* ptr, std::align_val_t, const std::nothrow_t&) noexcept {
+    aligned_free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t, std::align_val_t) noexcept {
+    aligned_free(ptr);
+}
+
+void operator delete[](void* ptr, std::size_t, std::align_val_t) noexcept {
+    aligned_free(ptr);
+}
+#endif
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
 using namespace kainjow::mustache;
 
 TEST_CASE("split") {
@@ -54,6 +208,171 @@ TEST_CASE("split") {
 
 }
 
+TEST_CASE("tag_path") {
+
+    SECTION("keys") {
+        for (const std::string name : {"", "test", "a.b", "a.", "..", ".a.b.c"}) {
+            const tag_path<std::string> path{name};
+            const auto names = name.find('.') == std::string::npos ? std::vector<std::string>{name} : split(name, '.');
+            REQUIRE(path.keys().size() == names.size());
+            for (std::size_t i = 0; i < names.size(); ++i) {
+                CHECK(path.keys()[i].name == names[i]);
+                CHECK(path.keys()[i].hash == std::hash<std::string>{}(names[i]));
+            }
+            CHECK_FALSE(path.is_dot());
+        }
+        const tag_path<std::string> dot{"."};
+        CHECK(dot.keys().empty());
+        CHECK(dot.is_dot());
+    }
+
+    SECTION("object_lookup") {
+        data dat;
+        dat.set("a", "1");
+        CHECK(dat.get(tag_key<std::string>{"a"})->string_value() == "1");
+        CHECK(dat.get(tag_key<std::string>{"b"}) == nullptr);
+        CHECK(data{"a"}.get(tag_key<std::string>{"a"}) == nullptr);
+    }
+
+    SECTION("resolve") {
+        data inner;
+        inner.set("b", "inner");
+        data dat;
+        dat.set("a", inner);
+        dat.set("b", "outer");
+        context<std::string> ctx{&dat};
+        ctx.push(&inner);
+        CHECK(ctx.resolve(tag_path<std::string>{"a.b"})->string_value() == "inner");
+        CHECK(ctx.resolve(tag_path<std::string>{"b"})->string_value() == "inner");
+        CHECK(ctx.resolve(tag_path<std::string>{"."}) == &inner);
+        CHECK(ctx.resolve(tag_path<std::string>{"a.c"}) == nullptr);
+        ctx.pop();
+        CHECK(ctx.resolve(tag_path<std::string>{"b"})->string_value() == "outer");
+    }
+
+}
+
+TEST_CASE("find_first_of_any") {
+
+    const char chars[5] = {'{', ' ', '\t', '\n', '\r'};
+
+    SECTION("matches_scalar") {
+        // exercise every block boundary of the 16 and 32 byte kernels
+        for (std::size_t size = 0; size < 100; ++size) {
+            for (std::size_t pos = 0; pos <= size; ++pos) {
+                std::string input(size, 'x');
+                if (pos < size) {
+                    input[pos] = chars[pos % 5];
+                }
+                const auto expected = find_first_of_any_scalar(input.data(), input.size(), chars);
+                CHECK(expected == pos);
+                CHECK(find_first_of_any(input.data(), input.size(), chars) == expected);
+            }
+        }
+    }
+
+    SECTION("high_bytes") {
+        const std::string input = "\x80\xff\xfe{";
+        CHECK(find_first_of_any(input.data(), input.size(), chars) == 3);
+    }
+
+    SECTION("wide") {
+        const std::wstring input = L"abc\tdef";
+        const wchar_t wchars[5] = {L'{', L' ', L'\t', L'\n', L'\r'};
+        CHECK(find_first_of_any(input.data(), input.size(), wchars) == 3);
+    }
+
+    SECTION("parse_long_text") {
+        std::string text;
+        for (int i = 0; i < 50; ++i) {
+            text += "abcdefghijklmnopqrstuvwxyz{not a tag}0123456789";
+        }
+        mustache tmpl{text + " {{what}}\r\n" + text};
+        CHECK(tmpl.render({"what", "World"}) == text + " World\r\n" + text);
+    }
+
+}
+
+TEST_CASE("html_escape") {
+
+    const auto reference = [](const std::string& s) {
+        std::string ret;
+        for (const auto ch : s) {
+            switch (ch) {
+                case '&': ret += "&amp;"; break;
+                case '<': ret += "&lt;"; break;
+                case '>': ret += "&gt;"; break;
+                case '"': ret += "&quot;"; break;
+                case '\'': ret += "&apos;"; break;
+                default: ret += ch; break;
+            }
+        }
+        return ret;
+    };
+
+    SECTION("matches_reference") {
+        const std::string specials = "&<>\"'";
+        for (std::size_t size = 0; size < 80; ++size) {
+            for (std::size_t pos = 0; pos <= size; ++pos) {
+                std::string input(size, 'x');
+                if (pos < size) {
+                    input[pos] = specials[pos % specials.size()];
+                    input[size - 1] = specials[size % specials.size()];
+                }
+                CHECK(html_escape(input) == reference(input));
+            }
+        }
+    }
+
+    SECTION("nothing_to_escape") {
+        const std::string input(1000, 'a');
+        CHECK(html_escape(input) == input);
+    }
+
+    SECTION("all_escaped") {
+        const std::string input = "<<>>&&\"\"''";
+        CHECK(html_escape(input) == "&lt;&lt;&gt;&gt;&amp;&amp;&quot;&quot;&apos;&apos;");
+    }
+
+    SECTION("wide") {
+        CHECK(html_escape<std::wstring>(L"a<b>&c") == L"a&lt;b&gt;&amp;c");
+    }
+
+}
+
+TEST_CASE("template_source") {
+
+    SECTION("outlives_input") {
+        std::unique_ptr<mustache> tmpl;
+        {
+            std::string input{"Hello {{#wrap}}{{what}}{{/wrap}}!"};
+            tmpl.reset(new mustache{input});
+            input.assign(input.size(), 'x');
+        }
+        data dat{"what", "World"};
+        dat["wrap"] = lambda{[](const std::string& text) { return "<" + text + ">"; }};
+        CHECK(tmpl->render(dat) == "Hello <World>!");
+    }
+
+    SECTION("copy") {
+        std::unique_ptr<mustache> tmpl{new mustache{"Hello {{what}}\n"}};
+        const mustache copy{*tmpl};
+        tmpl.reset();
+        mustache copy2{copy};
+        CHECK(copy2.render({"what", "World"}) == "Hello World\n");
+    }
+
+    SECTION("text_view") {
+        const std::string input{"  a b  "};
+        const text_view<std::string> view{input.data(), input.size()};
+        CHECK(view.str() == input);
+        CHECK(trim(view) == "a b");
+        CHECK(trim(view) != input);
+        CHECK(trim(text_view<std::string>{input.data(), 2}).empty());
+    }
+
+}
+
 TEST_CASE("variables") {
 
     SECTION("empty") {
@@ -213,6 +532,38 @@ TEST_CASE("sections") {
         CHECK(tmpl.render(data) == "helloworld");
     }
 
+    SECTION("deeply_nested") {
+        std::string input;
+        for (int i = 0; i < 1000; ++i) {
+            input += "{{#var}}.";
+        }
+        for (int i = 0; i < 1000; ++i) {
+            input += "{{/var}}";
+        }
+        mustache tmpl{input};
+        data data;
+        data.set("var", data::type::bool_true);
+        CHECK(tmpl.render(data) == std::string(1000, '.'));
+    }
+
+    SECTION("error_restores_context") {
+        mustache tmpl("{{#list}}{{#obj}}{{bad}}{{/obj}}{{/list}}");
+        data obj;
+        obj.set("name", "inner");
+        obj.set("bad", lambda2{[](const std::string&, const renderer&) -> mustache::string_type {
+            return {};
+        }});
+        data item;
+        item.set("obj", obj);
+        data dat;
+        dat.set("name", "outer");
+        dat.set("list", list{item, item});
+        context<mustache::string_type> ctx{&dat};
+        CHECK(tmpl.render(ctx) == "");
+        CHECK_FALSE(tmpl.is_valid());
+        CHECK(ctx.get("name")->string_value() == "outer");
+    }
+
 }
 
 TEST_CASE("sections_inverted") {
@@ -356,6 +707,31 @@ TEST_CASE("examples") {
 
 TEST_CASE("data") {
 
+    SECTION("layout") {
+        // A tag and an inline string
+        CHECK(sizeof(data) <= sizeof(std::string) + sizeof(void*));
+
+        data obj;
+        CHECK(obj.is_empty_object());
+        CHECK(obj.get("a") == nullptr);
+        data lst{data::type::list};
+        CHECK(lst.is_empty_list());
+        CHECK(lst.list_value().empty());
+        lst << data{"x"};
+        CHECK(lst.is_non_empty_list());
+
+        data str{"a string that is too long for the small string buffer"};
+        data moved{std::move(str)};
+        CHECK(str.is_invalid());
+        CHECK(moved.string_value() == "a string that is too long for the small string buffer");
+        const data copy{moved};
+        CHECK(copy.string_value() == moved.string_value());
+        moved = data{list{"a", "b"}};
+        CHECK(moved.list_value().size() == 2);
+        moved = data{false};
+        CHECK(moved.is_false());
+    }
+
     SECTION("types") {
         data dat("age", "42");
         data emptyStr = data::type::string;
@@ -452,6 +828,103 @@ TEST_CASE("data") {
 
 }
 
+TEST_CASE("data_allocations") {
+
+    // Rows with a nested object and strings too long to be stored inline,
+    // so copying a row would allocate several times
+    const std::size_t row_count = 100000;
+    std::vector<data> rows;
+    rows.reserve(row_count);
+    for (std::size_t i = 0; i < row_count; ++i) {
+        data row;
+        row.set("id", std::to_string(i));
+        row.set("name", std::string(40, 'x'));
+        row.set("address", data{"street", std::string(40, 'y')});
+        rows.push_back(std::move(row));
+    }
+
+    SECTION("push_back") {
+        data lst{data::type::list};
+        const auto before = allocation_count.load();
+        for (auto& row : rows) {
+            lst.push_back(std::move(row));
+        }
+        const auto count = allocation_count.load() - before;
+        // Only the list's buffer grows, the rows are moved
+        CHECK(count < 64);
+        REQUIRE(lst.list_value().size() == row_count);
+        CHECK(lst.list_value().back().get("address")->get("street")->string_value() == std::string(40, 'y'));
+        CHECK(rows.front().is_invalid());
+    }
+
+    SECTION("reserve") {
+        data lst{data::type::list};
+        lst.reserve(row_count);
+        const auto before = allocation_count.load();
+        for (auto& row : rows) {
+            lst << std::move(row);
+        }
+        CHECK(allocation_count.load() - before == 0);
+        CHECK(lst.list_value().size() == row_count);
+    }
+
+    SECTION("list") {
+        const auto before = allocation_count.load();
+        data lst{std::move(rows)};
+        // Just the list itself
+        CHECK(allocation_count.load() - before == 1);
+        CHECK(lst.list_value().size() == row_count);
+    }
+
+    SECTION("set") {
+        data lst{data::type::list};
+        lst.reserve(row_count);
+        for (auto& row : rows) {
+            lst << std::move(row);
+        }
+        data root;
+        root.reserve(1);
+        const auto before = allocation_count.load();
+        root.set("rows", std::move(lst));
+        // Just the object's node
+        CHECK(allocation_count.load() - before == 1);
+        CHECK(root.get("rows")->list_value().size() == row_count);
+    }
+
+    SECTION("emplace") {
+        data row;
+        row.reserve(2);
+        const auto before = allocation_count.load();
+        row.emplace("name", std::string(40, 'x'));
+        // The string and the object's node
+        CHECK(allocation_count.load() - before == 2);
+        CHECK(row.try_emplace("name", "other")->string_value() == std::string(40, 'x'));
+        CHECK(row.emplace("name", "other")->string_value() == "other");
+        CHECK(row.try_emplace("id", "1")->string_value() == "1");
+        CHECK(data{"str"}.emplace("a") == nullptr);
+
+        data lst{data::type::list};
+        CHECK(lst.emplace_back("a")->string_value() == "a");
+        CHECK(lst.emplace_back(data::type::bool_true)->is_true());
+        CHECK(lst.list_value().size() == 2);
+        CHECK(row.emplace_back("a") == nullptr);
+    }
+
+    SECTION("noexcept") {
+        CHECK(std::is_nothrow_move_constructible<data>::value);
+        CHECK(std::is_nothrow_move_assignable<data>::value);
+    }
+
+    SECTION("copy_assign") {
+        data a{"a"};
+        const data b{list{"x", "y"}};
+        a = b;
+        CHECK(a.list_value().size() == 2);
+        CHECK(b.list_value().size() == 2);
+    }
+
+}
+
 TEST_CASE("errors") {
 
     SECTION("unclosed_section") {
@@ -639,6 +1112,66 @@ TEST_CASE("partials") {
         data data("a.b", a_b);
         CHECK(tmpl.render(data) == "test");
     }
+
+    SECTION("cache") {
+        mustache tmpl{"{{#rows}}{{>row}}{{/rows}}"};
+        std::string row_text{"<{{.}}>"};
+        partial row{[&row_text]() {
+            return row_text;
+        }};
+        data dat("row", row);
+        dat["rows"] = list{"a", "b", "c"};
+        CHECK(tmpl.render(dat) == "<a><b><c>");
+        CHECK(tmpl.partial_cache_statistics().misses == 1);
+        CHECK(tmpl.partial_cache_statistics().hits == 2);
+        CHECK(tmpl.partial_cache_statistics().size == 1);
+
+        // Changed text is parsed again
+        row_text = "[{{.}}]";
+        CHECK(tmpl.render(dat) == "[a][b][c]");
+        CHECK(tmpl.partial_cache_statistics().misses == 2);
+        CHECK(tmpl.partial_cache_statistics().hits == 4);
+        CHECK(tmpl.partial_cache_statistics().size == 2);
+
+        tmpl.invalidate_partial("other");
+        CHECK(tmpl.partial_cache_statistics().size == 2);
+        tmpl.invalidate_partial("row");
+        CHECK(tmpl.partial_cache_statistics().size == 0);
+        CHECK(tmpl.render(dat) == "[a][b][c]");
+        CHECK(tmpl.partial_cache_statistics().misses == 3);
+        tmpl.invalidate_partials();
+        CHECK(tmpl.partial_cache_statistics().size == 0);
+    }
+
+    SECTION("cache_size") {
+        mustache tmpl{"{{>a}}{{>b}}{{>a}}"};
+        data dat;
+        dat["a"] = partial{[]() { return "A{{>b}}"; }};
+        dat["b"] = partial{[]() { return "B"; }};
+        tmpl.set_partial_cache_size(1);
+        CHECK(tmpl.render(dat) == "ABBAB");
+        CHECK(tmpl.partial_cache_statistics().size == 1);
+        // Partials used earlier in the same render are still hits
+        CHECK(tmpl.partial_cache_statistics().hits == 3);
+        CHECK(tmpl.partial_cache_statistics().misses == 2);
+        CHECK(tmpl.render(dat) == "ABBAB");
+        CHECK(tmpl.partial_cache_statistics().hits == 6);
+        CHECK(tmpl.partial_cache_statistics().misses == 4);
+
+        tmpl.set_partial_cache_size(0);
+        CHECK(tmpl.partial_cache_statistics().size == 0);
+        CHECK(tmpl.render(dat) == "ABBAB");
+        CHECK(tmpl.partial_cache_statistics().size == 0);
+        CHECK(tmpl.partial_cache_statistics().hits == 6);
+        CHECK(tmpl.partial_cache_statistics().misses == 9);
+    }
+
+    SECTION("cache_error") {
+        mustache tmpl{"{{>bad}}"};
+        data dat("bad", partial{[]() { return "{{#a}}"; }});
+        CHECK(tmpl.render(dat) == "");
+        CHECK(tmpl.error_message() == "Unclosed section \"a\" at 0");
+    }
 }
 
 TEST_CASE("lambdas") {
@@ -731,6 +1264,20 @@ TEST_CASE("lambdas") {
         CHECK(tmpl.render(data) == "<>");
     }
 
+    SECTION("section_standalone") {
+        // lines with only a section tag are standalone when the section is a
+        // lambda too, so their indentation and newline are removed
+        mustache tmpl{"a\n  {{#lambda}}\nbody\n  {{/lambda}}\nz\n"};
+        data dat("lambda", data{lambda{[](const std::string& text){
+            return text == "\nbody\n  " ? "X" : "?";
+        }}});
+        CHECK(tmpl.render(dat) == "a\nXz\n");
+        dat["lambda"] = lambda{[](const std::string& text){
+            return text + "\n";
+        }};
+        CHECK(tmpl.render(dat) == "a\n\nbody\n  \nz\n");
+    }
+
 }
 
 TEST_CASE("dotted_names") {
@@ -1094,6 +1641,50 @@ TEST_CASE("custom_escape") {
         CHECK_THROWS_AS(tmpl.render(dat), std::bad_function_call);
     }
 
+    SECTION("append") {
+        mustache tmpl{"{{a}} {{&a}} {{#quote}}{{a}}{{/quote}} {{>partial}}\n{{#list}}\n  {{.}}\n{{/list}}\n"};
+        tmpl.set_custom_escape_append([](const std::string& s, std::string& out) {
+            for (const auto ch: s) {
+                if (ch == '\"') {
+                    out.push_back('\\');
+                }
+                out.push_back(ch);
+            }
+        });
+        data dat;
+        dat.set("a", "\"a\"");
+        dat.set("quote", lambda_t{{[](const std::string& s, const renderer& r) {
+            return r("[" + s + "]", false);
+        }}});
+        dat.set("partial", partial{[]() {
+            return "<{{a}}>";
+        }});
+        data list{data::type::list};
+        list << "\"b\"";
+        dat.set("list", list);
+        CHECK(tmpl.render(dat) == "\\\"a\\\" \"a\" [\\\"a\\\"] <\\\"a\\\">\n  \\\"b\\\"\n");
+        CHECK(tmpl.is_valid());
+    }
+
+    SECTION("no_temporaries") {
+        mustache tmpl{"{{#items}}<li>{{.}}</li>{{/items}}"};
+        data items{data::type::list};
+        for (int i = 0; i < 100; ++i) {
+            items << "a & b < c > \"d\" 'e' with some text that is not short";
+        }
+        const data dat{"items", items};
+        std::string out;
+        out.reserve(1 << 16);
+        string_sink sink{out};
+        tmpl.render_to(dat, sink);
+        out.clear();
+        const auto before = allocation_count.load();
+        tmpl.render_to(dat, sink);
+        const auto count = allocation_count.load() - before;
+        CHECK(count < 10);
+        CHECK(out.find("a &amp; b &lt; c &gt; &quot;d&quot; &apos;e&apos;") == 4);
+    }
+
 }
 
 template <typename string_type>
@@ -1125,6 +1716,189 @@ private:
     basic_data<string_type> value_;
 };
 
+// A context that looks names up without calling get()
+template <typename string_type>
+class key_lookup_context : public context<string_type> {
+public:
+    key_lookup_context() {
+        this->use_key_lookup();
+    }
+};
+
+TEST_CASE("context_stack") {
+
+    std::vector<data> levels(40);
+    for (std::size_t i = 0; i < levels.size(); ++i) {
+        levels[i].set("depth", std::to_string(i));
+        if (i % 2 == 0) {
+            levels[i].set("even", std::to_string(i));
+        }
+    }
+
+    SECTION("lookup") {
+        context<std::string> ctx;
+        for (std::size_t i = 0; i < levels.size(); ++i) {
+            ctx.push(&levels[i]);
+            CHECK(ctx.get("depth")->string_value() == std::to_string(i));
+            CHECK(ctx.get("even")->string_value() == std::to_string(i - i % 2));
+            CHECK(ctx.get(".") == &levels[i]);
+        }
+        for (std::size_t i = levels.size() - 1; i > 0; --i) {
+            ctx.pop();
+            CHECK(ctx.get("depth")->string_value() == std::to_string(i - 1));
+        }
+    }
+
+    SECTION("clone") {
+        // only contexts that don't use get() for lookups can be cloned
+        CHECK(context<std::string>{}.clone() == nullptr);
+        key_lookup_context<std::string> ctx;
+        for (const auto& level : levels) {
+            ctx.push(&level);
+        }
+        const auto copy = ctx.clone();
+        ctx.pop();
+        CHECK(copy->get("depth")->string_value() == "39");
+        CHECK(ctx.get("depth")->string_value() == "38");
+        copy->pop();
+        copy->pop();
+        CHECK(copy->get("depth")->string_value() == "37");
+    }
+
+    SECTION("allocations") {
+        context<std::string> ctx;
+        const auto before = allocation_count.load();
+        for (std::size_t i = 0; i < 16; ++i) {
+            ctx.push(&levels[i]);
+        }
+        CHECK(allocation_count.load() - before == 0);
+        ctx.push(&levels[16]);
+        CHECK(allocation_count.load() - before == 1);
+    }
+
+    SECTION("nested_lists") {
+        mustache tmpl{"{{#a}}{{#b}}{{#c}}{{x}}{{y}}{{z}}{{/c}}{{/b}}{{/a}}"};
+        data c{data::type::list};
+        c << data{"z", "3"} << data{"z", "4"};
+        data b{data::type::list};
+        b << data{"c", c} << data{"c", c};
+        data dat;
+        dat.set("a", data{"b", b});
+        dat["a"].set("y", "2");
+        dat.set("x", "1");
+        CHECK(tmpl.render(dat) == "123124123124");
+    }
+
+}
+
+// Counts the context items looked in, optionally without the lookup cache
+template <typename string_type>
+class counting_context : public context<string_type> {
+public:
+    counting_context(const basic_data<string_type>* data, bool cached) : context<string_type>(data), cached_(cached) {}
+
+    virtual std::size_t depth() const override {
+        return cached_ ? this->resolve_depth() : 0;
+    }
+
+    virtual const basic_data<string_type>* resolve(const tag_path<string_type>& path) const override {
+        searched += this->resolve_depth();
+        return this->resolve_keys(path);
+    }
+
+    virtual const basic_data<string_type>* resolve_from(const tag_path<string_type>& path, std::size_t first, std::size_t& level) const override {
+        searched += this->resolve_depth() - first;
+        return this->resolve_keys_from(path, first, level);
+    }
+
+    mutable std::size_t searched = 0;
+
+private:
+    bool cached_;
+};
+
+TEST_CASE("lookup_cache") {
+
+    data rows{data::type::list};
+    for (int i = 0; i < 100; ++i) {
+        data row;
+        row.set("id", std::to_string(i));
+        if (i % 7 == 0) {
+            row.set("title", "row " + std::to_string(i));
+        }
+        if (i % 10 == 0) {
+            row.set("site", data{"name", "shadow"});
+        }
+        if (i % 5 == 0) {
+            row.set("inner", data{"id", "inner " + std::to_string(i)});
+        }
+        rows << row;
+    }
+    data dat;
+    dat.set("title", "Title");
+    dat.set("site", data{"name", "Site"});
+    dat.set("group", data{"rows", rows});
+    dat.set("cell", partial{[]() {
+        return "[{{title}}|{{site.name}}|{{missing}}]";
+    }});
+
+    const auto render_both = [&dat](const std::string& text) {
+        mustache tmpl{text};
+        counting_context<std::string> uncached{&dat, false};
+        counting_context<std::string> cached{&dat, true};
+        const std::string expected = tmpl.render(uncached);
+        CHECK(tmpl.render(cached) == expected);
+        CHECK(cached.searched <= uncached.searched);
+        return std::make_pair(uncached.searched, cached.searched);
+    };
+
+    SECTION("same_output") {
+        render_both("{{#group}}{{#rows}}{{id}} {{title}} {{site.name}} {{missing}}{{^missing}}!{{/missing}}{{#inner}}({{id}} {{title}}){{/inner}}{{>cell}}\n{{/rows}}{{/group}}");
+        render_both("{{#group}}{{#rows}}{{#rows}}{{id}}{{title}},{{/rows}}{{/rows}}{{/group}}");
+        render_both("{{title}}{{#site}}{{name}}{{title}}{{/site}}{{#group}}{{title}}{{/group}}");
+    }
+
+    SECTION("fewer_lookups") {
+        // title and site are found in the root for most rows, which are two
+        // items below the row
+        const auto searched = render_both("{{#group}}{{#rows}}{{title}}{{site.name}}{{missing}}{{/rows}}{{/group}}");
+        CHECK(searched.first >= 100 * 3 * 3);
+        CHECK(searched.second < 100 * 3 + 20);
+    }
+
+    SECTION("lambda_sections") {
+        data with_lambda{dat};
+        with_lambda.set("wrap", lambda{[](const std::string& text) {
+            return "<" + text + ">";
+        }});
+        mustache tmpl{"{{#group}}{{#rows}}{{#wrap}}{{id}}{{title}}{{/wrap}}{{/rows}}{{/group}}"};
+        counting_context<std::string> uncached{&with_lambda, false};
+        counting_context<std::string> cached{&with_lambda, true};
+        CHECK(tmpl.render(cached) == tmpl.render(uncached));
+    }
+
+    SECTION("uncached_partials") {
+        // partials that aren't cached are freed when they're done, and the
+        // next one may be allocated at the same address
+        data items{data::type::list};
+        for (int i = 0; i < 3; ++i) {
+            data item;
+            item.set("x", "X");
+            item.set("y", "Y");
+            item.set("z", "Z");
+            items << item;
+        }
+        data root{"outer", data{"rows", items}};
+        root.set("a", "[{{x}}]");
+        root.set("b", "({{y}})");
+        root.set("c", "({{y}}{{z}}{{y}}{{z}})");
+        mustache tmpl{"{{#outer}}{{#rows}}{{>a}}|{{>b}}|{{>c}};{{/rows}}{{/outer}}"};
+        tmpl.set_partial_cache_size(0);
+        CHECK(tmpl.render(root) == "[X]|(Y)|(YZYZ);[X]|(Y)|(YZYZ);[X]|(Y)|(YZYZ);");
+    }
+
+}
+
 TEST_CASE("custom_context") {
 
     SECTION("basic") {
@@ -1144,6 +1918,65 @@ TEST_CASE("custom_context") {
 
 }
 
+// Overrides get() of the default context, which the renderer must still call
+template <typename string_type>
+class overriding_context : public context<string_type> {
+public:
+    overriding_context(const basic_data<string_type>* data)
+        : context<string_type>(data)
+        , value_("OVERRIDDEN")
+    {
+    }
+
+    virtual const basic_data<string_type>* get(const string_type& name) const override {
+        if (name == "a") {
+            return &value_;
+        }
+        return context<string_type>::get(name);
+    }
+
+private:
+    basic_data<string_type> value_;
+};
+
+TEST_CASE("overriding_context") {
+
+    data dat;
+    dat.set("b", "B");
+    dat.set("rows", data{data::type::list} << data{"x", "1"} << data{"x", "2"});
+
+    SECTION("get") {
+        overriding_context<mustache::string_type> ctx{&dat};
+        mustache tmpl{"[A {{a}}]{{#a}} {{b}}{{/a}}"};
+        CHECK(tmpl.render(ctx) == "[A OVERRIDDEN] B");
+    }
+
+    SECTION("sections") {
+        overriding_context<mustache::string_type> ctx{&dat};
+        mustache tmpl{"{{#rows}}{{x}}{{a}}{{b}},{{/rows}}"};
+        CHECK(tmpl.render(ctx) == "1OVERRIDDENB,2OVERRIDDENB,");
+        CHECK(ctx.clone() == nullptr);
+    }
+
+    SECTION("parallel") {
+        data rows{data::type::list};
+        for (int i = 0; i < 100; ++i) {
+            rows << data{"x", std::to_string(i)};
+        }
+        data big{"rows", rows};
+        const auto pool = std::make_shared<thread_pool>(4);
+        mustache tmpl{"{{#rows}}{{a}}{{/rows}}"};
+        tmpl.set_parallel_sections(pool, 10);
+        overriding_context<mustache::string_type> ctx{&big};
+        std::string expected;
+        for (int i = 0; i < 100; ++i) {
+            expected += "OVERRIDDEN";
+        }
+        CHECK(tmpl.render(ctx) == expected);
+    }
+
+}
+
 template <typename string_type>
 class file_partial_context : public context<string_type> {
 public:
@@ -1230,61 +2063,63 @@ TEST_CASE("standalone_lines") {
         parser<mustache::string_type>{input, context, root_component, error_message};
         CHECK(error_message.empty());
         const auto& root_children = root_component.children;
-        REQUIRE(root_children.size() == 15);
-        CHECK(root_children[0].text == "|");
-        CHECK(root_children[0].tag.type == tag_type::text);
-        CHECK(root_children[0].children.empty());
-        CHECK(root_children[1].text == "\n");
-        CHECK(root_children[1].tag.type == tag_type::text);
-        CHECK(root_children[1].children.empty());
-        CHECK(root_children[2].text == "|");
-        CHECK(root_children[2].tag.type == tag_type::text);
-        CHECK(root_children[2].children.empty());
-        CHECK(root_children[3].text == " ");
-        CHECK(root_children[3].tag.type == tag_type::text);
-        CHECK(root_children[3].children.empty());
-        CHECK(root_children[4].text == "This");
-        CHECK(root_children[4].tag.type == tag_type::text);
-        CHECK(root_children[4].children.empty());
+        REQUIRE(root_children.size() == 7);
+        // spaces are part of the text around them
+        const std::vector<mustache::string_type> texts{"|", "\n", "| This Is", "\n", "", "\n", "| A Line"};
+        for (std::size_t i = 0; i < texts.size(); ++i) {
+            CHECK(root_children[i].text == texts[i]);
+            CHECK(root_children[i].tag.type == (i == 4 ? tag_type::section_begin : tag_type::text));
+        }
+        REQUIRE(root_children[4].children.size() == 3);
+        CHECK(root_children[4].children[0].text == "\n");
+        CHECK(root_children[4].children[0].tag.type == tag_type::text);
+        CHECK(root_children[4].children[0].children.empty());
+        CHECK(root_children[4].children[1].text == "|");
+        CHECK(root_children[4].children[1].tag.type == tag_type::text);
+        CHECK(root_children[4].children[1].children.empty());
+        CHECK(root_children[4].children[2].text == "\n");
+        CHECK(root_children[4].children[2].tag.type == tag_type::text);
+        CHECK(root_children[4].children[2].children.empty());
+        // the lines with the section tags are standalone
+        CHECK(root_children[4].children[0].standalone);
+        CHECK(root_children[5].standalone);
+        CHECK_FALSE(root_children[1].standalone);
+        CHECK_FALSE(root_children[3].standalone);
+        CHECK_FALSE(root_children[4].children[2].standalone);
+        for (const auto& child : root_children) {
+            CHECK_FALSE(child.dynamic_line);
+        }
+    }
+
+    SECTION("parse_standalone_whitespace") {
+        const mustache::string_type input = "a {{x}}\n  {{#s}}\t\n\t{{/s}}\n  {{>p}}\n";
+        component<mustache::string_type> root_component;
+        mustache::string_type error_message;
+        context<mustache::string_type> ctx;
+        context_internal<mustache::string_type> context{ctx};
+        parser<mustache::string_type>{input, context, root_component, error_message};
+        CHECK(error_message.empty());
+        const auto& root_children = root_component.children;
+        REQUIRE(root_children.size() == 9);
+        CHECK(root_children[0].text == "a ");
+        CHECK(root_children[1].tag.type == tag_type::variable);
+        CHECK(root_children[3].tag.type == tag_type::section_begin);
+        // the indentation and trailing whitespace are gone
+        REQUIRE(root_children[3].children.size() == 1);
+        CHECK(root_children[3].children[0].text == "\n");
+        CHECK(root_children[3].children[0].standalone);
+        CHECK(root_children[4].text == "\n");
+        CHECK(root_children[4].standalone);
+        // the line with the partial is decided while rendering
         CHECK(root_children[5].text == " ");
-        CHECK(root_children[5].tag.type == tag_type::text);
-        CHECK(root_children[5].children.empty());
-        CHECK(root_children[6].text == "Is");
-        CHECK(root_children[6].tag.type == tag_type::text);
-        CHECK(root_children[6].children.empty());
-        CHECK(root_children[7].text == "\n");
-        CHECK(root_children[7].tag.type == tag_type::text);
-        CHECK(root_children[7].children.empty());
-        CHECK(root_children[8].text.empty());
-        CHECK(root_children[8].tag.type == tag_type::section_begin);
-        REQUIRE(root_children[8].children.size() == 3);
-        CHECK(root_children[8].children[0].text == "\n");
-        CHECK(root_children[8].children[0].tag.type == tag_type::text);
-        CHECK(root_children[8].children[0].children.empty());
-        CHECK(root_children[8].children[1].text == "|");
-        CHECK(root_children[8].children[1].tag.type == tag_type::text);
-        CHECK(root_children[8].children[1].children.empty());
-        CHECK(root_children[8].children[2].text == "\n");
-        CHECK(root_children[8].children[2].tag.type == tag_type::text);
-        CHECK(root_children[8].children[2].children.empty());
-        CHECK(root_children[9].text == "\n");
-        CHECK(root_children[9].tag.type == tag_type::text);
-        CHECK(root_children[9].children.empty());
-        CHECK(root_children[10].text == "|");
-        CHECK(root_children[10].tag.type == tag_type::text);
-        CHECK(root_children[10].children.empty());
-        CHECK(root_children[11].text == " ");
-        CHECK(root_children[11].tag.type == tag_type::text);
-        CHECK(root_children[11].children.empty());
-        CHECK(root_children[12].text == "A");
-        CHECK(root_children[12].tag.type == tag_type::text);
-        CHECK(root_children[12].children.empty());
-        CHECK(root_children[13].text == " ");
-        CHECK(root_children[13].tag.type == tag_type::text);
-        CHECK(root_children[13].children.empty());
-        CHECK(root_children[14].text == "Line");
-        CHECK(root_children[14].tag.type == tag_type::text);
-        CHECK(root_children[14].children.empty());
+        CHECK(root_children[5].dynamic_line);
+        CHECK(root_children[7].tag.type == tag_type::partial);
+        CHECK(root_children[7].dynamic_line);
+        CHECK(root_children[8].text == "\n");
+        CHECK(root_children[8].dynamic_line);
+        CHECK_FALSE(root_children[8].standalone);
+        CHECK_FALSE(root_children[2].dynamic_line);
+        CHECK_FALSE(root_children[2].standalone);
     }
 
     SECTION("remove_standalone_lines") {
@@ -1323,14 +2158,28 @@ TEST_CASE("standalone_lines") {
         );
     }
 
-    SECTION("crlf") {
-        mustache tmpl{"|\r\n{{#boolean}}\r\n{{/boolean}}\r\n|"};
-        data data("boolean", true);
-        CHECK(tmpl.render(data) == "|\r\n|");
-    }
-
-    SECTION("without_previous_line") {
-        mustache tmpl{"  {{#boolean}}\n#{{/boolean}}\n/"};
+    SECTION("remove_false_standalone_lines") {
+        mustache tmpl{
+            "|\n"
+            "  {{#boolean}}\n"
+            "|\n"
+            "  {{/boolean}}\n"
+            "  {{^boolean}}  {{! comment }}\n"
+            "| A Line\n"
+            "{{/boolean}}\n"
+        };
+        CHECK(tmpl.render({"boolean", false}) == "|\n| A Line\n");
+        CHECK(tmpl.render({"boolean", true}) == "|\n|\n");
+    }
+
+    SECTION("crlf") {
+        mustache tmpl{"|\r\n{{#boolean}}\r\n{{/boolean}}\r\n|"};
+        data data("boolean", true);
+        CHECK(tmpl.render(data) == "|\r\n|");
+    }
+
+    SECTION("without_previous_line") {
+        mustache tmpl{"  {{#boolean}}\n#{{/boolean}}\n/"};
         data data("boolean", true);
         CHECK(tmpl.render(data) == "#\n/");
     }
@@ -1428,6 +2277,60 @@ TEST_CASE("standalone_lines") {
         );
     }
 
+    SECTION("partial_then_merged_text") {
+        mustache tmpl{"{{>p}}{{#s}}\nx\n{{/s}}abc\ndef\n"};
+        data dat{"p", "P"};
+        dat["s"] = false;
+        CHECK(tmpl.render(dat) == "Pabc\ndef\n");
+        dat["s"] = true;
+        CHECK(tmpl.render(dat) == "P\nx\nabc\ndef\n");
+    }
+
+    SECTION("long_line_streams") {
+        std::string line;
+        for (int i = 0; i < 2000; ++i) {
+            line += "{\"key\":\"{{value}}\"},";
+        }
+        mustache tmpl{line};
+        std::string result;
+        std::size_t calls = 0;
+        tmpl.render({"value", "v"}, [&result, &calls](const std::string& str) {
+            CHECK(str.size() < 8192);
+            result += str;
+            ++calls;
+        });
+        CHECK(calls > 1);
+        std::string expected;
+        for (int i = 0; i < 2000; ++i) {
+            expected += "{\"key\":\"v\"},";
+        }
+        CHECK(result == expected);
+    }
+
+    SECTION("partial_line_streams") {
+        // a line with a partial is only held until it has more than whitespace
+        mustache tmpl{"<html>{{>body}}</html>\n  {{>body}}\n"};
+        data rows{data::type::list};
+        for (int i = 0; i < 2000; ++i) {
+            rows << data{"id", std::to_string(i)};
+        }
+        data dat{"rows", rows};
+        dat["body"] = "{{#rows}}<p>{{id}}</p>{{/rows}}";
+        std::string result;
+        std::size_t calls = 0;
+        tmpl.render(dat, [&result, &calls](const std::string& str) {
+            CHECK(str.size() < 8192);
+            result += str;
+            ++calls;
+        });
+        CHECK(calls > 4);
+        std::string body;
+        for (int i = 0; i < 2000; ++i) {
+            body += "<p>" + std::to_string(i) + "</p>";
+        }
+        CHECK(result == "<html>" + body + "</html>\n  " + body + "\n");
+    }
+
     SECTION("partial_indent_bug") {
         mustache tmpl{
             "No indent\n"
@@ -1472,3 +2375,1499 @@ TEST_CASE("standalone_lines") {
     }
 
 }
+
+TEST_CASE("try_render") {
+
+    SECTION("basic") {
+        const mustache tmpl{"Hello {{what}}!"};
+        data dat("what", "World");
+        const auto result = tmpl.try_render(dat);
+        CHECK(result.is_valid());
+        CHECK(result.output == "Hello World!");
+    }
+
+    SECTION("handler") {
+        const mustache tmpl{"{{#list}}{{.}},{{/list}}"};
+        data dat("list", list{"a", "b", "c"});
+        std::string output;
+        const auto result = tmpl.try_render(dat, [&output](const std::string& str) {
+            output += str;
+        });
+        CHECK(result.is_valid());
+        CHECK(result.output.empty());
+        CHECK(output == "a,b,c,");
+    }
+
+    SECTION("error") {
+        const mustache tmpl{"{{name}} is awesome."};
+        data dat("name", lambda2{[](const std::string&, const renderer&) -> mustache::string_type {
+            return {};
+        }});
+        const auto result = tmpl.try_render(dat);
+        CHECK_FALSE(result.is_valid());
+        CHECK(result.error_message == "Lambda with render argument is not allowed for regular variables");
+        CHECK(tmpl.is_valid());
+
+        // Later renders aren't affected
+        const auto result2 = tmpl.try_render(data("name", "Steve"));
+        CHECK(result2.is_valid());
+        CHECK(result2.output == "Steve is awesome.");
+    }
+
+    SECTION("invalid") {
+        const mustache tmpl{"{{#a}}"};
+        const auto result = tmpl.try_render(data{});
+        CHECK_FALSE(result.is_valid());
+        CHECK(result.error_message == tmpl.error_message());
+    }
+
+    SECTION("threads") {
+        const mustache tmpl{"{{#rows}}{{>row}}{{/rows}}"};
+        std::vector<std::string> outputs(8);
+        std::vector<std::thread> threads;
+        for (std::size_t i = 0; i < outputs.size(); ++i) {
+            threads.emplace_back([&tmpl, &outputs, i]() {
+                data rows{data::type::list};
+                for (std::size_t j = 0; j < 100; ++j) {
+                    rows << data("n", std::to_string(i * j));
+                }
+                data dat("rows", rows);
+                dat["row"] = partial{[]() { return "{{n}},"; }};
+                for (int k = 0; k < 20; ++k) {
+                    outputs[i] = tmpl.try_render(dat).output;
+                }
+            });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        for (std::size_t i = 0; i < outputs.size(); ++i) {
+            std::string expected;
+            for (std::size_t j = 0; j < 100; ++j) {
+                expected += std::to_string(i * j) + ",";
+            }
+            CHECK(outputs[i] == expected);
+        }
+        CHECK(tmpl.partial_cache_statistics().size == 1);
+        CHECK(tmpl.partial_cache_statistics().hits + tmpl.partial_cache_statistics().misses == 8 * 20 * 100);
+    }
+
+}
+
+namespace {
+
+// Only has operator<<, so it's rendered to through a handler
+class collecting_stream {
+public:
+    std::string text;
+    std::size_t writes = 0;
+};
+
+collecting_stream& operator<<(collecting_stream& stream, const std::string& str) {
+    stream.text += str;
+    ++stream.writes;
+    return stream;
+}
+
+// Takes at most limit characters
+class limited_streambuf : public std::streambuf {
+public:
+    explicit limited_streambuf(std::size_t limit) : limit_(limit) {}
+    std::string text;
+
+protected:
+    std::streamsize xsputn(const char* s, std::streamsize n) override {
+        const auto count = std::min(static_cast<std::size_t>(n), limit_ - text.size());
+        text.append(s, count);
+        return static_cast<std::streamsize>(count);
+    }
+
+private:
+    std::size_t limit_;
+};
+
+}
+
+TEST_CASE("sinks") {
+
+    const mustache tmpl{"Hello {{what}}! {{#list}}{{.}}{{/list}}"};
+    data dat("what", "<World>");
+    dat["list"] = list{"a", "b", "c"};
+    const std::string expected = "Hello &lt;World&gt;! abc";
+
+    SECTION("string") {
+        std::string output = "> ";
+        string_sink sink{output};
+        CHECK(tmpl.render_to(dat, sink).is_valid());
+        CHECK(output == "> " + expected);
+    }
+
+    SECTION("streambuf") {
+        std::ostringstream stream;
+        streambuf_sink sink{*stream.rdbuf()};
+        CHECK(tmpl.render_to(dat, sink).is_valid());
+        CHECK_FALSE(sink.failed());
+        CHECK(stream.str() == expected);
+    }
+
+    SECTION("fixed_buffer") {
+        char buffer[64];
+        fixed_buffer_sink sink{buffer, sizeof(buffer)};
+        CHECK(tmpl.render_to(dat, sink).is_valid());
+        CHECK_FALSE(sink.truncated());
+        CHECK(std::string(sink.data(), sink.size()) == expected);
+
+        fixed_buffer_sink small{buffer, 8};
+        tmpl.render_to(dat, small);
+        CHECK(small.truncated());
+        CHECK(std::string(small.data(), small.size()) == expected.substr(0, 8));
+    }
+
+    SECTION("error") {
+        const mustache bad{"{{#a}}"};
+        std::string output;
+        string_sink sink{output};
+        const auto result = bad.render_to(dat, sink);
+        CHECK_FALSE(result.is_valid());
+        CHECK(result.error_message == bad.error_message());
+        CHECK(output.empty());
+    }
+
+    SECTION("stream") {
+        mustache copy{tmpl};
+        std::ostringstream stream;
+        stream << "> ";
+        copy.render(dat, stream);
+        CHECK(stream.str() == "> " + expected);
+        CHECK(stream.good());
+    }
+
+    SECTION("stream_failure") {
+        mustache copy{tmpl};
+        limited_streambuf buf{10};
+        std::ostream stream{&buf};
+        copy.render(dat, stream);
+        CHECK(buf.text == expected.substr(0, 10));
+        CHECK(stream.bad());
+    }
+
+    SECTION("other_stream") {
+        mustache copy{tmpl};
+        collecting_stream stream;
+        copy.render(dat, stream);
+        CHECK(stream.text == expected);
+        CHECK(stream.writes == 1);
+    }
+
+}
+
+TEST_CASE("chunked_render") {
+
+    mustache tmpl{"<ul>\n{{#items}}\n  {{>item}}\n{{/items}}\n</ul>{{#missing}}x{{/missing}}\n"};
+    data items{data::type::list};
+    for (int i = 0; i < 500; ++i) {
+        data item;
+        item.set("id", std::to_string(i));
+        item.set("name", "<" + std::to_string(i) + ">");
+        items << item;
+    }
+    data dat;
+    dat.set("items", items);
+    dat.set("item", partial{[]() {
+        return "<li id=\"{{id}}\">{{#name}}{{.}}{{/name}}</li>";
+    }});
+    const std::string expected = tmpl.render(dat);
+    REQUIRE(expected.size() > 10000);
+
+    SECTION("sizes") {
+        for (const std::size_t size : {std::size_t{0}, std::size_t{1}, std::size_t{7}, std::size_t{100}, std::size_t{4096}, std::size_t{1000000}}) {
+            auto chunks = tmpl.render_chunks(dat, size);
+            std::string output;
+            std::size_t count = 0;
+            while (chunks.next()) {
+                // no single instruction writes more than 40 characters here
+                CHECK(chunks.chunk().size() < std::max<std::size_t>(size, 1) + 40);
+                output += chunks.chunk();
+                ++count;
+            }
+            CHECK(chunks.done());
+            CHECK(chunks.is_valid());
+            CHECK_FALSE(chunks.next());
+            CHECK(output == expected);
+            if (size == 100) {
+                CHECK(count > expected.size() / 130);
+            }
+        }
+    }
+
+    SECTION("inline_partial") {
+        // the line with the partial isn't held until its newline
+        mustache page{"<html>{{>body}}</html>\n"};
+        data body{dat};
+        body.set("body", partial{[]() {
+            return "{{#items}}<td>{{name}}</td>{{/items}}";
+        }});
+        const std::string page_expected = page.render(body);
+        REQUIRE(page_expected.size() > 8192);
+        auto chunks = page.render_chunks(body, 4096);
+        std::string output;
+        std::size_t count = 0;
+        while (chunks.next()) {
+            CHECK(chunks.chunk().size() < 4096 + 40);
+            output += chunks.chunk();
+            ++count;
+        }
+        CHECK(count > 2);
+        CHECK(output == page_expected);
+    }
+
+    SECTION("context") {
+        context<std::string> ctx{&dat};
+        auto chunks = tmpl.render_chunks(ctx, 64);
+        std::string output;
+        while (chunks.next()) {
+            output += chunks.chunk();
+        }
+        CHECK(output == expected);
+    }
+
+    SECTION("interleaved") {
+        auto a = tmpl.render_chunks(dat, 50);
+        auto b = tmpl.render_chunks(dat, 70);
+        std::string output_a;
+        std::string output_b;
+        bool more_a = true;
+        bool more_b = true;
+        while (more_a || more_b) {
+            if (more_a && (more_a = a.next())) {
+                output_a += a.chunk();
+            }
+            if (more_b && (more_b = b.next())) {
+                output_b += b.chunk();
+            }
+        }
+        CHECK(output_a == expected);
+        CHECK(output_b == expected);
+    }
+
+    SECTION("error") {
+        data bad{dat};
+        bad.set("item", partial{[]() {
+            return "{{#id}}";
+        }});
+        auto chunks = tmpl.render_chunks(bad, 1);
+        std::string output;
+        while (chunks.next()) {
+            output += chunks.chunk();
+        }
+        CHECK(output == "<ul>\n  ");
+        CHECK_FALSE(chunks.is_valid());
+        CHECK(chunks.error_message() == "Unclosed section \"id\" at 0");
+
+        const mustache invalid{"{{#a}}"};
+        auto invalid_chunks = invalid.render_chunks(dat);
+        CHECK_FALSE(invalid_chunks.next());
+        CHECK(invalid_chunks.done());
+        CHECK(invalid_chunks.error_message() == invalid.error_message());
+    }
+
+#if defined(KAINJOW_MUSTACHE_COROUTINES)
+    SECTION("generator") {
+        auto chunks = tmpl.render_generator(dat, 256);
+        std::string output;
+        for (const auto& chunk : chunks) {
+            CHECK(chunk.size() < 256 + 40);
+            output += chunk;
+        }
+        CHECK(chunks.is_valid());
+        CHECK(output == expected);
+    }
+#endif
+
+}
+
+TEST_CASE("parallel_sections") {
+
+    const auto pool = std::make_shared<thread_pool>(4);
+
+    data rows{data::type::list};
+    for (int i = 0; i < 2000; ++i) {
+        data row;
+        row.set("id", std::to_string(i));
+        row.set("name", "<" + std::to_string(i) + ">");
+        row.set("even", i % 2 == 0);
+        data tags{data::type::list};
+        for (int j = 0; j < i % 4; ++j) {
+            tags << std::to_string(j);
+        }
+        row.set("tags", tags);
+        rows << row;
+    }
+    data dat;
+    dat.set("title", "Rows");
+    dat.set("rows", rows);
+    dat.set("row", partial{[]() {
+        return "<td>{{name}}</td>";
+    }});
+
+    const auto check_same = [&pool](const std::string& text, const data& input) {
+        mustache serial{text};
+        mustache parallel{text};
+        parallel.set_parallel_sections(pool, 10);
+        const auto expected = serial.try_render(input);
+        const auto result = parallel.try_render(input);
+        CHECK(result.output == expected.output);
+        CHECK(result.error_message == expected.error_message);
+    };
+
+    SECTION("same_output") {
+        check_same("<h1>{{title}}</h1>\n<table>\n{{#rows}}\n<tr id=\"{{id}}\">{{>row}}{{#even}}<td>even</td>{{/even}}{{^even}}<td>odd</td>{{/even}}{{#tags}}[{{.}}]{{/tags}}</tr>\n{{/rows}}\n</table>\n", dat);
+        check_same("{{#rows}}{{title}}{{/rows}}", dat);
+        check_same("{{#rows}}{{#tags}}{{id}}.{{.}} {{/tags}}{{/rows}}", dat);
+    }
+
+    SECTION("dynamic_lines") {
+        // partials on their own line are only known to be standalone when
+        // rendering, so chunks check that they continue the line before them
+        check_same("{{#rows}}\n  {{>row}}\n{{/rows}}\n", dat);
+        check_same("  {{#rows}}{{>row}}{{/rows}}\n", dat);
+        data inner{dat};
+        inner.set("row", partial{[]() {
+            return "{{#even}}\n{{name}}\n{{/even}}\n  {{#tags}}\n{{/tags}}  \n";
+        }});
+        check_same("{{#rows}}<{{>row}}>{{/rows}}", inner);
+        check_same("{{#rows}}{{>row}}{{/rows}}", inner);
+        check_same("{{#rows}}  {{>row}}{{/rows}}", inner);
+        inner.set("row", partial{[]() {
+            return "{{#even}}  {{/even}}{{^even}}{{#tags}}\n{{/tags}}{{/even}}";
+        }});
+        check_same("{{#rows}}{{>row}}{{/rows}}\n", inner);
+        check_same("{{#rows}}{{=<% %>=}}<%id%>{{/rows}}", dat);
+    }
+
+    SECTION("partials") {
+        // the first call waits for another thread to call the partial too,
+        // which only happens if the list is rendered in parallel
+        std::mutex mutex;
+        std::condition_variable called;
+        std::set<std::thread::id> threads;
+        bool waited = false;
+        data with_partial{dat};
+        with_partial.set("row", partial{[&]() {
+            std::unique_lock<std::mutex> lock{mutex};
+            threads.insert(std::this_thread::get_id());
+            called.notify_all();
+            if (!waited) {
+                waited = true;
+                called.wait_for(lock, std::chrono::seconds{10}, [&threads]() {
+                    return threads.size() > 1;
+                });
+            }
+            return std::string{"<td>{{name}}</td>"};
+        }});
+        mustache tmpl{"<tr>{{#rows}}{{>row}}{{/rows}}</tr>\n"};
+        tmpl.set_parallel_sections(pool, 10);
+        const std::string expected = mustache{"<tr>{{#rows}}{{>row}}{{/rows}}</tr>\n"}.render(dat);
+        CHECK(tmpl.render(with_partial) == expected);
+        CHECK(threads.size() > 1);
+    }
+
+    SECTION("lambdas") {
+        std::atomic<int> calls{0};
+        data with_lambda{dat};
+        with_lambda.set("upper", lambda{[&calls](const std::string& text) {
+            ++calls;
+            std::string result{text};
+            std::transform(result.begin(), result.end(), result.begin(), ::toupper);
+            return result;
+        }});
+        mustache tmpl{"{{#rows}}{{#upper}}x{{id}}{{/upper}}{{/rows}}"};
+        const std::string expected = tmpl.render(with_lambda);
+        CHECK(calls == 2000);
+        tmpl.set_parallel_sections(pool, 10);
+        CHECK(tmpl.render(with_lambda) == expected);
+        CHECK(calls == 4000);
+
+        // a partial that sets delimiters keeps the section serial, rather
+        // than calling the lambdas again after rendering it in parallel
+        with_lambda.set("p", "{{=<% %>=}}<%id%>");
+        mustache with_partial{"{{#rows}}{{#upper}}{{/upper}}{{>p}}{{/rows}}"};
+        const std::string serial = with_partial.render(with_lambda);
+        CHECK(calls == 6000);
+        with_partial.set_parallel_sections(pool, 10);
+        CHECK(with_partial.render(with_lambda) == serial);
+        CHECK(calls == 8000);
+    }
+
+    SECTION("error") {
+        data bad{dat};
+        bad.set("row", partial{[]() {
+            return "{{#name}}";
+        }});
+        check_same("start {{#rows}}{{id}},{{#even}}{{>row}}{{/even}}{{/rows}} end", bad);
+        check_same("{{#rows}}{{id}},{{/rows}}{{>row}}", bad);
+    }
+
+    SECTION("small_lists") {
+        mustache tmpl{"{{#rows}}{{id}}{{/rows}}"};
+        tmpl.set_parallel_sections(pool, 1000000);
+        mustache serial{"{{#rows}}{{id}}{{/rows}}"};
+        CHECK(tmpl.render(dat) == serial.render(dat));
+    }
+
+    SECTION("threads") {
+        mustache tmpl{"{{#rows}}<{{name}}>{{/rows}}"};
+        tmpl.set_parallel_sections(pool, 10);
+        const std::string expected = mustache{"{{#rows}}<{{name}}>{{/rows}}"}.render(dat);
+        std::vector<std::thread> threads;
+        std::atomic<int> matches{0};
+        for (int i = 0; i < 4; ++i) {
+            threads.emplace_back([&]() {
+                for (int j = 0; j < 5; ++j) {
+                    if (tmpl.try_render(dat).output == expected) {
+                        ++matches;
+                    }
+                }
+            });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        CHECK(matches == 20);
+    }
+
+    SECTION("thread_pool") {
+        std::vector<int> values(1000);
+        pool->for_each(values.size(), [&values](std::size_t i) {
+            values[i] = static_cast<int>(i) * 2;
+        });
+        for (std::size_t i = 0; i < values.size(); ++i) {
+            CHECK(values[i] == static_cast<int>(i) * 2);
+        }
+        CHECK_THROWS_AS(pool->for_each(10, [](std::size_t i) {
+            if (i == 5) {
+                throw std::runtime_error{"5"};
+            }
+        }), std::runtime_error);
+        thread_pool single{1};
+        CHECK(single.size() == 1);
+        int count = 0;
+        single.for_each(3, [&count](std::size_t) {
+            ++count;
+        });
+        CHECK(count == 3);
+    }
+
+}
+
+TEST_CASE("render_batch") {
+
+    const mustache tmpl{"Dear {{name}},\n{{#items}}\n- {{.}}\n{{/items}}\n{{>footer}}"};
+    std::vector<data> records;
+    for (int i = 0; i < 1000; ++i) {
+        data record;
+        record.set("name", "<" + std::to_string(i) + ">");
+        data items{data::type::list};
+        for (int j = 0; j < i % 3; ++j) {
+            items << std::to_string(j);
+        }
+        record.set("items", items);
+        record.set("footer", partial{[]() {
+            return "Bye {{name}}";
+        }});
+        records.push_back(record);
+    }
+    std::vector<std::string> expected;
+    for (const auto& record : records) {
+        expected.push_back(tmpl.try_render(record).output);
+    }
+
+    SECTION("pool") {
+        thread_pool pool{4};
+        std::vector<std::string> outputs(records.size());
+        const auto result = tmpl.render_batch(records.begin(), records.end(), [&outputs](std::size_t i) {
+            return string_sink{outputs[i]};
+        }, pool);
+        CHECK(result.is_valid());
+        CHECK(result.renders == records.size());
+        CHECK(result.seconds > 0);
+        CHECK(result.renders_per_second() > 0);
+        CHECK(outputs == expected);
+    }
+
+    SECTION("serial") {
+        std::vector<std::string> outputs(records.size());
+        const auto result = tmpl.render_batch(records.begin(), records.end(), [&outputs](std::size_t i) {
+            return string_sink{outputs[i]};
+        });
+        CHECK(result.is_valid());
+        CHECK(result.renders == records.size());
+        CHECK(outputs == expected);
+    }
+
+    SECTION("sink_references") {
+        thread_pool pool{3};
+        std::vector<fragment_sink> sinks(records.size());
+        const auto result = tmpl.render_batch(records.data(), records.data() + records.size(), [&sinks](std::size_t i) -> fragment_sink& {
+            return sinks[i];
+        }, pool);
+        CHECK(result.is_valid());
+        for (std::size_t i = 0; i < sinks.size(); ++i) {
+            CHECK(sinks[i].str() == expected[i]);
+        }
+    }
+
+    SECTION("handler_sinks") {
+        // sinks returned by value are flushed before they're destroyed
+        std::vector<std::string> outputs(records.size());
+        const auto result = tmpl.render_batch(records.begin(), records.end(), [&outputs](std::size_t i) {
+            return handler_sink{[&outputs, i](const std::string& text) {
+                outputs[i] += text;
+            }};
+        });
+        CHECK(result.is_valid());
+        CHECK(outputs == expected);
+    }
+
+    SECTION("sinks_retain_partials") {
+        // every sink keeps the partials it points into, not just the first
+        // one to use them
+        mustache letter{"{{>body}}"};
+        std::vector<data> letters(3, data{"body", "{{name}}\n" + std::string(100, 'x')});
+        std::vector<fragment_sink> sinks(letters.size());
+        const auto result = letter.render_batch(letters.begin(), letters.end(), [&sinks](std::size_t i) -> fragment_sink& {
+            return sinks[i];
+        });
+        CHECK(result.is_valid());
+        letter.invalidate_partials();
+        sinks[0].clear();
+        CHECK(sinks[1].str() == "\n" + std::string(100, 'x'));
+        CHECK(sinks[2].str() == "\n" + std::string(100, 'x'));
+    }
+
+    SECTION("errors") {
+        for (std::size_t i = 0; i < records.size(); i += 100) {
+            records[i].set("footer", partial{[]() {
+                return "{{#name}}";
+            }});
+        }
+        thread_pool pool{4};
+        std::vector<std::string> outputs(records.size());
+        const auto result = tmpl.render_batch(records.begin(), records.end(), [&outputs](std::size_t i) {
+            return string_sink{outputs[i]};
+        }, pool);
+        CHECK_FALSE(result.is_valid());
+        REQUIRE(result.errors.size() == 10);
+        for (std::size_t i = 0; i < result.errors.size(); ++i) {
+            CHECK(result.errors[i].index == i * 100);
+            CHECK(result.errors[i].error_message == "Unclosed section \"name\" at 0");
+        }
+        // the renders after an error start from a clean state
+        CHECK(outputs[1] == expected[1]);
+        CHECK(outputs[101] == expected[101]);
+    }
+
+    SECTION("invalid") {
+        const mustache bad{"{{#a}}"};
+        std::vector<std::string> outputs(3);
+        const auto result = bad.render_batch(records.begin(), records.begin() + 3, [&outputs](std::size_t i) {
+            return string_sink{outputs[i]};
+        });
+        CHECK(result.renders == 3);
+        REQUIRE(result.errors.size() == 3);
+        CHECK(result.errors[2].index == 2);
+        CHECK(result.errors[2].error_message == bad.error_message());
+    }
+
+    SECTION("empty") {
+        thread_pool pool{2};
+        const auto result = tmpl.render_batch(records.begin(), records.begin(), [](std::size_t) {
+            return fixed_buffer_sink{nullptr, 0};
+        }, pool);
+        CHECK(result.renders == 0);
+        CHECK(result.is_valid());
+    }
+
+}
+
+TEST_CASE("fragments") {
+
+    SECTION("references") {
+        const std::string header(100, 'h');
+        const std::string body(200, 'b');
+        const mustache tmpl{header + "{{&body}}<{{escaped}}>{{body}}\n"};
+        data dat;
+        dat.set("body", body);
+        dat.set("escaped", "a&b");
+        fragment_sink sink;
+        CHECK(tmpl.render_to(dat, sink).is_valid());
+        CHECK(sink.str() == header + body + "<a&amp;b>" + body + "\n");
+        CHECK(sink.size() == sink.str().size());
+        // the header and bodies are referenced, the short pieces between
+        // them are copied
+        const auto& frags = sink.fragments();
+        REQUIRE(frags.size() == 5);
+        CHECK(frags[0].size == header.size());
+        CHECK(frags[1].data == dat.get("body")->string_value().data());
+        CHECK(frags[1].size == body.size());
+        CHECK(std::string(frags[2].data, frags[2].size) == "<a&amp;b>");
+        CHECK(frags[3].data == frags[1].data);
+        CHECK(std::string(frags[4].data, frags[4].size) == "\n");
+
+        sink.clear();
+        CHECK(sink.fragments().empty());
+        CHECK(tmpl.render_to(dat, sink).is_valid());
+        CHECK(sink.size() == header.size() + 2 * body.size() + 10);
+    }
+
+    SECTION("copy_all") {
+        const mustache tmpl{"{{#list}}{{.}},{{/list}}"};
+        data dat{"list", list{"a", "b", "c"}};
+        fragment_sink sink{1000};
+        CHECK(tmpl.render_to(dat, sink).is_valid());
+        REQUIRE(sink.fragments().size() == 1);
+        CHECK(sink.str() == "a,b,c,");
+    }
+
+    SECTION("partials") {
+        mustache tmpl{"{{>a}}{{>a}}"};
+        std::string text(100, 'p');
+        data dat{"a", partial{[&text]() {
+            return text;
+        }}};
+        tmpl.set_partial_cache_size(0);
+        fragment_sink sink{0};
+        CHECK(tmpl.render_to(dat, sink).is_valid());
+        tmpl.invalidate_partials();
+        text.assign(100, 'q');
+        CHECK(sink.str() == std::string(200, 'p'));
+    }
+
+#if defined(__unix__) || defined(__APPLE__)
+    SECTION("write_fragments") {
+        const mustache tmpl{"{{#list}}{{.}}-{{/list}}"};
+        data items{data::type::list};
+        std::string expected;
+        for (int i = 0; i < 3000; ++i) {
+            items << std::to_string(i);
+            expected += std::to_string(i) + "-";
+        }
+        const data dat{"list", items};
+        fragment_sink sink{0};
+        CHECK(tmpl.render_to(dat, sink).is_valid());
+        CHECK(sink.fragments().size() > 3000);
+
+        std::FILE* file = std::tmpfile();
+        REQUIRE(file != nullptr);
+        CHECK(write_fragments(fileno(file), sink));
+        std::rewind(file);
+        std::string written(expected.size() + 1, '\0');
+        written.resize(std::fread(&written[0], 1, written.size(), file));
+        std::fclose(file);
+        CHECK(written == expected);
+
+        // nothing to write isn't an error
+        fragment_sink empty{0};
+        CHECK(mustache{"{{missing}}"}.render_to(dat, empty).is_valid());
+        CHECK(write_fragments(fileno(stdout), empty));
+    }
+#endif
+
+}
+
+namespace {
+
+struct bound_address {
+    std::string city;
+    int zip;
+};
+KAINJOW_MUSTACHE_FIELDS(bound_address, city, zip)
+
+struct bound_person {
+    std::string name;
+    unsigned age;
+    double score;
+    bool admin;
+    const char* title;
+    bound_address address;
+    std::vector<std::string> tags;
+    std::vector<bound_address> homes;
+#if defined(KAINJOW_MUSTACHE_OPTIONAL)
+    std::optional<bound_address> office;
+    std::optional<int> rank;
+#endif
+};
+#if defined(KAINJOW_MUSTACHE_OPTIONAL)
+KAINJOW_MUSTACHE_FIELDS(bound_person, name, age, score, admin, title, address, tags, homes, office, rank)
+#else
+KAINJOW_MUSTACHE_FIELDS(bound_person, name, age, score, admin, title, address, tags, homes)
+#endif
+
+struct bound_tree {
+    std::string name;
+    std::vector<bound_tree> children;
+};
+KAINJOW_MUSTACHE_FIELDS(bound_tree, name, children)
+
+struct bound_wide {
+    std::wstring name;
+    std::vector<std::wstring> tags;
+    long count;
+};
+KAINJOW_MUSTACHE_FIELDS(bound_wide, name, tags, count)
+
+}
+
+TEST_CASE("bound_structs") {
+
+    bound_person person;
+    person.name = "Ann <A>";
+    person.age = 42;
+    person.score = 2.5;
+    person.admin = true;
+    person.title = "Dr";
+    person.address = bound_address{"Paris", 75001};
+    person.tags = {"x", "y"};
+    person.homes = {bound_address{"Lyon", 69001}, bound_address{"Nice", 6000}};
+    const data dat = data::bind(person);
+
+    SECTION("fields") {
+        mustache tmpl{"{{title}} {{name}}, {{&name}}, {{age}}, {{score}}{{#admin}}, admin{{/admin}}{{^admin}}, user{{/admin}}{{missing}}"};
+        CHECK(tmpl.render(dat) == "Dr Ann &lt;A&gt;, Ann <A>, 42, 2.5, admin");
+        person.admin = false;
+        CHECK(tmpl.render(dat) == "Dr Ann &lt;A&gt;, Ann <A>, 42, 2.5, user");
+    }
+
+    SECTION("nested") {
+        mustache tmpl{"{{address.city}} {{#address}}{{zip}} {{name}}{{/address}}"};
+        CHECK(tmpl.render(dat) == "Paris 75001 Ann &lt;A&gt;");
+    }
+
+    SECTION("lists") {
+        mustache tmpl{"{{#tags}}{{.}};{{/tags}} {{#homes}}{{city}}/{{zip}}/{{address.city}};{{/homes}}{{^homes}}none{{/homes}}"};
+        CHECK(tmpl.render(dat) == "x;y; Lyon/69001/Paris;Nice/6000/Paris;");
+        person.homes.clear();
+        CHECK(tmpl.render(dat) == "x;y; none");
+    }
+
+#if defined(KAINJOW_MUSTACHE_OPTIONAL)
+    SECTION("optional") {
+        mustache tmpl{"{{#office}}{{city}}{{/office}}{{^office}}remote{{/office}} {{rank}}"};
+        CHECK(tmpl.render(dat) == "remote ");
+        person.office = bound_address{"Berlin", 10115};
+        person.rank = 3;
+        CHECK(tmpl.render(dat) == "Berlin 3");
+    }
+#endif
+
+    SECTION("recursive") {
+        bound_tree tree{"root", {bound_tree{"a", {bound_tree{"a1", {}}}}, bound_tree{"b", {}}}};
+        mustache tmpl{"{{name}}({{#children}}{{>node}}{{/children}})"};
+        data partials{"node", partial{[]() {
+            return "{{name}}({{#children}}{{>node}}{{/children}})";
+        }}};
+        context<std::string> ctx{&partials};
+        const data root = data::bind(tree);
+        ctx.push(&root);
+        CHECK(tmpl.render(ctx) == "root(a(a1())b())");
+    }
+
+    SECTION("wide") {
+        const bound_wide wide{L"<w>", {L"x", L"y"}, 7};
+        mustachew tmpl{L"{{name}} {{#tags}}{{.}}{{/tags}} {{count}}"};
+        CHECK(tmpl.render(dataw::bind(wide)) == L"&lt;w&gt; xy 7");
+    }
+
+    SECTION("lookup_cache") {
+        // names from outside the list are converted once, and stay valid
+        // while the list is rendered
+        person.homes.assign(100, bound_address{"Rome", 100});
+        mustache tmpl{"{{#homes}}{{name}}{{address.city}}{{city}}-{{/homes}}"};
+        std::string expected;
+        for (int i = 0; i < 100; ++i) {
+            expected += "Ann &lt;A&gt;ParisRome-";
+        }
+        CHECK(tmpl.render(dat) == expected);
+    }
+
+    SECTION("fragments") {
+        // string fields are borrowed, so the sink refers to them
+        person.name.assign(200, 'n');
+        mustache tmpl{"{{name}}{{&name}}{{age}}"};
+        fragment_sink sink{0};
+        CHECK(tmpl.render_to(dat, sink).is_valid());
+        CHECK(sink.str() == person.name + person.name + "42");
+        REQUIRE(sink.fragments().size() == 3);
+        CHECK(sink.fragments()[0].data == person.name.data());
+    }
+
+    SECTION("parallel") {
+        std::vector<bound_tree> items;
+        std::string expected;
+        for (int i = 0; i < 5000; ++i) {
+            items.push_back(bound_tree{std::to_string(i), {}});
+            expected += std::to_string(i) + ",";
+        }
+        const bound_tree outer{"outer", items};
+        mustache tmpl{"{{#children}}{{name}},{{/children}}"};
+        tmpl.set_parallel_sections(std::make_shared<thread_pool>(4), 100);
+        CHECK(tmpl.render(data::bind(outer)) == expected);
+    }
+
+}
+
+TEST_CASE("lazy_lists") {
+
+    // Produces rows with ids from 0 to count - 1, counting the sources
+    // opened and the rows pulled
+    class row_source {
+    public:
+        explicit row_source(int a_count) : count(a_count) {}
+        int count;
+        int opened = 0;
+        int pulled = 0;
+        lazy_list rows() {
+            return [this]() -> list_source {
+                ++opened;
+                auto next = std::make_shared<int>(0);
+                return [this, next](data& item) {
+                    if (*next == count) {
+                        return false;
+                    }
+                    ++pulled;
+                    // update the previous row in place
+                    if (!item.is_object() || item.is_empty_object()) {
+                        item = data{"id", ""};
+                    }
+                    item["id"] = std::to_string((*next)++);
+                    return true;
+                };
+            };
+        }
+    };
+
+    SECTION("rows") {
+        row_source source{3};
+        data dat{"rows", source.rows()};
+        dat.set("name", "r");
+        mustache tmpl{"{{#rows}}{{name}}{{id}},{{/rows}}{{^rows}}none{{/rows}}"};
+        CHECK(tmpl.render(dat) == "r0,r1,r2,");
+        CHECK(source.opened == 2);
+        CHECK(source.pulled == 4);
+        CHECK(tmpl.render(dat) == "r0,r1,r2,");
+        CHECK(source.opened == 4);
+    }
+
+    SECTION("inverted_first") {
+        // the item the inverted section pulled is the first one rendered
+        row_source source{3};
+        data dat{"rows", source.rows()};
+        mustache tmpl{"{{^rows}}none{{/rows}}\n{{#rows}}[{{id}}]{{/rows}}{{^rows}}none{{/rows}}"};
+        CHECK(tmpl.render(dat) == "\n[0][1][2]");
+        CHECK(source.opened == 2);
+        CHECK(source.pulled == 4);
+    }
+
+    SECTION("istream") {
+        std::istringstream input{"a b c"};
+        data dat{"rows", make_lazy_list<std::string>(std::istream_iterator<std::string>{input}, std::istream_iterator<std::string>{})};
+        mustache tmpl{"{{^rows}}none{{/rows}}{{#rows}}[{{.}}]{{/rows}}"};
+        CHECK(tmpl.render(dat) == "[a][b][c]");
+    }
+
+    SECTION("empty") {
+        row_source source{0};
+        data dat{"rows", source.rows()};
+        mustache tmpl{"{{#rows}}{{id}}{{/rows}}{{^rows}}none{{/rows}}\n"};
+        CHECK(tmpl.render(dat) == "none\n");
+        CHECK(tmpl.render(data{"rows", lazy_list{}}) == "none\n");
+    }
+
+    SECTION("standalone") {
+        row_source source{2};
+        data dat{"rows", source.rows()};
+        mustache tmpl{"<ul>\n{{#rows}}\n  <li>{{id}}</li>\n{{/rows}}\n</ul>\n"};
+        CHECK(tmpl.render(dat) == "<ul>\n  <li>0</li>\n  <li>1</li>\n</ul>\n");
+    }
+
+    SECTION("nested") {
+        row_source outer{2};
+        row_source inner{2};
+        data dat{"outer", outer.rows()};
+        dat.set("inner", inner.rows());
+        mustache tmpl{"{{#outer}}[{{#inner}}{{id}}{{/inner}}]{{/outer}}"};
+        CHECK(tmpl.render(dat) == "[01][01]");
+        CHECK(inner.opened == 2);
+    }
+
+    SECTION("iterators") {
+        const std::vector<std::string> names{"a", "<b>", "c"};
+        data dat{"names", make_lazy_list<std::string>(names.begin(), names.end())};
+        mustache tmpl{"{{#names}}{{.}};{{/names}}"};
+        CHECK(tmpl.render(dat) == "a;&lt;b&gt;;c;");
+        CHECK(tmpl.render(dat) == "a;&lt;b&gt;;c;");
+    }
+
+    SECTION("chunks") {
+        row_source source{1000};
+        data dat{"rows", source.rows()};
+        mustache tmpl{"{{#rows}}{{id}},{{/rows}}"};
+        const std::string expected = tmpl.render(dat);
+        auto chunks = tmpl.render_chunks(dat, 64);
+        std::string output;
+        while (chunks.next()) {
+            output += chunks.chunk();
+        }
+        CHECK(output == expected);
+    }
+
+    SECTION("fragments") {
+        // each row replaces the last, so the sink copies their strings
+        const std::vector<std::string> rows{std::string(100, 'a'), std::string(100, 'b')};
+        data dat{"rows", make_lazy_list<std::string>(rows.begin(), rows.end())};
+        mustache tmpl{"{{#rows}}{{.}}{{{.}}}{{/rows}}"};
+        fragment_sink sink{0};
+        CHECK(tmpl.render_to(dat, sink).is_valid());
+        CHECK(sink.str() == rows[0] + rows[0] + rows[1] + rows[1]);
+    }
+
+    SECTION("errors") {
+        row_source source{3};
+        data dat{"rows", source.rows()};
+        mustache tmpl{"{{#rows}}{{>bad}}{{/rows}}"};
+        dat.set("bad", partial{[]() {
+            return "{{#unclosed}}";
+        }});
+        context<std::string> ctx{&dat};
+        const auto result = tmpl.try_render(ctx);
+        CHECK_FALSE(result.is_valid());
+        CHECK(source.pulled == 1);
+        CHECK(ctx.get("id") == nullptr);
+    }
+
+}
+
+TEST_CASE("numbers") {
+
+    SECTION("types") {
+        CHECK(data::number(42).is_int64());
+        CHECK(data::number(-7L).is_int64());
+        CHECK(data::number(42u).is_uint64());
+        CHECK(data::number(std::uint64_t{1} << 63).is_uint64());
+        CHECK(data::number(2.5).is_float64());
+        CHECK(data::number(2.5f).is_float64());
+        CHECK(data{true}.is_bool());
+        CHECK(data::number(42).is_number());
+        CHECK_FALSE(data{"42"}.is_number());
+        CHECK(data::number(-7).int64_value() == -7);
+        CHECK(data::number(2.5).float64_value() == 2.5);
+
+        const auto before = allocation_count.load();
+        data copy{data::number(123456789)};
+        data moved{std::move(copy)};
+        CHECK(allocation_count.load() == before);
+        CHECK(moved.int64_value() == 123456789);
+    }
+
+    SECTION("render") {
+        data dat;
+        dat.set("int", data::number(-42));
+        dat.set("min", data::number(std::numeric_limits<std::int64_t>::min()));
+        dat.set("max", data::number(std::numeric_limits<std::uint64_t>::max()));
+        dat.set("half", data::number(0.5));
+        dat.set("tenth", data::number(0.1));
+        dat.set("whole", data::number(3.0));
+        dat.set("big", data::number(1e21));
+        dat.set("small", data::number(-1.25e-7));
+        mustache tmpl{"{{int}} {{min}} {{max}} {{half}} {{tenth}} {{whole}} {{&big}} {{small}}"};
+        CHECK(tmpl.render(dat) == "-42 -9223372036854775808 18446744073709551615 0.5 0.1 3 1e+21 -1.25e-07");
+        // like %g with at least 15 digits, with or without std::to_chars
+        dat.set("e5", data::number(1e5));
+        dat.set("decimal", data::number(1200.0));
+        dat.set("e15", data::number(1e15));
+        dat.set("sum", data::number(0.1 + 0.2));
+        mustache general{"{{e5}} {{decimal}} {{&e15}} {{sum}}"};
+        CHECK(general.render(dat) == "100000 1200 1e+15 0.30000000000000004");
+    }
+
+    SECTION("sections") {
+        // numbers are values like strings, so a zero number renders the
+        // section too
+        data dat;
+        dat.set("zero", data::number(0));
+        dat.set("count", data::number(3u));
+        dat.set("list", list{data::number(1), data::number(2.5), "x"});
+        mustache tmpl{"{{#zero}}[{{.}}]{{/zero}}{{^zero}}no{{/zero}} {{#count}}{{.}}{{/count}} {{#list}}{{.}},{{/list}}"};
+        CHECK(tmpl.render(dat) == "[0] 3 1,2.5,x,");
+    }
+
+    SECTION("bool_conversion") {
+        // plain integers and floating point numbers still convert to bool
+        CHECK(data{0}.is_false());
+        CHECK(data{1}.is_true());
+        CHECK(data{0.0}.is_false());
+        data dat;
+        dat.set("n", 0);
+        dat.set("m", 1);
+        dat.set("u", 2u);
+        mustache tmpl{"{{#n}}n-true{{/n}}{{^n}}n-false{{/n}} {{#m}}m-true{{/m}}{{^m}}m-false{{/m}} [{{m}}] {{#u}}u-true{{/u}}"};
+        CHECK(tmpl.render(dat) == "n-false m-true [] u-true");
+        dat.set("n", data::number(0));
+        dat.set("m", data::number(1));
+        CHECK(tmpl.render(dat) == "n-true m-true [1] u-true");
+    }
+
+    SECTION("standalone") {
+        // buffered lines render the same as with the number as a string
+        const auto render = [](const data& n) {
+            data dat{"n", n};
+            dat.set("p", partial{[]() {
+                return "{{n}}\n";
+            }});
+            mustache tmpl{"  {{>p}}\n{{#n}}\n{{n}}\n{{/n}}\n"};
+            return tmpl.render(dat);
+        };
+        CHECK(render(data::number(5)) == render(data{"5"}));
+    }
+
+    SECTION("wide") {
+        dataw dat{L"n", dataw::number(-12)};
+        dat.set(L"f", dataw::number(0.25));
+        mustachew tmpl{L"{{n}}/{{f}}"};
+        CHECK(tmpl.render(dat) == L"-12/0.25");
+    }
+
+}
+
+TEST_CASE("borrowed_strings") {
+
+    const std::string text = "<b>Tom & \"Jerry\"</b>";
+    const std::string big(1000, 'x');
+
+    SECTION("render") {
+        // renders the same as an owned string
+        mustache tmpl{"{{s}}|{{{s}}}|{{&s}}|{{#s}}{{.}}{{/s}}{{^s}}none{{/s}}\n  {{s}}\n"};
+        CHECK(tmpl.render(data{"s", data::borrow(text)}) == tmpl.render(data{"s", text}));
+        CHECK(data::borrow(text).is_borrowed_string());
+        CHECK_FALSE(data::borrow(text).is_string());
+        CHECK(data::borrow(text).borrowed_string_value() == text);
+    }
+
+    SECTION("string_like") {
+        CHECK(data::borrow(text).is_string_like());
+        CHECK(data{text}.is_string_like());
+        CHECK_FALSE(data{true}.is_string_like());
+        CHECK_FALSE(data::number(1).is_string_like());
+        CHECK(data::borrow(text).text_value() == text);
+        CHECK(data::borrow(text).text_value().data() == text.data());
+        CHECK(data{text}.text_value() == text);
+        CHECK(data{data::type::list}.text_value().empty());
+    }
+
+    SECTION("no_copy") {
+        const auto before = allocation_count.load();
+        data copy{data::borrow(big)};
+        data moved{std::move(copy)};
+        CHECK(allocation_count.load() == before);
+        CHECK(moved.borrowed_string_value().data() == big.data());
+
+        mustache tmpl{"{{s}}"};
+        fragment_sink sink{0};
+        CHECK(tmpl.render_to(data{"s", data::borrow(big)}, sink).is_valid());
+        REQUIRE(sink.fragments().size() == 1);
+        CHECK(sink.fragments()[0].data == big.data());
+    }
+
+    SECTION("custom_escape") {
+        mustache tmpl{"{{s}}"};
+        tmpl.set_custom_escape([](const std::string& s) {
+            return "[" + s + "]";
+        });
+        CHECK(tmpl.render(data{"s", data::borrow(text.data(), 3)}) == "[<b>]");
+    }
+
+    SECTION("partial") {
+        const std::string partial_text = "({{s}})";
+        data dat{"p", data::borrow(partial_text)};
+        dat.set("s", data::borrow(text));
+        mustache tmpl{"{{>p}}"};
+        CHECK(tmpl.render(dat) == "(&lt;b&gt;Tom &amp; &quot;Jerry&quot;&lt;/b&gt;)");
+    }
+
+    SECTION("list") {
+        const std::vector<std::string> words{"a", "<b>"};
+        data items{data::type::list};
+        for (const auto& word : words) {
+            items << data::borrow(word);
+        }
+        mustache tmpl{"{{#items}}{{.}},{{/items}}"};
+        CHECK(tmpl.render(data{"items", items}) == "a,&lt;b&gt;,");
+    }
+
+#if defined(KAINJOW_MUSTACHE_STRING_VIEW)
+    SECTION("string_view") {
+        const std::string_view view{text.data() + 3, 3};
+        mustache tmpl{"{{s}}"};
+        CHECK(tmpl.render(data{"s", data::borrow(view)}) == "Tom");
+    }
+#endif
+
+}
+
+TEST_CASE("json_documents") {
+
+    SECTION("render") {
+        const std::string text = R"({
+            "name": "<Ann>",
+            "count": -1.50e3,
+            "ok": true,
+            "no": false,
+            "nothing": null,
+            "items": [{"x": 1}, {"x": 2}],
+            "nested": {"a": {"b": "deep"}},
+            "empty": []
+        })";
+        json_document doc{text};
+        REQUIRE(doc.is_valid());
+        CHECK(doc.error_message().empty());
+        mustache tmpl{"{{name}} {{{name}}} {{count}}"
+            "|{{#ok}}ok{{/ok}}{{#no}}no{{/no}}{{^nothing}}nothing{{/nothing}}"
+            "|{{#items}}<{{x}}>{{/items}}|{{nested.a.b}}|{{#nested}}{{#a}}{{b}}{{/a}}{{/nested}}"
+            "|{{^empty}}empty{{/empty}}|{{missing}}|{{#items}}{{name}}{{/items}}"};
+        CHECK(tmpl.render(doc.root()) == "&lt;Ann&gt; <Ann> -1500|oknothing|<1><2>|deep|deep|empty||&lt;Ann&gt;&lt;Ann&gt;");
+    }
+
+    SECTION("root") {
+        const std::string list = R"([1, "a", 2.5])";
+        json_document doc{list};
+        REQUIRE(doc.is_valid());
+        CHECK(mustache{"{{#.}}({{.}}){{/.}}"}.render(doc.root()) == "(1)(a)(2.5)");
+        const std::string number = " 42 ";
+        CHECK(json_document{number}.root().int64_value() == 42);
+    }
+
+    SECTION("duplicate_keys") {
+        // the last one wins, as with data::from_json()
+        const std::string text = R"({"a": "first", "b": 1, "a": "second"})";
+        mustache tmpl{"{{a}}"};
+        CHECK(tmpl.render(json_document{text}.root()) == "second");
+        CHECK(tmpl.render(data::from_json(text)) == "second");
+    }
+
+    SECTION("numbers") {
+        // numbers render the same as from data::from_json()
+        const std::string text = R"({"a": 100000.0, "b": 1200.0, "c": 1e5, "d": -0.50, "e": 7})";
+        mustache tmpl{"{{a}} {{b}} {{c}} {{d}} {{e}}"};
+        CHECK(tmpl.render(json_document{text}.root()) == "100000 1200 100000 -0.5 7");
+        CHECK(tmpl.render(data::from_json(text)) == "100000 1200 100000 -0.5 7");
+    }
+
+    SECTION("no_copy") {
+        const std::string text = R"({"s": "plain text", "e": "esc\naped"})";
+        json_document doc{text};
+        mustache tmpl{"{{s}}{{e}}"};
+        fragment_sink sink{0};
+        CHECK(tmpl.render_to(doc.root(), sink).is_valid());
+        REQUIRE(sink.fragments().size() == 2);
+        // strings without escapes point into the text, others are decoded
+        CHECK(sink.fragments()[0].data == text.data() + 7);
+        CHECK(std::string(sink.fragments()[1].data, sink.fragments()[1].size) == "esc\naped");
+    }
+
+    SECTION("escapes") {
+        const std::string text = R"({"s": "\"\\\/\b\f\n\r\t", "u": "\u00e9\u20ac\ud83d\ude00", "k\u0065y": 1})";
+        json_document doc{text};
+        REQUIRE(doc.is_valid());
+        CHECK(mustache{"{{{s}}}"}.render(doc.root()) == "\"\\/\b\f\n\r\t");
+        CHECK(mustache{"{{u}}"}.render(doc.root()) == "\xC3\xA9\xE2\x82\xAC\xF0\x9F\x98\x80");
+        CHECK(mustache{"{{key}}"}.render(doc.root()) == "1");
+    }
+
+    SECTION("lone_surrogates") {
+        // surrogates without their other half become U+FFFD
+        const std::string text = R"({"a": "\ud800", "b": "x\udc00y", "c": "\ud83dA", "d": "\ude00\ud83d", "e": "\u007f"})";
+        json_document doc{text};
+        REQUIRE(doc.is_valid());
+        CHECK(mustache{"{{a}}|{{b}}|{{c}}|{{d}}"}.render(doc.root()) == "\xEF\xBF\xBD|x\xEF\xBF\xBDy|\xEF\xBF\xBD" "A|\xEF\xBF\xBD\xEF\xBF\xBD");
+        CHECK(mustache{"{{e}}"}.render(doc.root()) == "\x7F");
+        const dataw wide = dataw::from_json(std::wstring{LR"(["\ud800", "\ud83d\ude00"])"});
+        CHECK(wide.list_value()[0].string_value() == L"\xFFFD");
+        CHECK(wide.list_value()[1].string_value().size() == (sizeof(wchar_t) == 2 ? 2u : 1u));
+    }
+
+    SECTION("long_strings") {
+        // long enough for the vector scan, with escapes on either side of a block
+        std::string value(100, 'x');
+        value[31] = '\\';
+        value.insert(32, "\"");
+        const std::string text = "{\"s\": \"" + value + "\"}";
+        json_document doc{text};
+        REQUIRE(doc.is_valid());
+        std::string expected(100, 'x');
+        expected[31] = '"';
+        CHECK(mustache{"{{{s}}}"}.render(doc.root()) == expected);
+    }
+
+    SECTION("errors") {
+        const std::vector<std::pair<std::string, std::string>> cases{
+            {"", "Unexpected end of JSON at 0"},
+            {"{", "Expected a string key at 1"},
+            {"[1,]", "Unexpected character at 3"},
+            {"{\"a\" 1}", "Expected ':' at 5"},
+            {"{\"a\": 1 \"b\": 2}", "Expected ',' or '}' at 8"},
+            {"\"abc", "Unterminated string at 4"},
+            {"\"\\x\"", "Invalid escape at 1"},
+            {"\"\\u12g4\"", "Invalid \\u escape at 1"},
+            {"[\"a\tb\"]", "Control character in string at 3"},
+            {"\"\x01\"", "Control character in string at 1"},
+            {"\"" + std::string(40, 'x') + "\n\"", "Control character in string at 41"},
+            {"-", "Invalid number at 1"},
+            {"1.", "Invalid number at 2"},
+            {"01", "Unexpected text after JSON at 1"},
+            {"tru", "Unexpected character at 0"},
+            {"[1] x", "Unexpected text after JSON at 4"},
+            {std::string(600, '['), "JSON nested too deeply at 512"},
+        };
+        for (const auto& c : cases) {
+            json_document doc{c.first};
+            CHECK_FALSE(doc.is_valid());
+            CHECK(doc.error_message() == c.second);
+            CHECK(doc.root().is_false());
+        }
+    }
+
+    SECTION("lazy_arrays") {
+        // items are made as a section reaches them, so strings with escapes
+        // in an array aren't decoded until then
+        const std::string list = R"(["a\u0062", {"x": "c\n"}, 1])";
+        json_document doc{list};
+        REQUIRE(doc.is_valid());
+        const data root = doc.root();
+        REQUIRE(root.is_lazy_list());
+        basic_list_source<std::string> source = root.lazy_list_value()();
+        data item;
+        REQUIRE(source(item));
+        CHECK(item.string_value() == "ab");
+        REQUIRE(source(item));
+        CHECK(item.is_bound());
+        REQUIRE(source(item));
+        CHECK(item.int64_value() == 1);
+        CHECK_FALSE(source(item));
+        mustache tmpl{"{{#.}}[{{#x}}{{.}}{{/x}}{{^x}}{{.}}{{/x}}]{{/.}}"};
+        CHECK(tmpl.render(root) == "[ab][c\n][1]");
+        CHECK(tmpl.render(root) == "[ab][c\n][1]");
+    }
+
+    SECTION("lookup_cache") {
+        const std::string text = R"({"rows": [{"a": "1", "b": "2"}, {"b": "3", "a": "4"}, {"a": "5"}]})";
+        json_document doc{text};
+        mustache tmpl{"{{#rows}}{{a}}{{b}},{{/rows}}"};
+        CHECK(tmpl.render(doc.root()) == "12,43,5,");
+        CHECK(tmpl.render(doc.root()) == "12,43,5,");
+    }
+
+    SECTION("wide") {
+        const std::wstring text = L"{\"name\": \"w\\u00e9\", \"list\": [1, 2]}";
+        basic_json_document<std::wstring> doc{text};
+        REQUIRE(doc.is_valid());
+        CHECK(mustachew{L"{{name}}{{#list}}{{.}}{{/list}}"}.render(doc.root()) == L"w\u00e912");
+    }
+
+}
+
+TEST_CASE("from_json") {
+
+    SECTION("values") {
+        const std::string text = R"({"s": "a\tb", "t": true, "f": false, "n": null, "list": [1, "x", [], {}], "o": {"k": "v"}})";
+        data dat = data::from_json(text);
+        REQUIRE(dat.is_object());
+        CHECK(dat.get("s")->string_value() == "a\tb");
+        CHECK(dat.get("t")->is_true());
+        CHECK(dat.get("f")->is_false());
+        CHECK(dat.get("n")->is_false());
+        const auto& list = dat.get("list")->list_value();
+        REQUIRE(list.size() == 4);
+        CHECK(list[0].int64_value() == 1);
+        CHECK(list[1].string_value() == "x");
+        CHECK(list[2].is_empty_list());
+        CHECK(list[3].is_empty_object());
+        CHECK(dat.get("o")->get("k")->string_value() == "v");
+    }
+
+    SECTION("numbers") {
+        const std::string text = "[0, -0, 42, -42, 9223372036854775807, 9223372036854775808, 18446744073709551615,"
+            " -9223372036854775808, -9223372036854775809, 18446744073709551616, 1.5, -2.5e-3, 1E2, 1e400]";
+        const data dat = data::from_json(text);
+        const auto& n = dat.list_value();
+        REQUIRE(n.size() == 14);
+        CHECK(n[0].int64_value() == 0);
+        CHECK(n[1].int64_value() == 0);
+        CHECK(n[2].int64_value() == 42);
+        CHECK(n[3].int64_value() == -42);
+        CHECK(n[4].int64_value() == std::numeric_limits<std::int64_t>::max());
+        CHECK(n[5].uint64_value() == 9223372036854775808ULL);
+        CHECK(n[6].uint64_value() == std::numeric_limits<std::uint64_t>::max());
+        CHECK(n[7].int64_value() == std::numeric_limits<std::int64_t>::min());
+        CHECK(n[8].float64_value() == -9223372036854775809.0);
+        CHECK(n[9].float64_value() == 18446744073709551616.0);
+        CHECK(n[10].float64_value() == 1.5);
+        CHECK(n[11].float64_value() == -2.5e-3);
+        CHECK(n[12].float64_value() == 100.0);
+        CHECK(n[13].float64_value() == std::numeric_limits<double>::infinity());
+    }
+
+    SECTION("mutable") {
+        const std::string text = R"({"name": "Ann", "tags": ["a"], "name": "Bob"})";
+        data dat = data::from_json(text);
+        // a repeated key keeps the last value
+        CHECK(dat.get("name")->string_value() == "Bob");
+        dat.set("extra", "yes");
+        dat["tags"].push_back(data{"b"});
+        mustache tmpl{"{{name}} {{extra}} {{#tags}}{{.}}{{/tags}}"};
+        CHECK(tmpl.render(dat) == "Bob yes ab");
+    }
+
+    SECTION("same_as_document") {
+        const std::string text = R"({"rows": [{"id": 1, "name": "<a>", "on": true}, {"id": 2, "name": "bé", "on": null}]})";
+        mustache tmpl{"{{#rows}}{{id}} {{name}}{{#on}} on{{/on}}\n{{/rows}}"};
+        json_document doc{text};
+        CHECK(tmpl.render(data::from_json(text)) == tmpl.render(doc.root()));
+        CHECK(tmpl.render(data::from_json(text)) == "1 &lt;a&gt; on\n2 b\xC3\xA9\n");
+    }
+
+    SECTION("errors") {
+        const std::string text = "[1, 2";
+        std::string error;
+        CHECK(data::from_json(text, &error).is_invalid());
+        CHECK(error == "Expected ',' or ']' at 5");
+        CHECK(data::from_json(text).is_invalid());
+        const std::string valid = "[]";
+        CHECK(data::from_json(valid, &error).is_empty_list());
+        CHECK(error.empty());
+    }
+
+#if defined(KAINJOW_MUSTACHE_STRING_VIEW)
+    SECTION("string_view") {
+        const std::string_view text{"{\"a\": 1} trailing", 8};
+        CHECK(data::from_json(text).get("a")->int64_value() == 1);
+    }
+#endif
+
+    SECTION("wide") {
+        const std::wstring text = L"{\"k\": [\"v\\u00e9\", 2.5]}";
+        const dataw dat = dataw::from_json(text);
+        CHECK(dat.get(L"k")->list_value()[0].string_value() == L"vé");
+        CHECK(dat.get(L"k")->list_value()[1].float64_value() == 2.5);
+    }
+
+}
+
+TEST_CASE("shapes") {
+
+    const auto person = shape::make({"name", "age", "email"});
+
+    SECTION("render") {
+        data people{data::type::list};
+        people << data{person, {data{"Ann"}, data::number(30), data{"ann@example.com"}}};
+        people << data{person, {data{"<Bob>"}, data::number(41)}};
+        data dat{"people", people};
+        dat.set("email", "none");
+        mustache tmpl{"{{#people}}{{name}} {{age}} {{email}}\n{{/people}}"};
+        // an unset key is looked up further out, like a missing one
+        CHECK(tmpl.render(dat) == "Ann 30 ann@example.com\n&lt;Bob&gt; 41 none\n");
+    }
+
+    SECTION("values") {
+        data row{person};
+        CHECK(row.is_object());
+        CHECK(row.is_record());
+        CHECK(row.is_empty_object());
+        CHECK(row.get("name") == nullptr);
+        row.set("name", "Ann");
+        CHECK(row.is_non_empty_object());
+        CHECK(row.get("name")->string_value() == "Ann");
+        CHECK(row.try_emplace("name", "Bob")->string_value() == "Ann");
+        CHECK(row.try_emplace("age", data::number(30))->int64_value() == 30);
+        row["email"] = data{"a@example.com"};
+        CHECK(row.is_record());
+        CHECK(row.get("missing") == nullptr);
+
+        const data copy{row};
+        CHECK(copy.is_record());
+        CHECK(copy.get("email")->string_value() == "a@example.com");
+        data moved{std::move(row)};
+        CHECK(moved.get("age")->int64_value() == 30);
+    }
+
+    SECTION("new_key") {
+        // a key the shape doesn't have makes an ordinary object
+        data row{person, {data{"Ann"}}};
+        row.set("phone", "555");
+        CHECK_FALSE(row.is_record());
+        CHECK(row.is_object());
+        CHECK(row.get("name")->string_value() == "Ann");
+        CHECK(row.get("phone")->string_value() == "555");
+        CHECK(row.get("age") == nullptr);
+        CHECK(mustache{"{{name}} {{phone}}"}.render(row) == "Ann 555");
+    }
+
+    SECTION("dotted") {
+        const auto outer = shape::make({"person", "id"});
+        const data dat{outer, {data{person, {data{"Ann"}}}, data::number(7)}};
+        CHECK(mustache{"{{id}} {{person.name}} {{#person}}{{name}}{{id}}{{/person}}"}.render(dat) == "7 Ann Ann7");
+    }
+
+    SECTION("different_shapes") {
+        // the same tags alternate between shapes with the keys in other slots
+        const auto reversed = shape::make({"email", "age", "name"});
+        data rows{data::type::list};
+        for (int i = 0; i < 4; ++i) {
+            const std::string n = std::to_string(i);
+            if (i % 2 == 0) {
+                rows << data{person, {data{"p" + n}, data{i}, data{"e" + n}}};
+            } else {
+                rows << data{reversed, {data{"e" + n}, data{i}, data{"p" + n}}};
+            }
+        }
+        rows << data{object{{"name", "o"}, {"email", "x"}}};
+        mustache tmpl{"{{#rows}}{{name}}{{email}},{{/rows}}"};
+        CHECK(tmpl.render(data{"rows", rows}) == "p0e0,p1e1,p2e2,p3e3,ox,");
+        CHECK(tmpl.render(data{"rows", rows}) == "p0e0,p1e1,p2e2,p3e3,ox,");
+    }
+
+    SECTION("allocations") {
+        list values;
+        values.reserve(3);
+        values.emplace_back("Ann");
+        values.emplace_back(30);
+        values.emplace_back(false);
+        const auto before = allocation_count.load();
+        const data row{person, std::move(values)};
+        // one for the values' owner, none for the keys
+        CHECK(allocation_count.load() - before == 1);
+    }
+
+    SECTION("threads") {
+        const auto other = shape::make({"x", "name"});
+        data a{"rows", data{data::type::list} << data{person, {data{"a"}}}};
+        data b{"rows", data{data::type::list} << data{other, {data::number(1), data{"b"}}}};
+        const mustache tmpl{"{{#rows}}{{name}}{{/rows}}"};
+        std::vector<std::thread> threads;
+        std::atomic<int> wrong{0};
+        for (int t = 0; t < 4; ++t) {
+            threads.emplace_back([&, t] {
+                for (int i = 0; i < 500; ++i) {
+                    const bool first = (i + t) % 2 == 0;
+                    if (tmpl.try_render(first ? a : b).output != (first ? "a" : "b")) {
+                        ++wrong;
+                    }
+                }
+            });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        CHECK(wrong.load() == 0);
+    }
+
+}